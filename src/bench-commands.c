@@ -0,0 +1,206 @@
+/* Copyright (c) 2007-2018 ImapTest authors, see the included COPYING file */
+
+/* Microbenchmark for handling tagged replies to pipelined commands: the
+   old linear commands array vs. the tag-indexed ring used by commands.c.
+   Each reply's "<global_id>.<tag>" is parsed with command_tag_parse() like
+   imap_client_input_args() does. Run with: bench-commands [replies] */
+
+#include "lib.h"
+#include "array.h"
+#include "time-util.h"
+#include "commands.h"
+#include "commands-ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BENCH_DEFAULT_REPLY_COUNT 2000000
+#define BENCH_GLOBAL_ID 1234
+
+struct bench_client {
+	unsigned int tag_counter;
+
+	/* old: pending commands in the order they were sent */
+	ARRAY(struct command *) commands;
+	/* new: pending commands by tag */
+	struct command_ring ring;
+};
+
+struct bench_ops {
+	const char *name;
+	void (*add)(struct bench_client *client, struct command *cmd);
+	struct command *(*lookup)(struct bench_client *client,
+				  unsigned int tag);
+	void (*unlink)(struct bench_client *client, struct command *cmd);
+};
+
+static void bench_linear_add(struct bench_client *client, struct command *cmd)
+{
+	array_append(&client->commands, &cmd, 1);
+}
+
+static struct command *
+bench_linear_lookup(struct bench_client *client, unsigned int tag)
+{
+	struct command *const *cmds;
+	unsigned int i, count;
+
+	cmds = array_get(&client->commands, &count);
+	for (i = 0; i < count; i++) {
+		if (cmds[i]->tag == tag)
+			return cmds[i];
+	}
+	return NULL;
+}
+
+static void
+bench_linear_unlink(struct bench_client *client, struct command *cmd)
+{
+	struct command *const *cmds;
+	unsigned int i, count;
+
+	cmds = array_get(&client->commands, &count);
+	for (i = 0; i < count; i++) {
+		if (cmds[i] == cmd) {
+			array_delete(&client->commands, i, 1);
+			break;
+		}
+	}
+	i_assert(i < count);
+}
+
+static void bench_ring_add(struct bench_client *client, struct command *cmd)
+{
+	command_ring_add(&client->ring, cmd);
+}
+
+static struct command *
+bench_ring_lookup(struct bench_client *client, unsigned int tag)
+{
+	return command_ring_lookup(&client->ring, tag);
+}
+
+static void bench_ring_unlink(struct bench_client *client, struct command *cmd)
+{
+	command_ring_remove(&client->ring, cmd);
+}
+
+static const struct bench_ops bench_linear_ops = {
+	"linear", bench_linear_add, bench_linear_lookup, bench_linear_unlink
+};
+static const struct bench_ops bench_ring_ops = {
+	"ring", bench_ring_add, bench_ring_lookup, bench_ring_unlink
+};
+
+static unsigned int
+bench_send(const struct bench_ops *ops, struct bench_client *client)
+{
+	struct command *cmd;
+
+	cmd = i_new(struct command, 1);
+	cmd->tag = client->tag_counter++;
+	ops->add(client, cmd);
+	return cmd->tag;
+}
+
+static struct command *
+bench_reply(const struct bench_ops *ops, struct bench_client *client,
+	    unsigned int tag)
+{
+	char tagstr[MAX_INT_STRLEN*2 + 2];
+	unsigned int tag_num;
+
+	/* the tagged reply as the parser would give it */
+	if (i_snprintf(tagstr, sizeof(tagstr), "%u.%u",
+		       BENCH_GLOBAL_ID, tag) < 0)
+		i_unreached();
+	if (!command_tag_parse(tagstr, BENCH_GLOBAL_ID, &tag_num))
+		i_unreached();
+	return ops->lookup(client, tag_num);
+}
+
+/* Keep depth commands pipelined. Each reply is for the oldest command,
+   or for a random pending one if in_order is FALSE. Returns replies/sec. */
+static double
+bench_run(const struct bench_ops *ops, unsigned int depth, bool in_order,
+	  unsigned int reply_count)
+{
+	struct bench_client client;
+	struct command *cmd;
+	struct timeval tv_start, tv_end;
+	unsigned int *pending, pending_count = 0, i, idx, tag;
+	unsigned int next_reply_tag = 1;
+	long long usecs;
+
+	i_zero(&client);
+	client.tag_counter = 1;
+	i_array_init(&client.commands, depth);
+	command_ring_init(&client.ring);
+	pending = i_new(unsigned int, depth);
+	srand(depth);
+
+	for (i = 0; i < depth; i++)
+		pending[pending_count++] = bench_send(ops, &client);
+
+	i_gettimeofday(&tv_start);
+	for (i = 0; i < reply_count; i++) {
+		if (in_order)
+			tag = next_reply_tag++;
+		else {
+			idx = rand() % pending_count;
+			tag = pending[idx];
+			pending[idx] = pending[--pending_count];
+		}
+		cmd = bench_reply(ops, &client, tag);
+		i_assert(cmd != NULL);
+		ops->unlink(&client, cmd);
+		i_free(cmd);
+
+		tag = bench_send(ops, &client);
+		if (!in_order)
+			pending[pending_count++] = tag;
+	}
+	i_gettimeofday(&tv_end);
+	usecs = timeval_diff_usecs(&tv_end, &tv_start);
+
+	/* free the commands that are still pending */
+	for (i = 0; i < depth; i++) {
+		tag = in_order ? client.tag_counter - depth + i : pending[i];
+		cmd = ops->lookup(&client, tag);
+		i_assert(cmd != NULL);
+		ops->unlink(&client, cmd);
+		i_free(cmd);
+	}
+	i_free(pending);
+	command_ring_deinit(&client.ring);
+	array_free(&client.commands);
+	return usecs == 0 ? 0 : reply_count * 1000000.0 / usecs;
+}
+
+int main(int argc, char *argv[])
+{
+	static const unsigned int depths[] = { 10, 100, 1000, 10000 };
+	unsigned int i, reply_count = BENCH_DEFAULT_REPLY_COUNT;
+	double linear, ring;
+	int order;
+
+	lib_init();
+	if (argc > 1 && str_to_uint(argv[1], &reply_count) < 0)
+		i_fatal("Usage: bench-commands [replies]");
+
+	printf("%-8s %6s %15s %15s %8s\n", "order", "depth",
+	       "linear/sec", "ring/sec", "speedup");
+	for (order = 0; order < 2; order++) {
+		for (i = 0; i < N_ELEMENTS(depths); i++) {
+			linear = bench_run(&bench_linear_ops, depths[i],
+					   order == 0, reply_count);
+			ring = bench_run(&bench_ring_ops, depths[i],
+					 order == 0, reply_count);
+			printf("%-8s %6u %15.0f %15.0f %7.1fx\n",
+			       order == 0 ? "in-order" : "random", depths[i],
+			       linear, ring, linear == 0 ? 0 : ring / linear);
+		}
+	}
+	lib_deinit();
+	return 0;
+}
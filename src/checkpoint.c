@@ -1,8 +1,10 @@
 /* Copyright (c) 2007-2018 ImapTest authors, see the included COPYING file */
 
 #include "lib.h"
+#include "ioloop.h"
 #include "str.h"
 #include "array.h"
+#include "hash.h"
 #include "mail-types.h"
 #include "settings.h"
 #include "mailbox.h"
@@ -11,19 +13,34 @@
 
 #include <stdlib.h>
 
+/* Compare all the messages instead of only the changed ones at every Nth
+   checkpoint, in case some change was missed */
+#define CHECKPOINT_FULL_INTERVAL 10
+
 struct mailbox_checkpoint_context {
+	/* when the storage's clients started quiescing */
+	uint64_t start_usecs;
 	unsigned int clients_left;
 	bool check_sent:1;
 	bool thread_sent:1;
 };
 
 struct checkpoint_context {
+	/* seq-1 -> UID */
+	uint32_t *uids;
+	unsigned int count;
+
+	/* seq-1 of the messages whose flags are compared. The following
+	   arrays are indexed the same way. */
+	ARRAY(unsigned int) dirty_idxs;
 	struct message_metadata_dynamic *messages;
+	uint8_t **keyword_bitmasks;
+	unsigned int *flag_counts;
+
 	ARRAY(const char *) all_keywords;
+	/* case-insensitive name => all_keywords index + 1 */
+	HASH_TABLE(const char *, void *) all_keywords_hash;
 	ARRAY(unsigned int) cur_keywords_map;
-	uint32_t *uids;
-	unsigned int *flag_counts;
-	unsigned int count;
 
 	const char *thread_reply;
 
@@ -35,29 +52,29 @@ static void
 keyword_map_update(struct checkpoint_context *ctx, struct imap_client *client)
 {
 	const struct mailbox_keyword *kw_my;
-	const char *const *kw_all, *name;
-	unsigned int i, j, my_count, all_count;
+	const char *name;
+	unsigned int i, j, my_count;
+	void *value;
 
 	array_clear(&ctx->cur_keywords_map);
 	kw_my = array_get(&client->view->keywords, &my_count);
-	kw_all = array_get(&ctx->all_keywords, &all_count);
 	for (i = 0; i < my_count; i++) {
-		for (j = 0; j < all_count; j++) {
-			if (strcasecmp(kw_all[j], kw_my[i].name->name) == 0)
-				break;
-		}
-
-		array_append(&ctx->cur_keywords_map, &j, 1);
-		if (j == all_count) {
-			name = kw_my[i].name->name;
+		name = kw_my[i].name->name;
+		value = hash_table_lookup(ctx->all_keywords_hash, name);
+		if (value != NULL)
+			j = POINTER_CAST_TO(value, unsigned int) - 1;
+		else {
 			if (!ctx->first) {
 				i_error("Checkpoint: client %u: "
 					"Missing keyword %s",
 					client->client.idx, name);
 			}
+			j = array_count(&ctx->all_keywords);
 			array_append(&ctx->all_keywords, &name, 1);
-			kw_all = array_get(&ctx->all_keywords, &all_count);
+			hash_table_insert(ctx->all_keywords_hash, name,
+					  POINTER_CAST(j + 1));
 		}
+		array_append(&ctx->cur_keywords_map, &j, 1);
 	}
 }
 
@@ -100,17 +117,13 @@ checkpoint_keywords_to_str(struct checkpoint_context *ctx,
 	return str_c(str);
 }
 
-static void
-checkpoint_update(struct checkpoint_context *ctx, struct imap_client *client)
+static bool
+checkpoint_update_uids(struct checkpoint_context *ctx,
+		       struct imap_client *client)
 {
 	struct mailbox_view *view = client->view;
-	const struct message_metadata_dynamic *msgs;
 	const uint32_t *uids;
-	uint8_t *keywords_remapped;
-	enum mail_flags this_flags, other_flags;
-	unsigned int i, count, dest_keywords_size;
-
-	keyword_map_update(ctx, client);
+	unsigned int i, count;
 
 	uids = array_get(&view->uidmap, &count);
 	if (count != ctx->count) {
@@ -136,10 +149,6 @@ checkpoint_update(struct checkpoint_context *ctx, struct imap_client *client)
 			ctx->thread_reply);
 	}
 
-	msgs = array_get(&view->messages, &count);
-	dest_keywords_size = (array_count(&ctx->all_keywords) + 7) / 8;
-	keywords_remapped = dest_keywords_size == 0 ? NULL :
-		t_malloc_no0(dest_keywords_size);
 	for (i = 0; i < count; i++) {
 		if (uids[i] == 0) {
 			/* we don't have this message's metadata */
@@ -153,38 +162,95 @@ checkpoint_update(struct checkpoint_context *ctx, struct imap_client *client)
 				"Message seq=%u UID %u != %u",
 				client->client.global_id, i + 1,
 				uids[i], ctx->uids[i]);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static void
+checkpoint_find_dirty(struct checkpoint_context *ctx,
+		      struct mailbox_storage *storage, bool full)
+{
+	const struct seq_range *range;
+	unsigned int i, r, range_count;
+
+	range = array_get(&storage->checkpoint_dirty_uids, &range_count);
+	for (i = r = 0; i < ctx->count; i++) {
+		if (ctx->uids[i] == 0)
+			continue;
+		if (!full) {
+			/* the UIDs are ascending */
+			while (r < range_count &&
+			       range[r].seq2 < ctx->uids[i])
+				r++;
+			if (r == range_count)
+				break;
+			if (range[r].seq1 > ctx->uids[i])
+				continue;
+		}
+		array_append(&ctx->dirty_idxs, &i, 1);
+	}
+}
+
+static void
+checkpoint_update_flags(struct checkpoint_context *ctx,
+			struct imap_client *client)
+{
+	struct mailbox_view *view = client->view;
+	const struct message_metadata_dynamic *msgs;
+	const unsigned int *dirty_idxs;
+	const uint32_t *uids;
+	uint8_t *keywords_remapped;
+	enum mail_flags this_flags, other_flags;
+	unsigned int i, j, count, dirty_count, dest_keywords_size;
+
+	keyword_map_update(ctx, client);
+
+	uids = array_get(&view->uidmap, &count);
+	msgs = array_get(&view->messages, &count);
+	dest_keywords_size = (array_count(&ctx->all_keywords) + 7) / 8;
+	keywords_remapped = dest_keywords_size == 0 ? NULL :
+		t_malloc_no0(dest_keywords_size);
+	dirty_idxs = array_get(&ctx->dirty_idxs, &dirty_count);
+	for (j = 0; j < dirty_count; j++) {
+		i = dirty_idxs[j];
+		if (i >= count)
 			break;
+		if (uids[i] == 0) {
+			/* we don't have this message's metadata */
+			continue;
 		}
 
 		if (msgs[i].modseq != 0) {
 			/* modseq set */
-			if (ctx->messages[i].modseq == 0)
-				ctx->messages[i].modseq = msgs[i].modseq;
-			else if (ctx->messages[i].modseq != msgs[i].modseq) {
+			if (ctx->messages[j].modseq == 0)
+				ctx->messages[j].modseq = msgs[i].modseq;
+			else if (ctx->messages[j].modseq != msgs[i].modseq) {
 				ctx->errors = TRUE;
 				i_error("Checkpoint: client %u: "
 					"Message seq=%u UID=%u "
 					"modseqs differ: %s vs %s",
 					client->client.global_id, i + 1, uids[i],
 					dec2str(msgs[i].modseq),
-					dec2str(ctx->messages[i].modseq));
+					dec2str(ctx->messages[j].modseq));
 			}
 		}
 
 		if ((msgs[i].mail_flags & MAIL_FLAGS_SET) == 0)
 			continue;
 
-		keywords_remap(ctx, msgs[i].keyword_bitmask,
+		keywords_remap(ctx, mailbox_view_get_keywords(view, i + 1),
 			       keywords_remapped, dest_keywords_size);
-		ctx->flag_counts[i]++;
-		if ((ctx->messages[i].mail_flags & MAIL_FLAGS_SET) == 0) {
+		ctx->flag_counts[j]++;
+		if ((ctx->messages[j].mail_flags & MAIL_FLAGS_SET) == 0) {
 			/* first one to set flags */
-			ctx->messages[i].mail_flags = msgs[i].mail_flags;
-			ctx->messages[i].keyword_bitmask =
+			ctx->messages[j].mail_flags = msgs[i].mail_flags;
+			ctx->keyword_bitmasks[j] =
 				dest_keywords_size == 0 ? NULL :
 				i_malloc(dest_keywords_size);
 			if (dest_keywords_size > 0) {
-				memcpy(ctx->messages[i].keyword_bitmask,
+				memcpy(ctx->keyword_bitmasks[j],
 				       keywords_remapped, dest_keywords_size);
 			}
 			continue;
@@ -192,8 +258,8 @@ checkpoint_update(struct checkpoint_context *ctx, struct imap_client *client)
 
 		if ((msgs[i].mail_flags & MAIL_RECENT) != 0 &&
 		    !view->storage->dont_track_recent) {
-			if ((ctx->messages[i].mail_flags & MAIL_RECENT) == 0)
-				ctx->messages[i].mail_flags |= MAIL_RECENT;
+			if ((ctx->messages[j].mail_flags & MAIL_RECENT) == 0)
+				ctx->messages[j].mail_flags |= MAIL_RECENT;
 			else {
 				i_error("Checkpoint: client %u: "
 					"Message seq=%u UID=%u "
@@ -204,7 +270,7 @@ checkpoint_update(struct checkpoint_context *ctx, struct imap_client *client)
 		}
 
 		this_flags = msgs[i].mail_flags & ~MAIL_RECENT;
-		other_flags = ctx->messages[i].mail_flags & ~MAIL_RECENT;
+		other_flags = ctx->messages[j].mail_flags & ~MAIL_RECENT;
 		if (this_flags != other_flags) {
 			ctx->errors = TRUE;
 			i_error("Checkpoint: client %u: Message seq=%u UID=%u "
@@ -213,14 +279,14 @@ checkpoint_update(struct checkpoint_context *ctx, struct imap_client *client)
 				mail_flags_to_str(this_flags),
 				mail_flags_to_str(other_flags));
 		}
-		if (memcmp(keywords_remapped, ctx->messages[i].keyword_bitmask,
+		if (memcmp(keywords_remapped, ctx->keyword_bitmasks[j],
 			   dest_keywords_size) != 0) {
 			ctx->errors = TRUE;
 			i_error("Checkpoint: client %u: Message seq=%u UID=%u "
 				"keywords differ: (%s) vs (%s)",
 				client->client.global_id, i + 1, uids[i],
 				checkpoint_keywords_to_str(ctx, keywords_remapped),
-				checkpoint_keywords_to_str(ctx, ctx->messages[i].keyword_bitmask));
+				checkpoint_keywords_to_str(ctx, ctx->keyword_bitmasks[j]));
 		}
 	}
 }
@@ -228,20 +294,23 @@ checkpoint_update(struct checkpoint_context *ctx, struct imap_client *client)
 static void checkpoint_check_missing_recent(struct checkpoint_context *ctx,
 					    unsigned int min_uidnext)
 {
-	unsigned int i, client_count = array_count(&clients);
+	const unsigned int *dirty_idxs;
+	unsigned int i, j, dirty_count, client_count = array_count(&clients);
 
 	/* find the first message that we know were created by ourself */
-	for (i = 0; i < ctx->count; i++) {
-		if (ctx->uids[i] > min_uidnext)
+	dirty_idxs = array_get(&ctx->dirty_idxs, &dirty_count);
+	for (j = 0; j < dirty_count; j++) {
+		if (ctx->uids[dirty_idxs[j]] > min_uidnext)
 			break;
 	}
 
 	/* make sure \Recent flag is found from all of them */
-	for (; i < ctx->count; i++) {
-		if (ctx->flag_counts[i] != client_count ||
-		    (ctx->messages[i].mail_flags & MAIL_FLAGS_SET) == 0)
+	for (; j < dirty_count; j++) {
+		i = dirty_idxs[j];
+		if (ctx->flag_counts[j] != client_count ||
+		    (ctx->messages[j].mail_flags & MAIL_FLAGS_SET) == 0)
 			continue;
-		if ((ctx->messages[i].mail_flags & MAIL_RECENT) == 0) {
+		if ((ctx->messages[j].mail_flags & MAIL_RECENT) == 0) {
 			i_error("Checkpoint: Message seq=%u UID=%u "
 				"isn't \\Recent anywhere", i + 1, ctx->uids[i]);
 		}
@@ -251,14 +320,11 @@ static void checkpoint_check_missing_recent(struct checkpoint_context *ctx,
 static void checkpoint_send_state_cmd(struct mailbox_storage *storage,
 				      enum client_state state)
 {
-	struct client *const *c;
-	unsigned int i, count;
-
-	c = array_get(&clients, &count);
-	for (i = 0; i < count; i++) {
-		struct imap_client *client = imap_client(c[i]);
+	struct imap_client *client, *next;
 
-		if (client == NULL || client->checkpointing != storage)
+	for (client = storage->clients_head; client != NULL; client = next) {
+		next = client->storage_next;
+		if (client->checkpointing != storage)
 			continue;
 
 		/* send the checkpoint command */
@@ -272,18 +338,17 @@ static void checkpoint_send_state_cmd(struct mailbox_storage *storage,
 void checkpoint_neg(struct mailbox_storage *storage)
 {
 	struct checkpoint_context ctx;
-	struct client *const *c;
+	struct imap_client *client, *next;
+	ARRAY(struct imap_client *) uid_clients;
 	unsigned int min_uidnext = UINT_MAX, max_msgs_count = 0;
-	unsigned int i, count, check_count = 0;
+	unsigned int i, dirty_count, check_count = 0;
 	unsigned int recent_total;
-	bool orig_dont_track_recent = storage->dont_track_recent;
+	bool full, orig_dont_track_recent = storage->dont_track_recent;
 
 	i_assert(storage->checkpoint->clients_left > 0);
 	if (--storage->checkpoint->clients_left > 0)
 		return;
 
-	c = array_get(&clients, &count);
-
 	if (!storage->checkpoint->check_sent) {
 		/* everyone's finally finished their commands. now send CHECK
 		   to make sure everyone sees each others' changes */
@@ -308,12 +373,12 @@ void checkpoint_neg(struct mailbox_storage *storage)
 
 	/* get maximum number of messages in mailbox */
 	recent_total = 0;
-	for (i = 0; i < count; i++) {
-		struct imap_client *client = imap_client(c[i]);
-		if (client == NULL || client->checkpointing != storage)
+	for (client = storage->clients_head; client != NULL;
+	     client = client->storage_next) {
+		if (client->checkpointing != storage)
 			continue;
 
-		i_assert(array_count(&client->commands) == 0);
+		i_assert(client->commands_count == 0);
 		if (client->view->select_uidnext != 0) {
 			min_uidnext = I_MIN(min_uidnext,
 					    client->view->select_uidnext);
@@ -326,26 +391,44 @@ void checkpoint_neg(struct mailbox_storage *storage)
 	/* make sure everyone has the same idea of what the mailbox
 	   looks like */
 	i_zero(&ctx);
+	full = storage->checkpoint_full ||
+		storage->checkpoints_since_full + 1 >= CHECKPOINT_FULL_INTERVAL;
 	if (max_msgs_count > 0) {
 		ctx.count = max_msgs_count;
-		ctx.messages = i_new(struct message_metadata_dynamic,
-				     ctx.count);
 		ctx.uids = i_new(uint32_t, ctx.count);
-		ctx.flag_counts = i_new(uint32_t, ctx.count);
-		ctx.first = TRUE;
-		i_array_init(&ctx.all_keywords, 32);
-		i_array_init(&ctx.cur_keywords_map, 32);
-		for (i = 0; i < count; i++) {
-			struct imap_client *client = imap_client(c[i]);
-			if (client == NULL || client->checkpointing != storage)
+		i_array_init(&uid_clients, 32);
+		for (client = storage->clients_head; client != NULL;
+		     client = client->storage_next) {
+			if (client->checkpointing != storage)
 				continue;
 
 			check_count++;
-			checkpoint_update(&ctx, client);
+			if (checkpoint_update_uids(&ctx, client))
+				array_append(&uid_clients, &client, 1);
+		}
+
+		/* compare flags only for the messages that have changed */
+		i_array_init(&ctx.dirty_idxs, full ? ctx.count : 64);
+		checkpoint_find_dirty(&ctx, storage, full);
+		dirty_count = array_count(&ctx.dirty_idxs);
+		if (dirty_count > 0) {
+			ctx.messages = i_new(struct message_metadata_dynamic,
+					     dirty_count);
+			ctx.keyword_bitmasks = i_new(uint8_t *, dirty_count);
+			ctx.flag_counts = i_new(uint32_t, dirty_count);
+		}
+		ctx.first = TRUE;
+		i_array_init(&ctx.all_keywords, 32);
+		hash_table_create(&ctx.all_keywords_hash, default_pool, 0,
+				  strcase_hash, strcasecmp);
+		i_array_init(&ctx.cur_keywords_map, 32);
+		array_foreach_elem(&uid_clients, client) {
+			checkpoint_update_flags(&ctx, client);
 			ctx.first = FALSE;
 		}
-		for (i = 0; i < ctx.count; i++)
-			i_free(ctx.messages[i].keyword_bitmask);
+		array_free(&uid_clients);
+		for (i = 0; i < dirty_count; i++)
+			i_free(ctx.keyword_bitmasks[i]);
 
 		if (total_disconnects == 0 && min_uidnext != 0 &&
 		    !storage->dont_track_recent) {
@@ -367,28 +450,39 @@ void checkpoint_neg(struct mailbox_storage *storage)
 			storage->dont_track_recent = TRUE;
 		}
 		array_free(&ctx.all_keywords);
+		hash_table_destroy(&ctx.all_keywords_hash);
 		array_free(&ctx.cur_keywords_map);
+		array_free(&ctx.dirty_idxs);
 		i_free(ctx.flag_counts);
 		i_free(ctx.uids);
 		i_free(ctx.messages);
+		i_free(ctx.keyword_bitmasks);
 	}
 	if (!ctx.errors)
 		counters[STATE_CHECKPOINT] += check_count;
+	array_clear(&storage->checkpoint_dirty_uids);
+	if (full) {
+		storage->checkpoint_full = FALSE;
+		storage->checkpoints_since_full = 0;
+	} else
+		storage->checkpoints_since_full++;
+	/* the time the storage's clients were paused is reported as the
+	   checkpoint latency, separately from the commands' latencies */
+	client_state_add_to_timer(STATE_CHECKPOINT,
+				  storage->checkpoint->start_usecs, 0);
 	if (conf.error_quit && (ctx.errors || storage->dont_track_recent))
 		lib_exit(2);
 
 	/* checkpointing is done - continue normal commands */
-	for (i = 0; i < count; i++) {
-		struct imap_client *client = imap_client(c[i]);
-		if (client == NULL)
-			continue;
+	for (client = storage->clients_head; client != NULL; client = next) {
+		next = client->storage_next;
 		if (client->checkpointing == storage)
 			client->checkpointing = NULL;
 
-		if (array_count(&client->commands) == 0 &&
+		if (client->commands_count == 0 &&
 		    client->client.state != STATE_BANNER) {
 			(void)client_send_more_commands(&client->client);
-			i_assert(array_count(&client->commands) > 0);
+			i_assert(client->commands_count > 0);
 		}
 	}
 
@@ -400,29 +494,95 @@ void checkpoint_neg(struct mailbox_storage *storage)
 
 void clients_checkpoint(struct mailbox_storage *storage)
 {
-	struct client *const *c;
-	unsigned int i, count;
+	struct imap_client *client;
 
 	if (storage->checkpoint != NULL)
 		return;
 
 	storage->checkpoint = i_new(struct mailbox_checkpoint_context, 1);
+	storage->checkpoint->start_usecs = client_state_timer_now();
 
-	c = array_get(&clients, &count);
-	for (i = 0; i < count; i++) {
-		struct imap_client *client = imap_client(c[i]);
-		if (client == NULL ||
-		    client->client.login_state != LSTATE_SELECTED)
+	for (client = storage->clients_head; client != NULL;
+	     client = client->storage_next) {
+		if (client->client.login_state != LSTATE_SELECTED)
 			continue;
 
-		if (client->storage == storage) {
-			client->checkpointing = storage;
-			if (array_count(&client->commands) > 0)
-				storage->checkpoint->clients_left++;
-		}
+		client->checkpointing = storage;
+		if (client->commands_count > 0)
+			storage->checkpoint->clients_left++;
 	}
 	if (storage->checkpoint->clients_left == 0) {
 		storage->checkpoint->clients_left++;
 		checkpoint_neg(storage);
 	}
 }
+
+static struct priorityq *checkpoint_queue;
+
+static int checkpoint_schedule_cmp(const void *p1, const void *p2)
+{
+	const struct mailbox_checkpoint_schedule *s1 = p1, *s2 = p2;
+
+	if (s1->time < s2->time)
+		return -1;
+	return s1->time > s2->time ? 1 : 0;
+}
+
+void checkpoint_storage_add(struct mailbox_storage *storage)
+{
+	struct mailbox_checkpoint_schedule *sched =
+		&storage->checkpoint_schedule;
+
+	if (checkpoint_queue == NULL)
+		return;
+
+	/* stagger the storages so they aren't all checkpointed at once */
+	sched->storage = storage;
+	sched->time = ioloop_time + 1 +
+		i_rand_limit(conf.checkpoint_interval);
+	priorityq_add(checkpoint_queue, &sched->item);
+}
+
+void checkpoint_storage_remove(struct mailbox_storage *storage)
+{
+	if (checkpoint_queue != NULL)
+		(void)priorityq_remove(checkpoint_queue,
+				       &storage->checkpoint_schedule.item);
+}
+
+void checkpoints_run(void)
+{
+	struct mailbox_checkpoint_schedule *sched;
+
+	if (checkpoint_queue == NULL)
+		return;
+
+	while ((sched = (struct mailbox_checkpoint_schedule *)
+		priorityq_peek(checkpoint_queue)) != NULL &&
+	       sched->time <= ioloop_time) {
+		/* reschedule first, since checkpointing may end up
+		   freeing the storage */
+		(void)priorityq_pop(checkpoint_queue);
+		sched->time = ioloop_time + conf.checkpoint_interval;
+		priorityq_add(checkpoint_queue, &sched->item);
+
+		clients_checkpoint(sched->storage);
+	}
+}
+
+void checkpoints_init(void)
+{
+	if (conf.checkpoint_interval > 0) {
+		checkpoint_queue =
+			priorityq_init(checkpoint_schedule_cmp, 128);
+	}
+}
+
+void checkpoints_deinit(void)
+{
+	if (checkpoint_queue == NULL)
+		return;
+
+	while (priorityq_pop(checkpoint_queue) != NULL) ;
+	priorityq_deinit(&checkpoint_queue);
+}
@@ -4,4 +4,14 @@
 void clients_checkpoint(struct mailbox_storage *storage);
 void checkpoint_neg(struct mailbox_storage *storage);
 
+/* Storages are checkpointed one at a time every checkpoint_interval,
+   spread randomly across the interval. */
+void checkpoint_storage_add(struct mailbox_storage *storage);
+void checkpoint_storage_remove(struct mailbox_storage *storage);
+/* Start checkpointing the storages whose turn it is. */
+void checkpoints_run(void);
+
+void checkpoints_init(void);
+void checkpoints_deinit(void);
+
 #endif
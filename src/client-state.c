@@ -4,7 +4,6 @@
 #include "base64.h"
 #include "str.h"
 #include "strescape.h"
-#include "time-util.h"
 #include "istream.h"
 #include "ostream.h"
 #include "imap-date.h"
@@ -20,8 +19,10 @@
 #include "search.h"
 #include "imap-client.h"
 #include "client-state.h"
+#include "rate.h"
 
 #include <stdlib.h>
+#include <time.h>
 
 struct state states[] = {
 	{ "BANNER",	  "Bann", LSTATE_NONAUTH,  0,   0,  0 },
@@ -56,8 +57,9 @@ struct state states[] = {
 static_assert_array_size(states, STATE_COUNT);
 
 unsigned int counters[STATE_COUNT], total_counters[STATE_COUNT];
-unsigned int timer_counts[STATE_COUNT];
-unsigned long long timers[STATE_COUNT];
+struct histogram latencies[STATE_COUNT], total_latencies[STATE_COUNT];
+struct histogram response_latencies[STATE_COUNT];
+struct histogram total_response_latencies[STATE_COUNT];
 
 bool do_rand(enum client_state state)
 {
@@ -69,19 +71,29 @@ bool do_rand_again(enum client_state state)
 	return (i_rand_limit(100)) < states[state].probability_again;
 }
 
-void client_state_add_to_timer(enum client_state state,
-			       const struct timeval *tv_start)
+uint64_t client_state_timer_now(void)
 {
-	struct timeval tv_end;
-	int diff;
-
-	i_gettimeofday(&tv_end);
-	diff = timeval_diff_msecs(&tv_end, tv_start);
-	if (diff < 0)
-		diff = 0;
-	i_assert((unsigned int)diff < ULLONG_MAX - timers[state]);
-	timers[state] += diff;
-	timer_counts[state]++;
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		i_fatal("clock_gettime(CLOCK_MONOTONIC) failed: %m");
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void client_state_add_to_timer(enum client_state state, uint64_t start_usecs,
+			       uint64_t intended_usecs)
+{
+	uint64_t now = client_state_timer_now();
+	uint64_t diff = now > start_usecs ? now - start_usecs : 0;
+
+	histogram_add(&latencies[state], diff);
+	histogram_add(&total_latencies[state], diff);
+
+	if (intended_usecs != 0) {
+		diff = now > intended_usecs ? now - intended_usecs : 0;
+		histogram_add(&response_latencies[state], diff);
+		histogram_add(&total_response_latencies[state], diff);
+	}
 }
 
 static void auth_plain_callback(struct imap_client *client, struct command *cmd,
@@ -180,13 +192,12 @@ client_get_pending_cmd_flags(struct imap_client *client,
 			     enum login_state *new_lstate_r)
 {
 	enum state_flags state_flags = 0;
-	struct command *const *cmds;
-	unsigned int i, count;
+	struct command *cmd;
+	unsigned int iter = 0;
 
 	*new_lstate_r = client->client.login_state;
-	cmds = array_get(&client->commands, &count);
-	for (i = 0; i < count; i++) {
-		enum state_flags flags = states[cmds[i]->state].flags;
+	while ((cmd = command_iter_next(client, &iter)) != NULL) {
+		enum state_flags flags = states[cmd->state].flags;
 
 		if ((flags & FLAG_STATECHANGE) != 0)
 			*new_lstate_r = flags2login_state(flags);
@@ -258,17 +269,16 @@ static bool client_pending_cmds_allow_statechange(struct imap_client *client,
 						  enum client_state state)
 {
 	enum login_state old_lstate, new_lstate = 0;
-	struct command *const *cmds;
-	unsigned int i, count;
+	struct command *cmd;
+	unsigned int iter = 0;
 
 	new_lstate = flags2login_state(states[state].flags);
 
-	cmds = array_get(&client->commands, &count);
-	for (i = 0; i < count; i++) {
-		if ((states[cmds[i]->state].flags & FLAG_STATECHANGE) != 0)
+	while ((cmd = command_iter_next(client, &iter)) != NULL) {
+		if ((states[cmd->state].flags & FLAG_STATECHANGE) != 0)
 			return FALSE;
 
-		old_lstate = states[cmds[i]->state].login_state;
+		old_lstate = states[cmd->state].login_state;
 		if (new_lstate < old_lstate)
 			return FALSE;
 		if (new_lstate == old_lstate && new_lstate == LSTATE_SELECTED)
@@ -283,14 +293,21 @@ int imap_client_plan_send_more_commands(struct client *_client)
 	enum state_flags pending_flags;
 	enum login_state new_lstate;
 	enum client_state state;
+	bool sent = FALSE, wait_slot = FALSE;
+	int ret;
 
-	while (array_count(&client->commands) < MAX_COMMAND_QUEUE_LEN) {
+	while (client->commands_count < MAX_COMMAND_QUEUE_LEN) {
+		if (conf.rate > 0 && client->rate_slot_usecs == 0) {
+			/* open-loop mode: wait for the next slot */
+			wait_slot = TRUE;
+			break;
+		}
 		state = client_update_plan(client);
 		i_assert(state <= STATE_LOGOUT);
 
 		if (client->append_unfinished)
 			break;
-		if (conf.no_pipelining && array_count(&client->commands) > 0)
+		if (conf.no_pipelining && client->commands_count > 0)
 			break;
 
 		if ((states[state].flags & FLAG_STATECHANGE) != 0) {
@@ -322,11 +339,22 @@ int imap_client_plan_send_more_commands(struct client *_client)
 			continue;
 		}
 
-		if (imap_client_plan_send_next_cmd(client) < 0)
+		client->cmd_intended_usecs = client->rate_slot_usecs;
+		ret = imap_client_plan_send_next_cmd(client);
+		client->cmd_intended_usecs = 0;
+		if (client->rate_slot_usecs != 0) {
+			client->rate_slot_usecs = 0;
+			rate_client_wakeup(_client);
+		}
+		if (ret < 0)
 			return -1;
+		sent = TRUE;
 	}
 
-	if (!_client->delayed && do_rand(STATE_DELAY)) {
+	/* in open-loop mode we're called on every reply, but only the ones
+	   that got a slot should be able to delay the client */
+	if ((sent || !wait_slot) &&
+	    !_client->delayed && do_rand(STATE_DELAY)) {
 		counters[STATE_DELAY]++;
 		client_delay(&client->client, i_rand_limit(DELAY_MSECS));
 	}
@@ -556,11 +584,13 @@ store_verify_seq(struct store_verify_context *ctx, uint32_t seq)
 {
 	struct message_metadata_dynamic *metadata;
 	enum mail_flags test_flags, test_flags_result;
+	const uint8_t *keyword_bitmask;
 	const char *expunge_state;
 	unsigned int i;
 	bool ret, set, fail, mask;
 
 	metadata = array_idx_modifiable(&ctx->client->view->messages, seq - 1);
+	keyword_bitmask = mailbox_view_get_keywords(ctx->client->view, seq);
 	expunge_state = metadata->ms == NULL ? "?" :
 		metadata->ms->expunged ? "yes" : "no";
 	if ((metadata->mail_flags & MAIL_FLAGS_SET) == 0 ||
@@ -595,7 +625,7 @@ store_verify_seq(struct store_verify_context *ctx, uint32_t seq)
 	ret = TRUE;
 	for (i = 0; i < ctx->max_keyword_bit; i++) {
 		set = i/8 < ctx->client->view->keyword_bitmask_alloc_size ?
-			(metadata->keyword_bitmask[i/8] & (1 << (i%8))) != 0 :
+			(keyword_bitmask[i/8] & (1 << (i%8))) != 0 :
 			FALSE;
 		mask = (ctx->keywords_bitmask[i/8] & (1 << (i%8))) != 0;
 		switch (ctx->type) {
@@ -1440,7 +1470,7 @@ void imap_client_cmd_reply_finish(struct imap_client *client)
 {
 	if (client->checkpointing != NULL) {
 		/* we're checkpointing */
-		if (array_count(&client->commands) > 0)
+		if (client->commands_count > 0)
 			return;
 
 		checkpoint_neg(client->storage);
@@ -2,9 +2,9 @@
 #define CLIENT_STATE_H
 
 #include "seq-range-array.h"
+#include "histogram.h"
 
 enum command_reply;
-struct timeval;
 struct client;
 struct imap_client;
 struct command;
@@ -80,13 +80,20 @@ typedef void command_callback_t(struct imap_client *client, struct command *cmd,
 
 extern struct state states[STATE_COUNT];
 extern unsigned int counters[STATE_COUNT], total_counters[STATE_COUNT];
-extern unsigned int timer_counts[STATE_COUNT];
-extern unsigned long long timers[STATE_COUNT];
+/* command latencies in microseconds since the last report, and in total */
+extern struct histogram latencies[STATE_COUNT], total_latencies[STATE_COUNT];
+/* with rate=, latencies measured from the commands' intended start times */
+extern struct histogram response_latencies[STATE_COUNT];
+extern struct histogram total_response_latencies[STATE_COUNT];
 
 bool do_rand(enum client_state state);
 bool do_rand_again(enum client_state state);
-void client_state_add_to_timer(enum client_state state,
-			       const struct timeval *tv_start);
+/* Returns the current monotonic time in microseconds. */
+uint64_t client_state_timer_now(void);
+/* Add the command's service time (since start_usecs) and, if intended_usecs
+   isn't 0, its response time (since intended_usecs). */
+void client_state_add_to_timer(enum client_state state, uint64_t start_usecs,
+			       uint64_t intended_usecs);
 
 int imap_client_append(struct imap_client *client, const char *args, bool add_datetime,
 		       command_callback_t *callback, struct command **cmd_r);
@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "ioloop.h"
+#include "llist.h"
 #include "array.h"
 #include "istream.h"
 #include "ostream.h"
@@ -22,24 +23,123 @@
 #include "search.h"
 #include "test-exec.h"
 #include "client.h"
+#include "worker.h"
+#include "source-ips.h"
+#include "rate.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 
 int clients_count = 0;
+unsigned int clients_parked_count = 0;
+unsigned int clients_banner_waits = 0;
+struct client *clients_by_last_io = NULL;
 unsigned int total_disconnects = 0;
 ARRAY_TYPE(client) clients;
 ARRAY(unsigned int) stalled_clients;
 bool stalled = FALSE, disconnect_clients = FALSE, no_new_clients = FALSE;
 
-static unsigned int client_min_free_idx = 0;
+/* Indexes of clients that have been freed. Some of them may have been
+   reused already by client_new_random(). */
+static ARRAY(unsigned int) client_free_idx;
 static unsigned int global_id_counter = 0;
+static struct client *clients_by_last_io_tail = NULL;
 static struct ssl_iostream_context *ssl_ctx = NULL;
 
-static void client_input(struct client *client)
+static int client_output(struct client *client);
+
+void client_update_last_io(struct client *client)
 {
+	if (client->last_io_tracked) {
+		/* the list is ordered by last_io, so if it's already
+		   ioloop_time the client doesn't need to be moved */
+		if (client->last_io == ioloop_time)
+			return;
+		DLLIST2_REMOVE_FULL(&clients_by_last_io,
+				    &clients_by_last_io_tail, client,
+				    last_io_prev, last_io_next);
+	}
 	client->last_io = ioloop_time;
+	DLLIST2_APPEND_FULL(&clients_by_last_io, &clients_by_last_io_tail,
+			    client, last_io_prev, last_io_next);
+	client->last_io_tracked = TRUE;
+}
+
+void client_last_io_untrack(struct client *client)
+{
+	if (!client->last_io_tracked)
+		return;
+	DLLIST2_REMOVE_FULL(&clients_by_last_io, &clients_by_last_io_tail,
+			    client, last_io_prev, last_io_next);
+	client->last_io_tracked = FALSE;
+}
+
+void client_banner_received(struct client *client)
+{
+	if (client->banner_wait) {
+		client->banner_wait = FALSE;
+		clients_banner_waits--;
+	}
+}
+
+static void client_create_streams(struct client *client)
+{
+	client->input = i_stream_create_fd(client->fd, (size_t)-1);
+	client->output = o_stream_create_fd(client->fd, (size_t)-1);
+	i_stream_set_name(client->input,
+			  t_strdup_printf("client %u", client->idx));
+	o_stream_set_name(client->output,
+			  t_strdup_printf("client %u", client->idx));
+	o_stream_set_no_error_handling(client->output, TRUE);
+	o_stream_set_flush_callback(client->output, client_output, client);
+}
+
+static void client_input(struct client *client);
+
+static void client_parked_input(struct client *client)
+{
+	client_unpark(client);
+	client_input(client);
+}
+
+static void client_try_park(struct client *client)
+{
+	if (client->parked || client->io == NULL || client->to != NULL ||
+	    conf.ssl || conf.rawlog || client->v.can_park == NULL)
+		return;
+	if (i_stream_get_data_size(client->input) > 0 ||
+	    o_stream_get_buffer_used_size(client->output) > 0 ||
+	    !client->v.can_park(client))
+		return;
+
+	/* free the stream buffers until the server sends something */
+	client->v.set_parked(client, TRUE);
+	io_remove(&client->io);
+	o_stream_destroy(&client->output);
+	i_stream_destroy(&client->input);
+	client->io = io_add(client->fd, IO_READ, client_parked_input, client);
+	client->parked = TRUE;
+	clients_parked_count++;
+}
+
+void client_unpark(struct client *client)
+{
+	if (!client->parked)
+		return;
+
+	io_remove(&client->io);
+	client_create_streams(client);
+	client->io = io_add_istream(client->input, client_input, client);
+	client->v.set_parked(client, FALSE);
+	client->parked = FALSE;
+	clients_parked_count--;
+}
+
+static void client_input(struct client *client)
+{
+	client_update_last_io(client);
 
 	switch (i_stream_read(client->input)) {
 	case 0:
@@ -72,18 +172,22 @@ static void client_input(struct client *client)
 	} else {
 		if (client->input->closed)
 			client_unref(client, TRUE);
+		else if (conf.idle_lowmem)
+			client_try_park(client);
 	}
 	client_unref(client, TRUE);
 }
 
 void client_input_stop(struct client *client)
 {
+	client_unpark(client);
 	if (client->io != NULL)
 		io_remove(&client->io);
 }
 
 void client_input_continue(struct client *client)
 {
+	client_unpark(client);
 	if (client->io == NULL && !client->input->closed)
 		client->io = io_add_istream(client->input, client_input, client);
 }
@@ -93,7 +197,9 @@ static void client_delay_timeout(struct client *client)
 	i_assert(client->io == NULL);
 
 	client->delayed = FALSE;
-	client->last_io = ioloop_time;
+	client_update_last_io(client);
+	if (conf.rate > 0)
+		rate_client_wakeup(client);
 
 	timeout_remove(&client->to);
 	client_input_continue(client);
@@ -101,6 +207,7 @@ static void client_delay_timeout(struct client *client)
 
 void client_delay(struct client *client, unsigned int msecs)
 {
+	client_unpark(client);
 	if (client->input->closed) {
 		/* we're already disconnected and client->to is set */
 		return;
@@ -118,7 +225,7 @@ static int client_output(struct client *client)
 
 	o_stream_cork(client->output);
 	ret = o_stream_flush(client->output);
-	client->last_io = ioloop_time;
+	client_update_last_io(client);
 
 	if (ret > 0) {
 		if (client->v.output(client) < 0)
@@ -171,9 +278,6 @@ static void client_wait_connect(struct client *client)
 static struct client *
 client_new_full(unsigned int i, struct user *user, struct user_client *uc)
 {
-	if (client_min_free_idx == i)
-		client_min_free_idx++;
-
 	if (uc == NULL || uc->profile == NULL ||
 	    strcmp(uc->profile->protocol, "imap") == 0)
 		return &imap_client_new(i, user, uc)->client;
@@ -187,15 +291,19 @@ struct client *client_new_user(struct user *user)
 {
 	struct client *const *clientp;
 	struct user_client *uc;
+	unsigned int idx, count;
 
 	if (!user_get_new_client_profile(user, &uc))
 		return NULL;
-	while (client_min_free_idx < conf.clients_count) {
-		clientp = array_idx_get_space(&clients, client_min_free_idx);
+	while ((count = array_count(&client_free_idx)) > 0) {
+		idx = *array_idx(&client_free_idx, count - 1);
+		array_delete(&client_free_idx, count - 1, 1);
+		clientp = array_idx_get_space(&clients, idx);
 		if (*clientp == NULL)
-			return client_new_full(client_min_free_idx, user, uc);
-		client_min_free_idx++;
+			return client_new_full(idx, user, uc);
 	}
+	if (array_count(&clients) < conf.clients_count)
+		return client_new_full(array_count(&clients), user, uc);
 	return NULL;
 }
 
@@ -225,12 +333,14 @@ int client_init(struct client *client, unsigned int idx,
 	}*/
 
 	ip = &conf.ips[conf.ip_idx];
-	fd = net_connect_ip(ip, client->port, NULL);
+	fd = source_ips_connect(ip, client->port, &client->source_ip_idx);
 	if (++conf.ip_idx == conf.ips_count)
 		conf.ip_idx = 0;
 
 	if (fd < 0) {
-		i_error("connect() failed: %m");
+		/* EADDRNOTAVAIL was already warned about */
+		if (errno != EADDRNOTAVAIL)
+			i_error("connect() failed: %m");
 		return -1;
 	}
 
@@ -238,18 +348,15 @@ int client_init(struct client *client, unsigned int idx,
 	client->idx = idx;
 	client->user = user;
 	client->user_client = uc;
-	client->global_id = ++global_id_counter;
+	client->global_id = worker_client_global_id(++global_id_counter);
+	client->banner_wait = TRUE;
+	clients_banner_waits++;
 
 	client->fd = fd;
 	client->rawlog_fd = -1;
-	client->input = i_stream_create_fd(fd, (size_t)-1);
-	client->output = o_stream_create_fd(fd, (size_t)-1);
-	i_stream_set_name(client->input, t_strdup_printf("client %u", idx));
-	o_stream_set_name(client->output, t_strdup_printf("client %u", idx));
-	o_stream_set_no_error_handling(client->output, TRUE);
-	o_stream_set_flush_callback(client->output, client_output, client);
+	client_create_streams(client);
 	client->io = io_add(fd, IO_WRITE, client_wait_connect, client);
-        client->last_io = ioloop_time;
+	client_update_last_io(client);
 
 	clients_count++;
 	user_add_client(user, client);
@@ -269,6 +376,7 @@ void client_logout(struct client *client)
 void client_disconnect(struct client *client)
 {
 	client->disconnected = TRUE;
+	client_unpark(client);
 
 	i_stream_close(client->input);
 	o_stream_close(client->output);
@@ -293,7 +401,7 @@ static void clients_unstalled(struct mailbox_source *source)
 bool client_unref(struct client *client, bool reconnect)
 {
 	struct mailbox_source *source = client->user->mailbox_source;
-	unsigned int idx = client->idx;
+	unsigned int idx = client->idx, count;
 
 	i_assert(client->refcount > 0);
 	if (--client->refcount > 0)
@@ -304,9 +412,13 @@ bool client_unref(struct client *client, bool reconnect)
 	if (--clients_count == 0)
 		stalled = FALSE;
 	array_idx_clear(&clients, idx);
-	if (client_min_free_idx > idx)
-		client_min_free_idx = idx;
+	/* client_new_user() skips the slot if it's already been refilled */
+	if (idx < conf.clients_count)
+		array_append(&client_free_idx, &idx, 1);
 
+	client_unpark(client);
+	client_last_io_untrack(client);
+	client_banner_received(client);
 	client->v.free(client);
 
 	o_stream_destroy(&client->output);
@@ -319,6 +431,7 @@ bool client_unref(struct client *client, bool reconnect)
 		timeout_remove(&client->to);
 	if (close(client->fd) < 0)
 		i_error("close(client) failed: %m");
+	source_ips_connection_closed(client->source_ip_idx);
 	user_remove_client(client->user, client);
 
 	if (disconnect_clients && !imaptest_has_clients())
@@ -343,6 +456,12 @@ bool client_unref(struct client *client, bool reconnect)
 				 client->user_client->profile == NULL))
 			clients_unstalled(source);
 	}
+	/* client_new_random() refilled the slot directly. drop it from the
+	   free list so logouts don't keep growing it. */
+	count = array_count(&client_free_idx);
+	if (count > 0 && *array_idx(&client_free_idx, count - 1) == idx &&
+	    *array_idx(&clients, idx) != NULL)
+		array_delete(&client_free_idx, count - 1, 1);
 	i_free(client);
 	return FALSE;
 }
@@ -351,6 +470,11 @@ int client_send_more_commands(struct client *client)
 {
 	int ret;
 
+	if (client->parked) {
+		/* sending a command unparks the client */
+		return client->v.send_more_commands(client);
+	}
+
 	o_stream_cork(client->output);
 	ret = client->v.send_more_commands(client);
 	o_stream_uncork(client->output);
@@ -378,9 +502,30 @@ unsigned int clients_get_random_idx(void)
 	return 0;
 }
 
+uint64_t clients_get_memory_usage(void)
+{
+	char buf[128];
+	unsigned long long size, resident;
+	ssize_t ret;
+	int fd;
+
+	fd = open("/proc/self/statm", O_RDONLY);
+	if (fd == -1)
+		return 0;
+	ret = read(fd, buf, sizeof(buf) - 1);
+	i_close_fd(&fd);
+	if (ret <= 0)
+		return 0;
+	buf[ret] = '\0';
+	if (sscanf(buf, "%llu %llu", &size, &resident) != 2)
+		return 0;
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
 void clients_init(void)
 {
 	i_array_init(&stalled_clients, CLIENTS_COUNT);
+	i_array_init(&client_free_idx, CLIENTS_COUNT);
 }
 
 void clients_deinit(void)
@@ -388,4 +533,5 @@ void clients_deinit(void)
 	if (ssl_ctx != NULL)
 		ssl_iostream_context_unref(&ssl_ctx);
 	array_free(&stalled_clients);
+	array_free(&client_free_idx);
 }
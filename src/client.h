@@ -19,6 +19,12 @@ struct client_vfuncs {
 	void (*logout)(struct client *client);
 	void (*free)(struct client *client);
 	bool (*disconnected)(struct client *client);
+
+	/* idle_lowmem: Returns TRUE if the client is only waiting for input
+	   and its streams can be freed. */
+	bool (*can_park)(struct client *client);
+	/* The client's streams were freed (parked=TRUE) or recreated. */
+	void (*set_parked)(struct client *client, bool parked);
 };
 
 struct client {
@@ -33,6 +39,8 @@ struct client {
         unsigned int cur;
 
 	int fd, rawlog_fd;
+	/* index of the source_ips address the connection is bound to, or -1 */
+	int source_ip_idx;
 	struct istream *input;
 	struct ostream *output;
 	struct ssl_iostream *ssl_iostream;
@@ -42,15 +50,28 @@ struct client {
 	enum login_state login_state;
 	enum client_state state;
         time_t last_io;
+	/* clients_by_last_io list */
+	struct client *last_io_prev, *last_io_next;
 
 	bool delayed:1;
 	bool disconnected:1;
 	bool logout_sent:1;
 	bool idling:1;
+	/* idle_lowmem: input/output streams are freed until there is
+	   something to read or write */
+	bool parked:1;
+	bool last_io_tracked:1;
+	bool banner_wait:1;
 };
 ARRAY_DEFINE_TYPE(client, struct client *);
 
 extern int clients_count;
+extern unsigned int clients_parked_count;
+/* Number of clients that haven't yet received the server's banner */
+extern unsigned int clients_banner_waits;
+/* Clients ordered by last_io, oldest first. Idling and delayed clients may
+   be removed with client_last_io_untrack() until their next I/O. */
+extern struct client *clients_by_last_io;
 extern unsigned int total_disconnects;
 extern ARRAY_TYPE(client) clients;
 extern bool stalled, disconnect_clients, no_new_clients;
@@ -66,11 +87,20 @@ void client_disconnect(struct client *client);
 void client_input_stop(struct client *client);
 void client_input_continue(struct client *client);
 void client_delay(struct client *client, unsigned int msecs);
+/* Set last_io to ioloop_time. */
+void client_update_last_io(struct client *client);
+void client_last_io_untrack(struct client *client);
+void client_banner_received(struct client *client);
 int client_send_more_commands(struct client *client);
+/* Recreate the streams of a parked client. Does nothing if it's not
+   parked. */
+void client_unpark(struct client *client);
 
 unsigned int clients_get_random_idx(void);
 
 bool imaptest_has_clients(void);
+/* Returns the process's resident memory size in bytes, or 0 if unknown. */
+uint64_t clients_get_memory_usage(void);
 
 void clients_init(void);
 void clients_deinit(void);
@@ -0,0 +1,108 @@
+/* Copyright (c) 2007-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "commands.h"
+#include "commands-ring.h"
+
+#define COMMAND_RING_INIT_SIZE 16
+
+void command_ring_init(struct command_ring *ring)
+{
+	i_zero(ring);
+	ring->mask = COMMAND_RING_INIT_SIZE - 1;
+	ring->cmds = i_new(struct command *, COMMAND_RING_INIT_SIZE);
+}
+
+void command_ring_deinit(struct command_ring *ring)
+{
+	i_free(ring->cmds);
+}
+
+static void command_ring_grow(struct command_ring *ring, unsigned int size)
+{
+	struct command **cmds, *cmd;
+	unsigned int i;
+
+	cmds = i_new(struct command *, size);
+	for (i = 0; i <= ring->mask; i++) {
+		cmd = ring->cmds[i];
+		if (cmd != NULL)
+			cmds[cmd->tag & (size - 1)] = cmd;
+	}
+	i_free(ring->cmds);
+	ring->cmds = cmds;
+	ring->mask = size - 1;
+}
+
+void command_ring_add(struct command_ring *ring, struct command *cmd)
+{
+	unsigned int size = ring->mask + 1;
+
+	if (ring->first_tag == ring->next_tag)
+		ring->first_tag = cmd->tag;
+	else if (cmd->tag - ring->first_tag >= size) {
+		/* an old command is still pending - grow the ring so that
+		   all the tags between it and the new one fit */
+		while (cmd->tag - ring->first_tag >= size)
+			size *= 2;
+		command_ring_grow(ring, size);
+	}
+	ring->cmds[cmd->tag & ring->mask] = cmd;
+	ring->next_tag = cmd->tag + 1;
+}
+
+void command_ring_remove(struct command_ring *ring, struct command *cmd)
+{
+	i_assert(command_ring_lookup(ring, cmd->tag) == cmd);
+
+	ring->cmds[cmd->tag & ring->mask] = NULL;
+	if (cmd->tag == ring->first_tag) {
+		/* skip over the commands that have already finished */
+		while (ring->first_tag != ring->next_tag &&
+		       ring->cmds[ring->first_tag & ring->mask] == NULL)
+			ring->first_tag++;
+	}
+}
+
+struct command *
+command_ring_lookup(const struct command_ring *ring, unsigned int tag)
+{
+	struct command *cmd;
+
+	if (tag - ring->first_tag >= ring->next_tag - ring->first_tag)
+		return NULL;
+	cmd = ring->cmds[tag & ring->mask];
+	return cmd != NULL && cmd->tag == tag ? cmd : NULL;
+}
+
+struct command *command_ring_get_oldest(const struct command_ring *ring)
+{
+	if (ring->first_tag == ring->next_tag)
+		return NULL;
+	return ring->cmds[ring->first_tag & ring->mask];
+}
+
+struct command *
+command_ring_iter_next(const struct command_ring *ring, unsigned int *iter)
+{
+	struct command *cmd;
+	unsigned int tag;
+
+	while (*iter < ring->next_tag - ring->first_tag) {
+		tag = ring->first_tag + (*iter)++;
+		cmd = ring->cmds[tag & ring->mask];
+		if (cmd != NULL)
+			return cmd;
+	}
+	return NULL;
+}
+
+bool command_tag_parse(const char *str, unsigned int global_id,
+		       unsigned int *tag_r)
+{
+	unsigned int id;
+	const char *p;
+
+	return str_parse_uint(str, &id, &p) == 0 && *p == '.' &&
+		id == global_id && str_to_uint(p + 1, tag_r) == 0;
+}
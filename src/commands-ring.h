@@ -0,0 +1,36 @@
+#ifndef COMMANDS_RING_H
+#define COMMANDS_RING_H
+
+struct command;
+
+/* Pending commands indexed by (tag & mask). They all have tags between
+   first_tag and next_tag. */
+struct command_ring {
+	struct command **cmds;
+	unsigned int mask;
+	/* oldest pending tag and the tag after the newest one. they're equal
+	   when nothing is pending. */
+	unsigned int first_tag, next_tag;
+};
+
+void command_ring_init(struct command_ring *ring);
+void command_ring_deinit(struct command_ring *ring);
+
+/* Add a command with a tag higher than any of the pending ones. */
+void command_ring_add(struct command_ring *ring, struct command *cmd);
+void command_ring_remove(struct command_ring *ring, struct command *cmd);
+struct command *
+command_ring_lookup(const struct command_ring *ring, unsigned int tag);
+/* Returns the oldest pending command, or NULL if there are none. */
+struct command *command_ring_get_oldest(const struct command_ring *ring);
+/* Iterate through the pending commands in the order they were added.
+   Initialize *iter to 0 before the first call. Returns NULL at the end. */
+struct command *
+command_ring_iter_next(const struct command_ring *ring, unsigned int *iter);
+
+/* Parse a tagged reply's "<global_id>.<tag>". Returns TRUE if it's valid
+   and belongs to the client with the given global_id. */
+bool command_tag_parse(const char *str, unsigned int global_id,
+		       unsigned int *tag_r);
+
+#endif
@@ -5,11 +5,13 @@
 #include "str.h"
 #include "istream.h"
 #include "ostream.h"
-#include "time-util.h"
 #include "imap-parser.h"
 #include "mailbox.h"
 #include "imap-client.h"
+#include "settings.h"
 #include "commands.h"
+#include "commands-ring.h"
+#include "rate.h"
 
 #include <ctype.h>
 
@@ -121,6 +123,39 @@ command_get_cmdline(struct imap_client *client, const char **_cmdline,
 	*_cmdline_len = str_len(str);
 }
 
+static struct command *command_alloc(struct imap_client *client)
+{
+	struct command *cmd = client->free_commands;
+	char *cmdline;
+	unsigned int cmdline_alloc_size;
+
+	if (cmd == NULL)
+		return i_new(struct command, 1);
+
+	/* reuse a finished command along with its cmdline buffer */
+	client->free_commands = cmd->next_free;
+	cmdline = cmd->cmdline;
+	cmdline_alloc_size = cmd->cmdline_alloc_size;
+	i_zero(cmd);
+	cmd->cmdline = cmdline;
+	cmd->cmdline_alloc_size = cmdline_alloc_size;
+	return cmd;
+}
+
+static void command_set_cmdline(struct command *cmd, const char *cmdline,
+				unsigned int cmdline_len)
+{
+	if (cmdline_len + 1 > cmd->cmdline_alloc_size) {
+		cmd->cmdline_alloc_size =
+			nearest_power(I_MAX(cmdline_len + 1, 64));
+		i_free(cmd->cmdline);
+		cmd->cmdline = i_malloc(cmd->cmdline_alloc_size);
+	}
+	memcpy(cmd->cmdline, cmdline, cmdline_len);
+	cmd->cmdline[cmdline_len] = '\0';
+	cmd->cmdline_len = cmdline_len;
+}
+
 struct command *command_send(struct imap_client *client, const char *cmdline,
 			     command_callback_t *callback)
 {
@@ -134,22 +169,22 @@ command_send_binary(struct imap_client *client, const char *cmdline,
 {
 	struct command *cmd;
 	struct const_iovec iov[3];
-	const char *prefix, *cmdname, *argp;
+	char prefix[MAX_INT_STRLEN*2 + 2];
+	const char *cmdname, *argp;
 	unsigned int tag = client->tag_counter++;
 
 	i_assert(!client->append_unfinished);
 
+	client_unpark(&client->client);
 	if (client->client.idling && !client->idle_done_sent) {
 		client->idle_done_sent = TRUE;
 		o_stream_nsend_str(client->client.output, "DONE\r\n");
 	}
 
-	cmd = i_new(struct command, 1);
+	cmd = command_alloc(client);
 	T_BEGIN {
 		command_get_cmdline(client, &cmdline, &cmdline_len);
-		cmd->cmdline = i_malloc(cmdline_len+1);
-		memcpy(cmd->cmdline, cmdline, cmdline_len);
-		cmd->cmdline_len = cmdline_len;
+		command_set_cmdline(cmd, cmdline, cmdline_len);
 	} T_END;
 	cmd->state = client->client.state;
 	cmd->tag = tag;
@@ -165,17 +200,11 @@ command_send_binary(struct imap_client *client, const char *cmdline,
 	} else if (strcasecmp(cmdname, "SELECT") == 0 ||
 		   strcasecmp(cmdname, "EXAMINE") == 0) {
 		/* switch selected mailbox storage */
-		struct mailbox_source *source = client->storage->source;
 		const char *name;
 
 		name = get_astring(argp);
-		if (name != NULL && strcmp(name, client->storage->name) != 0) {
-			mailbox_view_free(&client->view);
-			mailbox_storage_unref(&client->storage);
-			client->storage = mailbox_storage_get(source,
-				client->client.user->username, name);
-			client->view = mailbox_view_new(client->storage);
-		}
+		if (name != NULL && strcmp(name, client->storage->name) != 0)
+			imap_client_set_storage(client, name);
 	} else if (strcasecmp(cmdname, "DELETE") == 0 ||
 		   strcasecmp(cmdname, "RENAME") == 0) {
 		/* clear selected mailbox storage's state,
@@ -193,7 +222,9 @@ command_send_binary(struct imap_client *client, const char *cmdline,
 		}
 	}
 
-	prefix = t_strdup_printf("%u.%u ", client->client.global_id, tag);
+	if (i_snprintf(prefix, sizeof(prefix), "%u.%u ",
+		       client->client.global_id, tag) < 0)
+		i_unreached();
 	iov[0].iov_base = prefix;
 	iov[0].iov_len = strlen(prefix);
 	iov[1].iov_base = cmd->cmdline;
@@ -201,49 +232,70 @@ command_send_binary(struct imap_client *client, const char *cmdline,
 	iov[2].iov_base = "\r\n";
 	iov[2].iov_len = 2;
 	o_stream_nsendv(client->client.output, iov, 3);
-	i_gettimeofday(&cmd->tv_start);
+	cmd->start_usecs = client_state_timer_now();
+	cmd->intended_usecs = client->cmd_intended_usecs;
 
-	array_append(&client->commands, &cmd, 1);
+	command_ring_add(&client->cmd_ring, cmd);
+	client->commands_count++;
 	client->last_cmd = cmd;
 	return cmd;
 }
 
 void command_unlink(struct imap_client *client, struct command *cmd)
 {
-	struct command *const *cmds;
-	unsigned int i, count;
-
-	cmds = array_get(&client->commands, &count);
-	for (i = 0; i < count; i++) {
-		if (cmds[i] == cmd) {
-			array_delete(&client->commands, i, 1);
-			break;
-		}
-	}
-	i_assert(i < count);
+	command_ring_remove(&client->cmd_ring, cmd);
+	client->commands_count--;
 
-	client_state_add_to_timer(cmd->state, &cmd->tv_start);
+	client_state_add_to_timer(cmd->state, cmd->start_usecs,
+				  cmd->intended_usecs);
 	if (client->last_cmd == cmd)
 		client->last_cmd = NULL;
+	if (conf.rate > 0)
+		rate_client_wakeup(&client->client);
 }
 
-void command_free(struct command *cmd)
+void command_free(struct imap_client *client, struct command *cmd)
 {
 	if (array_is_created(&cmd->seq_range))
 		array_free(&cmd->seq_range);
-	i_free(cmd->cmdline);
-	i_free(cmd);
+	cmd->next_free = client->free_commands;
+	client->free_commands = cmd;
 }
 
 struct command *command_lookup(struct imap_client *client, unsigned int tag)
 {
-	struct command *const *cmds;
-	unsigned int i, count;
+	return command_ring_lookup(&client->cmd_ring, tag);
+}
+
+struct command *command_get_oldest(struct imap_client *client)
+{
+	return command_ring_get_oldest(&client->cmd_ring);
+}
+
+struct command *command_iter_next(struct imap_client *client,
+				  unsigned int *iter)
+{
+	return command_ring_iter_next(&client->cmd_ring, iter);
+}
+
+void commands_ring_init(struct imap_client *client)
+{
+	command_ring_init(&client->cmd_ring);
+}
+
+void commands_ring_deinit(struct imap_client *client)
+{
+	struct command *cmd;
+	unsigned int iter = 0;
+
+	while ((cmd = command_iter_next(client, &iter)) != NULL)
+		command_free(client, cmd);
+	command_ring_deinit(&client->cmd_ring);
+	client->commands_count = 0;
 
-	cmds = array_get(&client->commands, &count);
-	for (i = 0; i < count; i++) {
-		if (cmds[i]->tag == tag)
-			return cmds[i];
+	while ((cmd = client->free_commands) != NULL) {
+		client->free_commands = cmd->next_free;
+		i_free(cmd->cmdline);
+		i_free(cmd);
 	}
-	return NULL;
 }
@@ -19,13 +19,19 @@ struct command;
 struct command {
 	char *cmdline;
 	unsigned int cmdline_len; /* in case there are NUL chars */
+	/* allocated size of cmdline, kept when the command is reused */
+	unsigned int cmdline_alloc_size;
+	/* next command in imap_client.free_commands */
+	struct command *next_free;
 
 	enum client_state state;
 	unsigned int tag;
 	ARRAY_TYPE(seq_range) seq_range;
 
 	command_callback_t *callback;
-	struct timeval tv_start;
+	/* when the command was sent, and when it was intended to be sent
+	   (0 unless running with rate=) */
+	uint64_t start_usecs, intended_usecs;
 
 	bool expect_bad:1;
 };
@@ -38,8 +44,18 @@ command_send_binary(struct imap_client *client, const char *cmdline,
 		    command_callback_t *callback);
 
 void command_unlink(struct imap_client *client, struct command *cmd);
-void command_free(struct command *cmd);
+/* Return the command to the client's free list for reuse. */
+void command_free(struct imap_client *client, struct command *cmd);
 
 struct command *command_lookup(struct imap_client *client, unsigned int tag);
+/* Returns the oldest pending command, or NULL if there are none. */
+struct command *command_get_oldest(struct imap_client *client);
+/* Iterate through the pending commands in the order they were sent.
+   Initialize *iter to 0 before the first call. Returns NULL at the end. */
+struct command *command_iter_next(struct imap_client *client,
+				  unsigned int *iter);
+
+void commands_ring_init(struct imap_client *client);
+void commands_ring_deinit(struct imap_client *client);
 
 #endif
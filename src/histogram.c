@@ -0,0 +1,161 @@
+/* Copyright (c) 2007-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "histogram.h"
+
+#define HISTOGRAM_HALF_COUNT (HISTOGRAM_SUB_BUCKET_COUNT / 2)
+
+struct histogram_export_header {
+	uint64_t count, sum, max;
+	uint32_t bucket_count;
+};
+
+struct histogram_export_bucket {
+	uint32_t idx, count;
+};
+
+static unsigned int histogram_value_to_idx(uint64_t value)
+{
+	unsigned int magnitude, shift;
+
+	if (value < HISTOGRAM_SUB_BUCKET_COUNT)
+		return value;
+	if (value > HISTOGRAM_MAX_VALUE)
+		value = HISTOGRAM_MAX_VALUE;
+
+	magnitude = 63 - __builtin_clzll(value);
+	shift = magnitude - (HISTOGRAM_SUB_BUCKET_BITS - 1);
+	return HISTOGRAM_SUB_BUCKET_COUNT +
+		(magnitude - HISTOGRAM_SUB_BUCKET_BITS) * HISTOGRAM_HALF_COUNT +
+		((value >> shift) - HISTOGRAM_HALF_COUNT);
+}
+
+static uint64_t histogram_idx_to_highest_value(unsigned int idx)
+{
+	unsigned int magnitude, shift;
+	uint64_t sub;
+
+	if (idx < HISTOGRAM_SUB_BUCKET_COUNT)
+		return idx;
+	idx -= HISTOGRAM_SUB_BUCKET_COUNT;
+	magnitude = idx / HISTOGRAM_HALF_COUNT + HISTOGRAM_SUB_BUCKET_BITS;
+	sub = idx % HISTOGRAM_HALF_COUNT + HISTOGRAM_HALF_COUNT;
+	shift = magnitude - (HISTOGRAM_SUB_BUCKET_BITS - 1);
+	return ((sub + 1) << shift) - 1;
+}
+
+void histogram_add(struct histogram *hist, uint64_t value)
+{
+	hist->buckets[histogram_value_to_idx(value)]++;
+	hist->count++;
+	hist->sum += value;
+	if (hist->max < value)
+		hist->max = value;
+}
+
+void histogram_merge(struct histogram *dest, const struct histogram *src)
+{
+	unsigned int i;
+
+	if (src->count == 0)
+		return;
+	for (i = 0; i < HISTOGRAM_BUCKET_COUNT; i++)
+		dest->buckets[i] += src->buckets[i];
+	dest->count += src->count;
+	dest->sum += src->sum;
+	if (dest->max < src->max)
+		dest->max = src->max;
+}
+
+void histogram_reset(struct histogram *hist)
+{
+	if (hist->count != 0)
+		i_zero(hist);
+}
+
+uint64_t histogram_get_percentile(const struct histogram *hist,
+				  double percentile)
+{
+	uint64_t target, seen = 0, value;
+	unsigned int i;
+
+	if (hist->count == 0)
+		return 0;
+	if (percentile >= 100)
+		return hist->max;
+
+	target = (uint64_t)(hist->count * percentile / 100.0 + 0.5);
+	if (target == 0)
+		target = 1;
+	for (i = 0; i < HISTOGRAM_BUCKET_COUNT; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target) {
+			value = histogram_idx_to_highest_value(i);
+			return I_MIN(value, hist->max);
+		}
+	}
+	return hist->max;
+}
+
+uint64_t histogram_get_mean(const struct histogram *hist)
+{
+	return hist->count == 0 ? 0 : hist->sum / hist->count;
+}
+
+void histogram_export(const struct histogram *hist, buffer_t *dest)
+{
+	struct histogram_export_header hdr;
+	struct histogram_export_bucket bucket;
+	size_t hdr_pos = dest->used;
+	unsigned int i;
+
+	i_zero(&hdr);
+	hdr.count = hist->count;
+	hdr.sum = hist->sum;
+	hdr.max = hist->max;
+	buffer_append(dest, &hdr, sizeof(hdr));
+
+	if (hist->count == 0)
+		return;
+	for (i = 0; i < HISTOGRAM_BUCKET_COUNT; i++) {
+		if (hist->buckets[i] == 0)
+			continue;
+		bucket.idx = i;
+		bucket.count = hist->buckets[i];
+		buffer_append(dest, &bucket, sizeof(bucket));
+		hdr.bucket_count++;
+	}
+	buffer_write(dest, hdr_pos, &hdr, sizeof(hdr));
+}
+
+int histogram_import(struct histogram *hist, const void *data, size_t size)
+{
+	struct histogram_export_header hdr;
+	struct histogram_export_bucket bucket;
+	const unsigned char *p = data;
+	size_t total_size;
+	unsigned int i;
+
+	if (size < sizeof(hdr))
+		return 0;
+	memcpy(&hdr, p, sizeof(hdr));
+	if (hdr.bucket_count > HISTOGRAM_BUCKET_COUNT)
+		return -1;
+	total_size = sizeof(hdr) + hdr.bucket_count * sizeof(bucket);
+	if (size < total_size)
+		return 0;
+
+	p += sizeof(hdr);
+	for (i = 0; i < hdr.bucket_count; i++) {
+		memcpy(&bucket, p + i * sizeof(bucket), sizeof(bucket));
+		if (bucket.idx >= HISTOGRAM_BUCKET_COUNT)
+			return -1;
+		hist->buckets[bucket.idx] += bucket.count;
+	}
+	hist->count += hdr.count;
+	hist->sum += hdr.sum;
+	if (hist->max < hdr.max)
+		hist->max = hdr.max;
+	return total_size;
+}
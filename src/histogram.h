@@ -0,0 +1,40 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include "buffer.h"
+
+/* Log-linear (HDR style) histogram. Values below HISTOGRAM_SUB_BUCKET_COUNT
+   are counted exactly, larger ones with HISTOGRAM_SUB_BUCKET_BITS-1 bits of
+   precision, so they may be off by up to 1/64 (~1.6%).
+   Values above HISTOGRAM_MAX_VALUE are clamped. */
+#define HISTOGRAM_SUB_BUCKET_BITS 7
+#define HISTOGRAM_SUB_BUCKET_COUNT (1U << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_MAX_MAGNITUDE 36
+#define HISTOGRAM_MAX_VALUE ((1ULL << HISTOGRAM_MAX_MAGNITUDE) - 1)
+#define HISTOGRAM_BUCKET_COUNT \
+	(HISTOGRAM_SUB_BUCKET_COUNT + \
+	 (HISTOGRAM_MAX_MAGNITUDE - HISTOGRAM_SUB_BUCKET_BITS) * \
+	 (HISTOGRAM_SUB_BUCKET_COUNT / 2))
+
+struct histogram {
+	uint64_t count, sum, max;
+	uint32_t buckets[HISTOGRAM_BUCKET_COUNT];
+};
+
+void histogram_add(struct histogram *hist, uint64_t value);
+void histogram_merge(struct histogram *dest, const struct histogram *src);
+void histogram_reset(struct histogram *hist);
+
+/* Returns the value below which the given percentage (0..100) of the
+   values fall. 100 returns the exact maximum. */
+uint64_t histogram_get_percentile(const struct histogram *hist,
+				  double percentile);
+uint64_t histogram_get_mean(const struct histogram *hist);
+
+/* Append the histogram in a compact (sparse) binary form to dest. */
+void histogram_export(const struct histogram *hist, buffer_t *dest);
+/* Merge an exported histogram into hist. Returns the number of bytes used
+   from data, 0 if more data is needed, or -1 if the data is invalid. */
+int histogram_import(struct histogram *hist, const void *data, size_t size);
+
+#endif
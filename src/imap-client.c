@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "array.h"
 #include "str.h"
+#include "llist.h"
 #include "write-full.h"
 #include "istream.h"
 #include "ostream.h"
@@ -20,6 +21,7 @@
 #include "profile.h"
 #include "test-exec.h"
 #include "imap-client.h"
+#include "rate.h"
 
 #include <stdlib.h>
 #include <unistd.h>
@@ -70,6 +72,32 @@ int imap_client_state_error(struct imap_client *client, const char *fmt, ...)
 	return -1;
 }
 
+static void imap_client_storage_detach(struct imap_client *client)
+{
+	struct mailbox_storage *storage = client->storage;
+
+	DLLIST2_REMOVE_FULL(&storage->clients_head, &storage->clients_tail,
+			    client, storage_prev, storage_next);
+}
+
+void imap_client_set_storage(struct imap_client *client, const char *mailbox)
+{
+	struct mailbox_source *source = client->client.user->mailbox_source;
+
+	if (client->storage != NULL) {
+		source = client->storage->source;
+		mailbox_view_free(&client->view);
+		imap_client_storage_detach(client);
+		mailbox_storage_unref(&client->storage);
+	}
+	client->storage = mailbox_storage_get(source,
+		client->client.user->username, mailbox);
+	DLLIST2_APPEND_FULL(&client->storage->clients_head,
+			    &client->storage->clients_tail,
+			    client, storage_prev, storage_next);
+	client->view = mailbox_view_new(client->storage);
+}
+
 void imap_client_exists(struct imap_client *client, unsigned int msgs)
 {
 	unsigned int old_count = array_count(&client->view->uidmap);
@@ -84,10 +112,16 @@ void imap_client_exists(struct imap_client *client, unsigned int msgs)
 		(void)array_append_space(&client->view->uidmap);
 }
 
+static unsigned int imap_client_view_count(struct imap_client *client)
+{
+	return array_count(&client->view->uidmap) -
+		client->view->pending_expunge_count;
+}
+
 static int imap_client_expunge(struct imap_client *client, unsigned int seq)
 {
 	struct message_metadata_dynamic *metadata;
-	unsigned int count = array_count(&client->view->uidmap);
+	unsigned int count = imap_client_view_count(client);
 
 	if (seq == 0) {
 		imap_client_input_error(client, "Tried to expunge sequence 0");
@@ -100,7 +134,8 @@ static int imap_client_expunge(struct imap_client *client, unsigned int seq)
 		return -1;
 	}
 
-	metadata = array_idx_get_space(&client->view->messages, seq - 1);
+	metadata = array_idx_get_space(&client->view->messages,
+		mailbox_view_pending_expunge_seq(client->view, seq) - 1);
 	if (metadata->fetch_refcount > 0) {
 		imap_client_input_error(client,
 			"Referenced message expunged seq=%u uid=%u",
@@ -119,20 +154,17 @@ static int imap_client_expunge_uid(struct imap_client *client, uint32_t uid)
 	/* if there are unknown UIDs we don't really know which one of them
 	   we should expunge, but it doesn't matter because they contain no
 	   metadata at that point. */
-	uidmap = array_get(&client->view->uidmap, &count);
-	for (i = 0; i < count; i++) {
-		if (uid <= uidmap[i]) {
-			if (uid == uidmap[i]) {
-				/* found it */
-				imap_client_expunge(client, i + 1);
-				return 0;
-			}
-			break;
-		}
+	mailbox_view_expunges_flush(client->view);
+	if (mailbox_view_uid_lookup(client->view, uid, &i)) {
+		/* found it */
+		imap_client_expunge(client, i + 1);
+		return 0;
 	}
 
 	/* there are one or more unknown messages. expunge the last one of them
 	   (none of them should have any attached metadata) */
+	uidmap = array_get(&client->view->uidmap, &count);
+	i_assert(i <= count);
 	if (i == 0 || uidmap[i-1] != 0) {
 		imap_client_input_error(client, "VANISHED UID=%u not found", uid);
 		return -1;
@@ -146,18 +178,42 @@ static void
 imap_client_expunge_uid_range(struct imap_client *client,
 			      const ARRAY_TYPE(seq_range) *expunged_uids)
 {
+	const struct message_metadata_dynamic *metadata;
+	const struct seq_range *range;
 	const uint32_t *uidmap;
-	unsigned int seq, uid_count;
+	ARRAY_TYPE(seq_range) seqs;
+	unsigned int i, seq, uid_count, range_count;
 
+	/* both the uidmap and the ranges are sorted by UID, so find the
+	   expunged sequences by walking through them together */
 	uidmap = array_get(&client->view->uidmap, &uid_count);
-	for (seq = uid_count; seq > 0; seq--) {
+	range = array_get(expunged_uids, &range_count);
+	t_array_init(&seqs, 16);
+	for (seq = 1, i = 0; seq <= uid_count && i < range_count; ) {
 		i_assert(uidmap[seq-1] != 0);
 
-		if (seq_range_exists(expunged_uids, uidmap[seq-1])) {
-			imap_client_expunge(client, seq);
-			uidmap = array_get(&client->view->uidmap, &uid_count);
+		if (uidmap[seq-1] < range[i].seq1) {
+			seq++;
+			continue;
+		}
+		if (uidmap[seq-1] > range[i].seq2) {
+			i++;
+			continue;
+		}
+		if (seq <= array_count(&client->view->messages)) {
+			metadata = array_idx(&client->view->messages, seq - 1);
+			if (metadata->fetch_refcount > 0) {
+				imap_client_input_error(client,
+					"Referenced message expunged seq=%u uid=%u",
+					seq, uidmap[seq-1]);
+				seq++;
+				continue;
+			}
 		}
+		seq_range_array_add(&seqs, seq);
+		seq++;
 	}
+	mailbox_view_expunge_seqs(client->view, &seqs);
 }
 
 static void
@@ -308,7 +364,7 @@ void imap_client_log_mailbox_view(struct imap_client *client)
 		imap_write_flags(str, metadata[i].mail_flags, NULL);
 		str_append(str, ") keywords=(");
 		mailbox_view_keywords_write(client->view,
-					    metadata[i].keyword_bitmask, str);
+			mailbox_view_get_keywords(client->view, i + 1), str);
 		str_append(str, ")\r\n");
 		write_full(client->client.rawlog_fd, str_data(str), str_len(str));
 	}
@@ -317,10 +373,12 @@ void imap_client_log_mailbox_view(struct imap_client *client)
 
 void imap_client_mailbox_close(struct imap_client *client)
 {
+	mailbox_view_expunges_flush(client->view);
 	if (client->client.login_state == LSTATE_SELECTED && conf.qresync) {
-		if (i_rand_limit(3) == 0) {
-			if (mailbox_view_save_offline_cache(client->view))
-				imap_client_log_mailbox_view(client);
+		if (i_rand_limit(3) == 0 &&
+		    mailbox_view_can_save_offline_cache(client->view)) {
+			imap_client_log_mailbox_view(client);
+			mailbox_view_save_offline_cache(client->view);
 		}
 
 		client->client.login_state = LSTATE_AUTH;
@@ -385,11 +443,11 @@ int imap_client_handle_untagged(struct imap_client *client,
 		if (strcmp(str, "EXISTS") == 0)
 			imap_client_exists(client, num);
 
-                if (num > array_count(&view->uidmap) &&
+                if (num > imap_client_view_count(client) &&
 		    client->last_cmd->state > STATE_SELECT) {
 			imap_client_input_warn(client,
 				"seq too high (%u > %u, state=%s)",
-				num, array_count(&view->uidmap),
+				num, imap_client_view_count(client),
                                 states[client->last_cmd->state].name);
 		} else if (strcmp(str, "EXPUNGE") == 0) {
 			if (imap_client_expunge(client, num) < 0)
@@ -438,17 +496,35 @@ int imap_client_handle_untagged(struct imap_client *client,
 	return 0;
 }
 
+static bool imap_client_args_are_expunge(const struct imap_arg *args)
+{
+	const char *str;
+	unsigned int num;
+
+	return imap_arg_get_atom(&args[0], &str) &&
+		str_to_uint(str, &num) == 0 &&
+		imap_arg_get_atom(&args[1], &str) &&
+		strcasecmp(str, "EXPUNGE") == 0 &&
+		args[2].type == IMAP_ARG_EOL;
+}
+
 static int
 imap_client_input_args(struct imap_client *client, const struct imap_arg *args)
 {
-	const char *p, *tag, *tag_status;
+	const char *tag, *tag_status;
 	struct command *cmd;
 	enum command_reply reply;
+	unsigned int tag_num;
 
 	if (!imap_arg_get_atom(args, &tag))
 		return imap_client_input_error(client, "Broken tag");
 	args++;
 
+	/* consecutive "* n EXPUNGE" replies are queued and removed from the
+	   view at once before anything else looks at it */
+	if (strcmp(tag, "*") != 0 || !imap_client_args_are_expunge(args))
+		mailbox_view_expunges_flush(client->view);
+
 	if (strcmp(tag, "+") == 0) {
 		if (client->last_cmd == NULL) {
 			return imap_client_input_error(client,
@@ -470,10 +546,8 @@ imap_client_input_args(struct imap_client *client, const struct imap_arg *args)
 	if (!imap_arg_get_atom(args, &tag_status))
 		return imap_client_input_error(client, "Broken tagged reply");
 
-	p = strchr(tag, '.');
-	cmd = p != NULL &&
-		atoi(t_strdup_until(tag, p)) == (int)client->client.global_id ?
-		command_lookup(client, atoi(t_strcut(p+1, ' '))) : NULL;
+	cmd = command_tag_parse(tag, client->client.global_id, &tag_num) ?
+		command_lookup(client, tag_num) : NULL;
 	if (cmd == NULL) {
 		return imap_client_input_error(client,
 			"Unexpected tagged reply: %s", tag);
@@ -499,7 +573,7 @@ imap_client_input_args(struct imap_client *client, const struct imap_arg *args)
 	cmd->callback(client, cmd, args, reply);
 	imap_client_cmd_reply_finish(client);
 	o_stream_uncork(client->client.output);
-	command_free(cmd);
+	command_free(client, cmd);
 	return 0;
 }
 
@@ -539,6 +613,9 @@ static void imap_client_input(struct client *_client)
 		if (line == NULL)
 			return;
 		client->seen_banner = TRUE;
+		client_banner_received(_client);
+		if (conf.rate > 0)
+			rate_client_wakeup(_client);
 
 		if (strncasecmp(line, "* PREAUTH ", 10) == 0) {
 			client->preauth = TRUE;
@@ -557,6 +634,8 @@ static void imap_client_input(struct client *_client)
 	}
 
 	while (imap_client_skip_literal(client)) {
+		if (i_stream_get_data_size(_client->input) > 0)
+			client->parser_line_pending = TRUE;
 		ret = imap_parser_read_args(client->parser, 0,
 					    IMAP_PARSE_FLAG_LITERAL_SIZE |
 					    IMAP_PARSE_FLAG_LITERAL8 |
@@ -571,7 +650,7 @@ static void imap_client_input(struct client *_client)
 			imap_client_input_error(client,
 				"error parsing input: %s",
 				imap_parser_get_error(client->parser, &fatal));
-			return;
+			break;
 		}
 		if (imap_args->type == IMAP_ARG_EOL) {
 			/* FIXME: we get here, but we shouldn't.. */
@@ -602,6 +681,7 @@ static void imap_client_input(struct client *_client)
 		if (client->literal_left == 0) {
 			/* end of command - skip CRLF */
 			imap_parser_reset(client->parser);
+			client->parser_line_pending = FALSE;
 
 			data = i_stream_get_data(_client->input, &size);
 			if (size > 0 && data[0] == '\r') {
@@ -613,8 +693,9 @@ static void imap_client_input(struct client *_client)
 		}
 
 		if (ret < 0)
-			return;
+			break;
 	}
+	mailbox_view_expunges_flush(client->view);
 }
 
 static int imap_client_output(struct client *_client)
@@ -635,6 +716,27 @@ static void imap_client_connected(struct client *_client)
 	client->parser = imap_parser_create(_client->input, NULL, (size_t)-1);
 }
 
+static bool imap_client_can_park(struct client *_client)
+{
+	struct imap_client *client = (struct imap_client *)_client;
+
+	/* only IDLE is running and we're waiting for untagged replies */
+	return _client->idling && !client->idle_wait_cont &&
+		!client->idle_done_sent && !client->parser_line_pending &&
+		client->literal_left == 0 && client->append_stream == NULL &&
+		client->commands_count == 1;
+}
+
+static void imap_client_set_parked(struct client *_client, bool parked)
+{
+	struct imap_client *client = (struct imap_client *)_client;
+
+	if (parked)
+		imap_parser_unref(&client->parser);
+	else
+		imap_client_connected(_client);
+}
+
 static void imap_client_logout(struct client *_client)
 {
 	struct imap_client *client = (struct imap_client *)_client;
@@ -647,21 +749,20 @@ static void imap_client_free(struct client *_client)
 	struct imap_client *client = (struct imap_client *)_client;
 	struct mailbox_storage *storage = client->storage;
 	struct mailbox_list_entry *list;
-	struct command *const *cmds;
-	unsigned int i, count;
 	bool checkpoint;
 
 	if (conf.disconnect_quit && _client->login_state != LSTATE_NONAUTH)
 		lib_exit(1);
-	cmds = array_get(&client->commands, &count);
-	checkpoint = client->checkpointing != NULL && count > 0;
+	checkpoint = client->checkpointing != NULL &&
+		client->commands_count > 0;
 
 	imap_client_mailbox_close(client);
 	mailbox_view_free(&client->view);
+	if (storage != NULL)
+		imap_client_storage_detach(client);
 
-	for (i = 0; i < count; i++)
-		command_free(cmds[i]);
-	array_free(&client->commands);
+	commands_ring_deinit(client);
+	rate_client_remove(client);
 
 	if (client->qresync_select_cache != NULL)
 		mailbox_offline_cache_unref(&client->qresync_select_cache);
@@ -695,7 +796,9 @@ static const struct client_vfuncs imap_client_vfuncs = {
 	.output = imap_client_output,
 	.connected = imap_client_connected,
 	.logout = imap_client_logout,
-	.free = imap_client_free
+	.free = imap_client_free,
+	.can_park = imap_client_can_park,
+	.set_parked = imap_client_set_parked
 };
 
 struct imap_client *
@@ -715,13 +818,10 @@ imap_client_new(unsigned int idx, struct user *user, struct user_client *uc)
 	if (strchr(conf.mailbox, '%') != NULL ||
 	    client->client.user_client != NULL)
 		client->try_create_mailbox = TRUE;
-	i_array_init(&client->commands, 16);
-
 	client->tag_counter = 1;
+	commands_ring_init(client);
 	mailbox = user_get_new_mailbox(&client->client);
-	client->storage = mailbox_storage_get(user->mailbox_source,
-					      user->username, mailbox);
-	client->view = mailbox_view_new(client->storage);
+	imap_client_set_storage(client, mailbox);
 
 	client->client.v = imap_client_vfuncs;
 	client->handle_untagged = user->profile != NULL ?
@@ -2,6 +2,7 @@
 #define IMAP_CLIENT_H
 
 #include "client.h"
+#include "commands-ring.h"
 
 struct imap_arg;
 
@@ -55,12 +56,26 @@ struct imap_client {
 	struct test_exec_context *test_exec_ctx;
 
 	struct mailbox_storage *storage;
+	/* storage's clients list */
+	struct imap_client *storage_prev, *storage_next;
 	struct mailbox_view *view;
 	struct mailbox_storage *checkpointing;
-	ARRAY(struct command *) commands;
+	/* pending commands by tag */
+	struct command_ring cmd_ring;
+	unsigned int commands_count;
+	/* Finished commands kept for reuse by command_send_binary() */
+	struct command *free_commands;
 	struct command *last_cmd;
 	unsigned int tag_counter;
 
+	/* rate=: intended start time of the next command we may send,
+	   0 if we don't have a slot. */
+	uint64_t rate_slot_usecs;
+	/* rate=: queue of clients that may be able to take a slot */
+	struct imap_client *rate_prev, *rate_next;
+	/* intended start time for the commands currently being sent */
+	uint64_t cmd_intended_usecs;
+
 	/* Highest MODSEQ seen in untagged FETCH replies. Tagged reply
 	   handler updates highest_modseq based on this and resets to 0. */
 	uint64_t highest_untagged_modseq;
@@ -80,8 +95,11 @@ struct imap_client {
 	bool seen_bye:1;
 	bool idle_wait_cont:1;
 	bool idle_done_sent:1;
+	/* parser has started reading a line that hasn't been finished */
+	bool parser_line_pending:1;
 	bool preauth:1;
 	bool uid_fetch_performed:1;
+	bool rate_queued:1;
 };
 
 static inline struct imap_client *imap_client(struct client *client)
@@ -95,6 +113,8 @@ struct imap_client *
 imap_client_new(unsigned int idx, struct user *user, struct user_client *uc);
 
 void imap_client_exists(struct imap_client *client, unsigned int msgs);
+/* Switch the client's storage and view to the given mailbox. */
+void imap_client_set_storage(struct imap_client *client, const char *mailbox);
 void imap_client_mailbox_close(struct imap_client *client);
 int imap_client_handle_untagged(struct imap_client *client, const struct imap_arg *args);
 void imap_client_capability_parse(struct imap_client *client, const char *line);
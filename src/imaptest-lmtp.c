@@ -4,7 +4,6 @@
 #include "llist.h"
 #include "ioloop.h"
 #include "istream.h"
-#include "time-util.h"
 #include "smtp-address.h"
 #include "smtp-client.h"
 #include "smtp-client-connection.h"
@@ -14,6 +13,7 @@
 #include "client.h"
 #include "client-state.h"
 #include "imaptest-lmtp.h"
+#include "source-ips.h"
 
 #include <sys/time.h>
 
@@ -25,7 +25,8 @@ struct imaptest_lmtp_delivery {
 	struct smtp_client_connection *lmtp_conn;
 	struct smtp_client_transaction *lmtp_trans;
 
-	struct timeval tv_start;
+	uint64_t start_usecs;
+	int source_ip_idx;
 	struct smtp_address *rcpt_to;
 	struct istream *data_input;
 	struct timeout *to;
@@ -46,6 +47,7 @@ static void imaptest_lmtp_free(struct imaptest_lmtp_delivery *d)
 	DLLIST_REMOVE(&lmtp_deliveries, d);
 	lmtp_count--;
 	smtp_client_connection_unref(&d->lmtp_conn);
+	source_ips_connection_closed(d->source_ip_idx);
 	if (d->lmtp_trans != NULL)
 		smtp_client_transaction_destroy(&d->lmtp_trans);
 	if (d->data_input != NULL)
@@ -85,7 +87,7 @@ imaptest_lmtp_data_callback(const struct smtp_reply *reply,
 			smtp_reply_log(reply));
 	} else {
 		counters[STATE_LMTP]++;
-		client_state_add_to_timer(STATE_LMTP, &d->tv_start);
+		client_state_add_to_timer(STATE_LMTP, d->start_usecs, 0);
 	}
 }
 
@@ -107,10 +109,10 @@ void imaptest_lmtp_send(unsigned int port, unsigned int lmtp_max_parallel_count,
 			const struct smtp_address *rcpt_to,
 			struct mailbox_source *source)
 {
-	struct smtp_client_settings lmtp_set;
+	struct smtp_client_settings lmtp_set, conn_set;
 	struct imaptest_lmtp_delivery *d;
 	uoff_t vsize;
-	const struct ip_addr *ip;
+	const struct ip_addr *ip, *my_ip;
 	time_t t;
 	int tz;
 
@@ -136,16 +138,26 @@ void imaptest_lmtp_send(unsigned int port, unsigned int lmtp_max_parallel_count,
 	d->to = timeout_add(LMTP_DELIVERY_TIMEOUT_MSECS,
 			    imaptest_lmtp_timeout, d);
 	d->rcpt_to = smtp_address_clone(default_pool, rcpt_to);
-	i_gettimeofday(&d->tv_start);
+	d->start_usecs = client_state_timer_now();
 
 
 	ip = &conf.ips[conf.ip_idx];
 	if (++conf.ip_idx == conf.ips_count)
 		conf.ip_idx = 0;
 
+	/* lib-smtp connects asynchronously and reports a failure only as a
+	   generic connect error without errno. So running out of local ports
+	   here can't be told apart from the server being down: the delivery
+	   just fails, and the source IP isn't marked exhausted like with
+	   source_ips_connect(). Exhausted IPs are still skipped though. */
+	i_zero(&conn_set);
+	d->source_ip_idx = source_ips_get_next(&my_ip);
+	if (d->source_ip_idx >= 0)
+		conn_set.my_ip = *my_ip;
+
 	d->lmtp_conn = smtp_client_connection_create(lmtp_client,
 		SMTP_PROTOCOL_LMTP, net_ip2addr(ip), port,
-		SMTP_CLIENT_SSL_MODE_NONE, NULL);
+		SMTP_CLIENT_SSL_MODE_NONE, &conn_set);
 	smtp_client_connection_connect(d->lmtp_conn, NULL, NULL);
 
 	d->lmtp_trans = smtp_client_transaction_create(d->lmtp_conn,
@@ -21,6 +21,9 @@
 #include "commands.h"
 #include "test-exec.h"
 #include "imaptest-lmtp.h"
+#include "worker.h"
+#include "rate.h"
+#include "source-ips.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -32,24 +35,45 @@ bool profile_running = FALSE;
 
 static struct ioloop *ioloop;
 static int return_value = 0;
-static time_t next_checkpoint_time;
 static struct ostream *results_output = NULL;
 static struct timeout *to_stop;
-static unsigned int final_wait_secs;
+static unsigned int stop_secs, final_wait_secs;
+static bool workers_parent = FALSE;
 
 #define STATE_IS_VISIBLE(state) \
 	(states[i].probability != 0)
 
+static const struct {
+	const char *name;
+	double percentile;
+} latency_percentiles[] = {
+	{ "p50", 50 },
+	{ "p90", 90 },
+	{ "p99", 99 },
+	{ "p99.9", 99.9 },
+	{ "max", 100 }
+};
+
 static void print_results_header(void)
 {
 	string_t *str = t_str_new(128);
-	unsigned int i;
+	unsigned int i, j;
 
 	for (i = 1; i < STATE_COUNT; i++) {
 		if (!STATE_IS_VISIBLE(i))
 			continue;
 		str_printfa(str, "\t%s count\t%s msecs",
 			    states[i].name, states[i].name);
+		for (j = 0; j < N_ELEMENTS(latency_percentiles); j++) {
+			str_printfa(str, "\t%s %s usecs", states[i].name,
+				    latency_percentiles[j].name);
+		}
+		if (conf.rate == 0)
+			continue;
+		for (j = 0; j < N_ELEMENTS(latency_percentiles); j++) {
+			str_printfa(str, "\t%s resp %s usecs", states[i].name,
+				    latency_percentiles[j].name);
+		}
 	}
 	str_append_c(str, '\n');
 	o_stream_nsend(results_output, str_data(str)+1, str_len(str)-1);
@@ -58,20 +82,60 @@ static void print_results_header(void)
 static void print_results(void)
 {
 	string_t *str = t_str_new(128);
-	unsigned int i;
+	unsigned int i, j;
 
 	for (i = 1; i < STATE_COUNT; i++) {
 		if (!STATE_IS_VISIBLE(i))
 			continue;
 
-		str_printfa(str, "\t%d\t%d\t%lld", counters[i], timer_counts[i], timers[i]);
-		timers[i] = 0;
-		timer_counts[i] = 0;
+		str_printfa(str, "\t%d\t%llu\t%llu", counters[i],
+			    (unsigned long long)latencies[i].count,
+			    (unsigned long long)latencies[i].sum / 1000);
+		for (j = 0; j < N_ELEMENTS(latency_percentiles); j++) {
+			str_printfa(str, "\t%llu", (unsigned long long)
+				histogram_get_percentile(&latencies[i],
+					latency_percentiles[j].percentile));
+		}
+		histogram_reset(&latencies[i]);
+		if (conf.rate == 0)
+			continue;
+		for (j = 0; j < N_ELEMENTS(latency_percentiles); j++) {
+			str_printfa(str, "\t%llu", (unsigned long long)
+				histogram_get_percentile(&response_latencies[i],
+					latency_percentiles[j].percentile));
+		}
+		histogram_reset(&response_latencies[i]);
 	}
 	str_append_c(str, '\n');
 	o_stream_nsend(results_output, str_data(str)+1, str_len(str)-1);
 }
 
+static void print_latency(uint64_t usecs)
+{
+	if (usecs < 10000)
+		printf("%4.1f ", usecs / 1000.0);
+	else if (usecs < 10000000)
+		printf("%4u ", (unsigned int)(usecs / 1000));
+	else
+		printf("%3us ", (unsigned int)(usecs / 1000000));
+}
+
+static void
+print_latency_percentiles(const struct histogram *hist, const char *label)
+{
+	unsigned int i, j;
+
+	for (j = 0; j < N_ELEMENTS(latency_percentiles); j++) {
+		for (i = 1; i < STATE_COUNT; i++) {
+			if (!STATE_IS_VISIBLE(i))
+				continue;
+			print_latency(histogram_get_percentile(&hist[i],
+					latency_percentiles[j].percentile));
+		}
+		printf("ms %s%s\n", label, latency_percentiles[j].name);
+	}
+}
+
 static void print_timers(void)
 {
 	unsigned int i;
@@ -83,12 +147,17 @@ static void print_timers(void)
 		if (!STATE_IS_VISIBLE(i))
 			continue;
 
-		printf("%4d ", timer_counts[i] == 0 ? 0 :
-		       (unsigned int)(timers[i] / timer_counts[i]));
-		timers[i] = 0;
-		timer_counts[i] = 0;
+		printf("%4u ", (unsigned int)
+		       (histogram_get_mean(&latencies[i]) / 1000));
 	}
 	printf("ms/cmd avg\n");
+	print_latency_percentiles(latencies, "");
+	if (conf.rate > 0)
+		print_latency_percentiles(response_latencies, "resp ");
+	for (i = 1; i < STATE_COUNT; i++) {
+		histogram_reset(&latencies[i]);
+		histogram_reset(&response_latencies[i]);
+	}
 	if (isatty(STDOUT_FILENO) > 0)
 		printf("\x1b[0m");
 }
@@ -131,88 +200,78 @@ static void print_header(void)
 
 static void print_stalled_imap_client(string_t *str, struct imap_client *client)
 {
-	struct command *const *cmds;
-	unsigned int cmdcount;
+	struct command *cmd = command_get_oldest(client);
 
-	cmds = array_get(&client->commands, &cmdcount);
 	if (client->seen_bye)
 		str_append(str, "BYE, waiting for disconnect");
-	else if (cmdcount == 0)
+	else if (cmd == NULL)
 		str_append(str, states[client->client.state].name);
 	else {
 		str_printfa(str, "command: %u %s",
-			    cmds[0]->tag, cmds[0]->cmdline);
+			    cmd->tag, cmd->cmdline);
 	}
 }
 
-static void print_timeout(void *context ATTR_UNUSED)
-{
 #define CLIENT_STALLED_SECS(c) \
 	(((c)->to != NULL || (c)->idling) ? 0 : \
 	 (ioloop_time - (c)->last_io))
-	struct client *const *c;
-	string_t *str;
-        static int rowcount = 0;
-	unsigned int i, count, banner_waits, stall_count;
+#define SHORT_STALL_PRINT_SECS 3
+#define LONG_STALL_PRINT_SECS 15
 
-	if (results_output != NULL)
-		print_results();
-	if ((rowcount++ % 10) == 0) {
-		if (rowcount > 1 && results_output == NULL) print_timers();
-		print_header();
-	}
+static void
+clients_check_stalls(unsigned int *banner_waits_r, unsigned int *stall_count_r)
+{
+	struct client *c, *next;
+	unsigned int stalled_secs, stall_count = 0;
+	unsigned int min_secs = SHORT_STALL_PRINT_SECS + 1;
 
-        for (i = 1; i < STATE_COUNT; i++) {
-		if (!STATE_IS_VISIBLE(i))
-			continue;
-		printf("%4d ", counters[i]);
-		total_counters[i] += counters[i];
-		counters[i] = 0;
-        }
+	if (conf.stalled_disconnect_timeout > 0)
+		min_secs = I_MIN(min_secs, conf.stalled_disconnect_timeout);
 
+	/* clients_by_last_io is sorted by last_io, so only the clients that
+	   have been quiet for at least min_secs need to be looked at */
 	stalled = FALSE;
-	banner_waits = 0;
-	stall_count = 0;
-
-#define SHORT_STALL_PRINT_SECS 3
-	c = array_get(&clients, &count);
-	for (i = 0; i < count; i++) {
-		if (c[i] == NULL)
+	for (c = clients_by_last_io; c != NULL; c = next) {
+		next = c->last_io_next;
+		if (ioloop_time - c->last_io < min_secs)
+			break;
+		if (c->to != NULL || c->idling) {
+			/* not stalled - drop from the list until the next
+			   I/O so we don't keep checking it */
+			client_last_io_untrack(c);
 			continue;
-		if (c[i]->state == STATE_BANNER)
-			banner_waits++;
+		}
 
-		unsigned int stalled_secs = CLIENT_STALLED_SECS(c[i]);
+		stalled_secs = CLIENT_STALLED_SECS(c);
 		if (stalled_secs > SHORT_STALL_PRINT_SECS)
 			stall_count++;
 		if (stalled_secs >= conf.stalled_disconnect_timeout &&
 		    conf.stalled_disconnect_timeout > 0)
-			client_disconnect(c[i]);
+			client_disconnect(c);
         }
+	*banner_waits_r = clients_banner_waits;
+	*stall_count_r = stall_count;
+}
 
-	printf("%3d/%3d", (clients_count - banner_waits), clients_count);
-	if (stall_count > 0)
-		printf(" (%u stalled >%us)", stall_count, SHORT_STALL_PRINT_SECS);
-
-	if (array_count(&clients) < conf.clients_count) {
-		printf(" [%d%%]", array_count(&clients) * 100 /
-		       conf.clients_count);
-	}
+static void clients_print_long_stalls(void)
+{
+	struct client *c;
+	string_t *str;
+	unsigned int stalled_secs;
 
-#define LONG_STALL_PRINT_SECS 15
-	printf("\n");
 	str = t_str_new(256);
-	for (i = 0; i < count; i++) {
-		unsigned int stalled_secs =
-			c[i] == NULL ? 0 : CLIENT_STALLED_SECS(c[i]);
+	for (c = clients_by_last_io; c != NULL; c = c->last_io_next) {
+		stalled_secs = CLIENT_STALLED_SECS(c);
+		if (ioloop_time - c->last_io <= LONG_STALL_PRINT_SECS)
+			break;
 		if (stalled_secs > LONG_STALL_PRINT_SECS &&
-		    c[i]->state != STATE_BANNER) {
-			struct imap_client *client = imap_client(c[i]);
+		    c->state != STATE_BANNER) {
+			struct imap_client *client = imap_client(c);
 
 			str_truncate(str, 0);
 			str_printfa(str, " - %d stalled for %u secs in ",
-				    c[i]->global_id,
-				    (unsigned)(ioloop_time - c[i]->last_io));
+				    c->global_id,
+				    (unsigned)(ioloop_time - c->last_io));
 			if (client != NULL)
 				print_stalled_imap_client(str, client);
 
@@ -220,18 +279,75 @@ static void print_timeout(void *context ATTR_UNUSED)
                         printf("%s\n", str_c(str));
                 }
 	}
+}
+
+static void print_timeout(void *context ATTR_UNUSED)
+{
+        static int rowcount = 0;
+	unsigned int i, clients_total, clients_created;
+	unsigned int banner_waits, stall_count, rate_backlog, parked;
+	uint64_t memory_usage;
+
+	if (worker_idx >= 0) {
+		/* the parent process prints the statistics */
+		clients_check_stalls(&banner_waits, &stall_count);
+		worker_send_stats(banner_waits, stall_count, rate_get_backlog());
+		clients_print_long_stalls();
+		checkpoints_run();
+		return;
+	}
+
+	if (results_output != NULL)
+		print_results();
+	if ((rowcount++ % 10) == 0) {
+		if (rowcount > 1 && results_output == NULL) print_timers();
+		print_header();
+	}
+
+        for (i = 1; i < STATE_COUNT; i++) {
+		if (!STATE_IS_VISIBLE(i))
+			continue;
+		printf("%4d ", counters[i]);
+		total_counters[i] += counters[i];
+		counters[i] = 0;
+        }
+
+	if (workers_parent) {
+		workers_get_client_counts(&clients_total, &clients_created,
+					  &banner_waits, &stall_count,
+					  &rate_backlog);
+		workers_update_source_ips();
+		workers_get_memory_usage(&parked, &memory_usage);
+	} else {
+		clients_check_stalls(&banner_waits, &stall_count);
+		clients_total = clients_count;
+		clients_created = array_count(&clients);
+		rate_backlog = rate_get_backlog();
+		parked = clients_parked_count;
+		memory_usage = 0;
+	}
 
-	if (ioloop_time >= next_checkpoint_time &&
-	    conf.checkpoint_interval > 0) {
-		struct hash_iterate_context *iter;
-		char *key;
-		struct mailbox_storage *storage;
+	printf("%3d/%3d", (clients_total - banner_waits), clients_total);
+	if (stall_count > 0)
+		printf(" (%u stalled >%us)", stall_count, SHORT_STALL_PRINT_SECS);
+	if (rate_backlog > 0)
+		printf(" (%u cmds behind schedule)", rate_backlog);
+	source_ips_print_status();
+	if (conf.idle_lowmem && clients_total > 0) {
+		memory_usage += clients_get_memory_usage();
+		printf(" [%u parked, %llu bytes/conn]", parked,
+		       (unsigned long long)(memory_usage / clients_total));
+	}
+
+	if (clients_created < conf.clients_count) {
+		printf(" [%d%%]", clients_created * 100 /
+		       conf.clients_count);
+	}
+	printf("\n");
 
-		iter = hash_table_iterate_init(storages);
-		while (hash_table_iterate(iter, storages, &key, &storage))
-			clients_checkpoint(storage);
-		hash_table_iterate_deinit(&iter);
-		next_checkpoint_time = ioloop_time + conf.checkpoint_interval;
+	if (!workers_parent) {
+		clients_print_long_stalls();
+		checkpoints_run();
 	}
 }
 
@@ -251,6 +367,9 @@ static void print_total(void)
 		printf("%4d ", total_counters[i]);
 	}
 	printf("\n");
+	print_latency_percentiles(total_latencies, "");
+	if (conf.rate > 0)
+		print_latency_percentiles(total_response_latencies, "resp ");
 }
 
 static void fix_probabilities(void)
@@ -285,7 +404,8 @@ static void fix_probabilities(void)
 
 bool imaptest_has_clients(void)
 {
-	return clients_count > 0 || imaptest_lmtp_have_deliveries();
+	return clients_count > 0 || imaptest_lmtp_have_deliveries() ||
+		workers_running_count() > 0;
 }
 
 static void sig_die(const siginfo_t *si ATTR_UNUSED, void *context ATTR_UNUSED)
@@ -349,6 +469,7 @@ static void clients_unref(void)
 
 static struct mailbox_source *imaptest_mailbox_source(void)
 {
+	struct mailbox_source_synthetic_settings synth_set;
 	struct state *state;
 
 	state = state_find("APPEND");
@@ -359,27 +480,91 @@ static struct mailbox_source *imaptest_mailbox_source(void)
 	}
 	if (conf.random_msg_size > 0)
 		return mailbox_source_new_random(conf.random_msg_size);
-	else
+	else if (conf.synthetic_msg_size > 0) {
+		i_zero(&synth_set);
+		synth_set.median_size = conf.synthetic_msg_size;
+		synth_set.max_parts = conf.synthetic_max_parts;
+		synth_set.attachment_percentage = conf.synthetic_attachments;
+		synth_set.max_extra_headers = conf.synthetic_headers;
+		return mailbox_source_new_synthetic(&synth_set);
+	} else if (conf.corpus_path != NULL)
+		return mailbox_source_new_corpus(conf.corpus_path);
+	else if (conf.msgdir_path != NULL) {
+		return mailbox_source_new_dir(conf.msgdir_path,
+					      conf.msgdir_random);
+	} else
 		return mailbox_source_new_mbox(conf.mbox_path);
 }
 
+static void imaptest_corpus(char *argv[])
+{
+	struct mailbox_source *source;
+	const char *path;
+
+	if (argv[0] == NULL || strcmp(argv[0], "build") != 0 ||
+	    argv[1] == NULL)
+		i_fatal("Usage: imaptest corpus build CORPUS "
+			"[mbox=MBOX | msgdir=DIR]");
+	path = argv[1];
+
+	for (argv += 2; *argv != NULL; argv++) {
+		if (strncmp(*argv, "mbox=", 5) == 0)
+			conf.mbox_path = home_expand(*argv + 5);
+		else if (strncmp(*argv, "msgdir=", 7) == 0)
+			conf.msgdir_path = home_expand(*argv + 7);
+		else
+			i_fatal("Unknown arg: %s", *argv);
+	}
+
+	if (conf.msgdir_path != NULL)
+		source = mailbox_source_new_dir(conf.msgdir_path, FALSE);
+	else
+		source = mailbox_source_new_mbox(conf.mbox_path);
+	mailbox_source_corpus_build(source, path);
+	mailbox_source_unref(&source);
+}
+
 static void imaptest_run(void)
 {
 	struct timeout *to;
 	unsigned int i;
 
-	next_checkpoint_time = ioloop_time + conf.checkpoint_interval;
 	to = timeout_add(1000, print_timeout, NULL);
 	if (!profile_running) {
 		for (i = 0; i < INIT_CLIENT_COUNT && i < conf.clients_count; i++)
 			client_new_random(i, mailbox_source);
 	}
+	if (conf.rate > 0) {
+		/* workers share the rate between them */
+		rate_init((double)conf.rate /
+			  (worker_idx < 0 ? 1 : conf.workers_count));
+	}
 
         io_loop_run(ioloop);
 
+	rate_deinit();
 	timeout_remove(&to);
+	if (worker_idx < 0) {
+		/* before the clients free the storages */
+		mailbox_storages_print_memory_usage();
+	}
 	clients_unref();
 
+	if (worker_idx >= 0)
+		worker_send_stats(0, 0, 0);
+	else
+		print_total();
+}
+
+static void imaptest_run_workers(void)
+{
+	struct timeout *to;
+
+	workers_init();
+	to = timeout_add(1000, print_timeout, NULL);
+	io_loop_run(ioloop);
+	timeout_remove(&to);
+
 	print_total();
 }
 
@@ -435,21 +620,45 @@ static void print_help(void)
 "         [host=HOST] [port=PORT] [mbox=MBOX] [clients=CC] [msgs=NMSG]\n"
 "         [box=MAILBOX] [copybox=DESTBOX] [-] [<state>[=<n%%>[,<m%%>]]]\n"
 "         [random] [no_pipelining] [no_tracking] [checkpoint=<secs>]\n"
+"         [workers=NW] [rate=CPS] [source_ips=IPS] [idle_lowmem]\n"
+"         [keywords=NKW] [corpus=CORPUS] [synthetic=SIZE]\n"
+"         [msgdir=DIR] [msgdir_random] [msg_memory=MB]\n"
+"imaptest corpus build CORPUS [mbox=MBOX | msgdir=DIR]\n"
 "\n"
 " USER = username (and domain) template, e.g. \"u%%04d\" or \"u%%04d@d%%04d\"\n"
 " RANGE = range for templated usernames [1-%u] or domain names [1-%u]\n"
 " FILE = file of username:passwd pairs (instead of user/users/domains)\n"
 " MBOX = path to mbox from which we read mails to append.\n"
+" CORPUS = corpus file built from MBOX or DIR to read the mails from instead.\n"
+" DIR  = maildir or directory tree of .eml files to read the mails from\n"
+"        instead of MBOX. The files' mtimes are used as INTERNALDATEs.\n"
+"        msgdir_random picks the mails randomly instead of in path order.\n"
+" SIZE = generate MIME messages of around SIZE bytes instead of using MBOX.\n"
+"        synthetic_parts=N, synthetic_attachments=PCT and synthetic_headers=N\n"
+"        set the max. parts, attachment percentage and max. extra headers.\n"
 " MAILBOX = Mailbox name where to do all the work (default = INBOX).\n"
 " DESTBOX = Mailbox name where to copy messages.\n"
 " CC   = number of concurrent clients. [%u]\n"
 " NMSG = target number of messages in the mailbox. [%u]\n"
 " SEED = seed for PRNG to make test repeatable.\n"
+" NW   = number of processes to split the clients and users between. [1]\n"
+" CPS  = open-loop mode: start CPS commands/sec on a fixed schedule, and\n"
+"        measure response times from the scheduled start times.\n"
+" IPS  = comma-separated local IPs and CIDR ranges to rotate connections\n"
+"        between, e.g. \"10.0.0.1,10.0.1.0/24\"\n"
+" idle_lowmem = free the buffers of connections waiting in IDLE, and show\n"
+"        the memory usage per connection\n"
+" MB   = max. memory for remembering the mails' BODYSTRUCTUREs, headers,\n"
+"        etc. The least recently used mails that no mailbox has are\n"
+"        forgotten first. [%u]\n"
+" NKW  = keyword storm: add random keywords from a vocabulary of NKW\n"
+"        keywords ($Storm1..$StormNKW) to STOREs and APPENDs\n"
 "\n"
 " -    = Sets all probabilities to 0%% except for LOGIN, LOGOUT and SELECT\n"
 " <state> = Sets state's probability to n%% and repeated probability to m%%\n",
 	USER_RAND, DOMAIN_RAND,
-	CLIENTS_COUNT, MESSAGE_COUNT_THRESHOLD);
+	CLIENTS_COUNT, MESSAGE_COUNT_THRESHOLD,
+	MAILBOX_SOURCE_DEFAULT_MAX_MEMORY / (1024*1024));
 }
 static void
 parse_possible_range(const char *value, unsigned int *start_r, unsigned int *count_r)
@@ -514,6 +723,35 @@ bool username_format_is_valid(const char *s, const char **error_r)
 	return FALSE;
 }
 
+static void
+check_workers_conf(const char *testpath, const struct profile *profile)
+{
+	unsigned int n = conf.workers_count;
+
+	if (testpath != NULL)
+		i_fatal("workers can't be used with test");
+	if (profile != NULL)
+		return;
+	if (conf.clients_count < n)
+		i_fatal("workers=%u can't be larger than clients=%u",
+			n, conf.clients_count);
+
+	/* each worker tracks its mailboxes separately, so they must not
+	   share users */
+	if (array_is_created(&conf.usernames)) {
+		if (array_count(&conf.usernames) < n) {
+			i_fatal("workers=%u can't be larger than the number "
+				"of users in userfile", n);
+		}
+	} else if (strchr(conf.username_template, '%') == NULL) {
+		if (!conf.no_tracking)
+			i_fatal("workers require multiple users with tracking");
+	} else if (conf.users_rand_count < n && conf.domains_rand_count < n) {
+		i_fatal("workers=%u can't be larger than the users or "
+			"domains range", n);
+	}
+}
+
 int main(int argc ATTR_UNUSED, char *argv[])
 {
 	struct state *state;
@@ -523,11 +761,6 @@ int main(int argc ATTR_UNUSED, char *argv[])
 	int ret, fd;
 
 	lib_init();
-	ioloop = io_loop_create();
-
-	lib_signals_init();
-	lib_signals_ignore(SIGPIPE, TRUE);
-	lib_signals_set_handler(SIGINT, LIBSIG_FLAG_DELAYED, sig_die, NULL);
 
 	conf.password = PASSWORD;
 	conf.username_template = USERNAME_TEMPLATE;
@@ -535,12 +768,22 @@ int main(int argc ATTR_UNUSED, char *argv[])
 	conf.mbox_path = home_expand(MBOX_PATH);
 	conf.clients_count = CLIENTS_COUNT;
 	conf.message_count_threshold = MESSAGE_COUNT_THRESHOLD;
+	conf.msg_memory_mb = MAILBOX_SOURCE_DEFAULT_MAX_MEMORY / (1024*1024);
+	conf.synthetic_max_parts = SYNTHETIC_MAX_PARTS;
+	conf.synthetic_attachments = SYNTHETIC_ATTACHMENTS;
+	conf.synthetic_headers = SYNTHETIC_HEADERS;
 	conf.users_rand_start = 1;
 	conf.users_rand_count = USER_RAND;
 	conf.domains_rand_start = 1;
 	conf.domains_rand_count = DOMAIN_RAND;
 	to_stop = NULL;
 
+	if (argv[1] != NULL && strcmp(argv[1], "corpus") == 0) {
+		imaptest_corpus(argv + 2);
+		lib_deinit();
+		return 0;
+	}
+
 	for (argv++; *argv != NULL; argv++) {
 		value = strchr(*argv, '=');
 		key = value == NULL ? *argv :
@@ -553,17 +796,15 @@ int main(int argc ATTR_UNUSED, char *argv[])
 			return 0;
 		}
 		if (strcmp(key, "secs") == 0) {
-			unsigned int secs;
 			const char *p;
 
-			if (str_parse_uint(value, &secs, &p) < 0)
+			if (str_parse_uint(value, &stop_secs, &p) < 0)
 				i_fatal("Invalid secs: %s", value);
 			if (p[0] == '\0')
 				final_wait_secs = 30;
 			else if (p[0] != ',' ||
 				 str_to_uint(p+1, &final_wait_secs) < 0)
 				i_fatal("Invalid secs: %s", value);
-			to_stop = timeout_add(secs * 1000, timeout_stop, NULL);
 			continue;
 		}
 		if (strcmp(key, "seed") == 0) {
@@ -634,6 +875,14 @@ int main(int argc ATTR_UNUSED, char *argv[])
 			conf.qresync = TRUE;
 			continue;
 		}
+		if (strcmp(*argv, "idle_lowmem") == 0) {
+			conf.idle_lowmem = TRUE;
+			continue;
+		}
+		if (strcmp(*argv, "msgdir_random") == 0) {
+			conf.msgdir_random = TRUE;
+			continue;
+		}
 
 		/* pass=password */
 		if (strcmp(key, "pass") == 0) {
@@ -646,11 +895,49 @@ int main(int argc ATTR_UNUSED, char *argv[])
 			conf.mbox_path = home_expand(value);
 			continue;
 		}
+		/* corpus=path */
+		if (strcmp(key, "corpus") == 0) {
+			conf.corpus_path = home_expand(value);
+			continue;
+		}
+		/* msgdir=path */
+		if (strcmp(key, "msgdir") == 0) {
+			conf.msgdir_path = home_expand(value);
+			continue;
+		}
 		if (strcmp(key, "random_msg_size") == 0) {
 			if (str_to_uint(value, &conf.random_msg_size) < 0)
 				i_fatal("Invalid random_msg_size: %s", value);
 			continue;
 		}
+		/* msg_memory=MB */
+		if (strcmp(key, "msg_memory") == 0) {
+			if (str_to_uint(value, &conf.msg_memory_mb) < 0)
+				i_fatal("Invalid msg_memory: %s", value);
+			continue;
+		}
+		/* synthetic=size */
+		if (strcmp(key, "synthetic") == 0) {
+			if (str_to_uint(value, &conf.synthetic_msg_size) < 0)
+				i_fatal("Invalid synthetic: %s", value);
+			continue;
+		}
+		if (strcmp(key, "synthetic_parts") == 0) {
+			if (str_to_uint(value, &conf.synthetic_max_parts) < 0)
+				i_fatal("Invalid synthetic_parts: %s", value);
+			continue;
+		}
+		if (strcmp(key, "synthetic_attachments") == 0) {
+			if (str_to_uint(value, &conf.synthetic_attachments) < 0 ||
+			    conf.synthetic_attachments > 100)
+				i_fatal("Invalid synthetic_attachments: %s", value);
+			continue;
+		}
+		if (strcmp(key, "synthetic_headers") == 0) {
+			if (str_to_uint(value, &conf.synthetic_headers) < 0)
+				i_fatal("Invalid synthetic_headers: %s", value);
+			continue;
+		}
 
 		/* clients=# */
 		if (strcmp(key, "clients") == 0) {
@@ -658,6 +945,33 @@ int main(int argc ATTR_UNUSED, char *argv[])
 			continue;
 		}
 
+		/* workers=# */
+		if (strcmp(key, "workers") == 0) {
+			if (str_to_uint(value, &conf.workers_count) < 0)
+				i_fatal("Invalid workers: %s", value);
+			continue;
+		}
+
+		/* rate=# */
+		if (strcmp(key, "rate") == 0) {
+			if (str_to_uint(value, &conf.rate) < 0)
+				i_fatal("Invalid rate: %s", value);
+			continue;
+		}
+
+		/* keywords=# */
+		if (strcmp(key, "keywords") == 0) {
+			if (str_to_uint(value, &conf.keywords_count) < 0)
+				i_fatal("Invalid keywords: %s", value);
+			continue;
+		}
+
+		/* source_ips=ip,ip/bits,.. */
+		if (strcmp(key, "source_ips") == 0) {
+			source_ips_parse(value);
+			continue;
+		}
+
 		/* users=# */
 		if (strcmp(key, "users") == 0) {
 			parse_possible_range(value,
@@ -771,33 +1085,68 @@ int main(int argc ATTR_UNUSED, char *argv[])
 			conf.host, net_gethosterror(ret));
 	}
 
+	if (conf.workers_count > 1)
+		check_workers_conf(testpath, profile);
+	if (conf.rate > 0 && (testpath != NULL || profile != NULL))
+		i_fatal("rate can't be used with test or profile");
+
 	lib_set_clean_exit(TRUE);
 	if (results_output != NULL)
 		print_results_header();
 	fix_probabilities();
-	mailbox_source = imaptest_mailbox_source();
-	users_init(profile, mailbox_source);
-	mailboxes_init();
-	clients_init();
-
-	i_array_init(&clients, CLIENTS_COUNT);
-	if (testpath == NULL)
-		imaptest_run();
-	else
-		imaptest_run_tests(testpath);
 
-	imaptest_lmtp_delivery_deinit();
-	clients_deinit();
-	mailboxes_deinit();
-	users_deinit();
+	if (conf.workers_count > 1) {
+		if (results_output != NULL)
+			(void)o_stream_flush(results_output);
+		/* fork before creating the ioloop, so the workers don't
+		   share its epoll/kqueue handle */
+		workers_parent = workers_fork();
+		if (!workers_parent && results_output != NULL)
+			o_stream_destroy(&results_output);
+	}
+
+	ioloop = io_loop_create();
+	lib_signals_init();
+	lib_signals_ignore(SIGPIPE, TRUE);
+	lib_signals_set_handler(SIGINT, LIBSIG_FLAG_DELAYED, sig_die, NULL);
+	if (stop_secs > 0 && !workers_parent)
+		to_stop = timeout_add(stop_secs * 1000, timeout_stop, NULL);
+
+	if (workers_parent) {
+		/* the workers do all the work, we only gather statistics */
+		imaptest_run_workers();
+		return_value = I_MAX(return_value, workers_deinit());
+	} else {
+		mailbox_source = imaptest_mailbox_source();
+		mailbox_source_set_max_memory(mailbox_source,
+			(size_t)conf.msg_memory_mb * 1024*1024);
+		users_init(profile, mailbox_source);
+		mailboxes_init();
+		checkpoints_init();
+		clients_init();
+
+		i_array_init(&clients, CLIENTS_COUNT);
+		if (testpath == NULL)
+			imaptest_run();
+		else
+			imaptest_run_tests(testpath);
+
+		imaptest_lmtp_delivery_deinit();
+		clients_deinit();
+		checkpoints_deinit();
+		mailboxes_deinit();
+		users_deinit();
+		mailbox_source_unref(&mailbox_source);
+		worker_deinit();
+	}
 	if (profile != NULL) {
 		pool_unref(&profile->pool);
 		profile_deinit();
 	}
-	mailbox_source_unref(&mailbox_source);
 
 	if (to_stop != NULL)
 		timeout_remove(&to_stop);
+	source_ips_deinit();
 	if (results_output != NULL) {
 		if (o_stream_flush(results_output) < 0) {
 			i_error("Failed to write results: %s",
@@ -0,0 +1,335 @@
+/* Copyright (c) 2007-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "hash.h"
+#include "istream.h"
+#include "write-full.h"
+#include "message-size.h"
+#include "message-header-parser.h"
+#include "mailbox.h"
+#include "mailbox-source-private.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Corpus file is a header, followed by the messages' data with CRLF line
+   feeds, followed by the records array. It's written in the host's byte
+   order. */
+#define CORPUS_MAGIC "ITCORPUS"
+#define CORPUS_VERSION 1
+#define CORPUS_RECORD_ALIGN 8
+
+struct corpus_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t message_count;
+	uint64_t records_offset;
+};
+
+struct corpus_record {
+	/* message data's offset in the file. The size is also the vsize,
+	   since the data already has CRLFs. */
+	uint64_t offset, size;
+	int64_t time;
+	int32_t tz_offset;
+	uint32_t unused;
+};
+
+struct corpus_mailbox_source {
+	struct mailbox_source source;
+
+	int fd;
+	char *path;
+	void *mmap_base;
+	size_t mmap_size;
+
+	const struct corpus_record *records;
+	unsigned int records_count, next_idx;
+};
+
+static void corpus_mailbox_source_free(struct mailbox_source *_source)
+{
+	struct corpus_mailbox_source *source =
+		(struct corpus_mailbox_source *)_source;
+
+	if (source->mmap_base != NULL) {
+		if (munmap(source->mmap_base, source->mmap_size) < 0)
+			i_error("munmap(%s) failed: %m", source->path);
+	}
+	if (source->fd != -1)
+		i_close_fd(&source->fd);
+	i_free(source->path);
+	i_free(source);
+}
+
+static void corpus_mailbox_source_open(struct corpus_mailbox_source *source)
+{
+	const struct corpus_header *hdr;
+	const struct corpus_record *rec;
+	struct stat st;
+	unsigned int i;
+
+	if (source->fd != -1)
+		return;
+
+	source->fd = open(source->path, O_RDONLY);
+	if (source->fd == -1)
+		i_fatal("open(%s) failed: %m", source->path);
+	if (fstat(source->fd, &st) < 0)
+		i_fatal("fstat(%s) failed: %m", source->path);
+	if ((uoff_t)st.st_size < sizeof(*hdr) ||
+	    (uoff_t)st.st_size > (size_t)-1)
+		i_fatal("Corpus file %s has invalid size", source->path);
+
+	/* the mapping is shared read-only between all the processes using
+	   the same corpus */
+	source->mmap_size = st.st_size;
+	source->mmap_base = mmap(NULL, source->mmap_size, PROT_READ,
+				 MAP_SHARED, source->fd, 0);
+	if (source->mmap_base == MAP_FAILED) {
+		source->mmap_base = NULL;
+		i_fatal("mmap(%s) failed: %m", source->path);
+	}
+
+	hdr = source->mmap_base;
+	if (memcmp(hdr->magic, CORPUS_MAGIC, sizeof(hdr->magic)) != 0)
+		i_fatal("Not a corpus file: %s", source->path);
+	if (hdr->version != CORPUS_VERSION) {
+		i_fatal("Corpus file %s has unsupported version %u",
+			source->path, hdr->version);
+	}
+	if (hdr->message_count == 0)
+		i_fatal("Empty corpus file: %s", source->path);
+	if (hdr->records_offset % CORPUS_RECORD_ALIGN != 0 ||
+	    hdr->records_offset > source->mmap_size ||
+	    (source->mmap_size - hdr->records_offset) / sizeof(*rec) <
+	    hdr->message_count)
+		i_fatal("Corpus file %s is truncated", source->path);
+
+	source->records = CONST_PTR_OFFSET(source->mmap_base,
+					   hdr->records_offset);
+	source->records_count = hdr->message_count;
+	for (i = 0; i < source->records_count; i++) {
+		rec = &source->records[i];
+		if (rec->offset > hdr->records_offset ||
+		    rec->size > hdr->records_offset - rec->offset) {
+			i_fatal("Corpus file %s is corrupted: "
+				"Message %u points outside data", source->path, i);
+		}
+	}
+}
+
+static bool corpus_mailbox_source_eof(struct mailbox_source *_source)
+{
+	struct corpus_mailbox_source *source =
+		(struct corpus_mailbox_source *)_source;
+
+	corpus_mailbox_source_open(source);
+	return source->next_idx == source->records_count;
+}
+
+static struct istream *
+corpus_mailbox_source_get_next(struct mailbox_source *_source,
+			       uoff_t *vsize_r, time_t *time_r, int *tz_offset_r)
+{
+	struct corpus_mailbox_source *source =
+		(struct corpus_mailbox_source *)_source;
+	const struct corpus_record *rec;
+	struct istream *file_input, *input;
+
+	corpus_mailbox_source_open(source);
+	if (source->next_idx == source->records_count)
+		source->next_idx = 0;
+	rec = &source->records[source->next_idx++];
+
+	*vsize_r = rec->size;
+	*time_r = rec->time;
+	*tz_offset_r = rec->tz_offset;
+
+	/* Each message gets its own file stream. It's read with pread(), so
+	   the streams don't fight over a seek offset, and ostreams can
+	   sendfile() it directly. */
+	file_input = i_stream_create_fd(source->fd, IO_BLOCK_SIZE);
+	input = i_stream_create_range(file_input, rec->offset, rec->size);
+	i_stream_unref(&file_input);
+	return input;
+}
+
+static const struct mailbox_source_vfuncs corpus_mailbox_source_vfuncs = {
+	corpus_mailbox_source_free,
+	corpus_mailbox_source_eof,
+	corpus_mailbox_source_get_next,
+};
+
+struct mailbox_source *mailbox_source_new_corpus(const char *path)
+{
+	struct corpus_mailbox_source *source;
+
+	source = i_new(struct corpus_mailbox_source, 1);
+	source->path = i_strdup(path);
+	source->fd = -1;
+	source->source.v = corpus_mailbox_source_vfuncs;
+	mailbox_source_init(&source->source);
+	return &source->source;
+}
+
+static void corpus_read_message(struct istream *input, buffer_t *buf)
+{
+	const unsigned char *data;
+	size_t size;
+
+	buffer_set_used_size(buf, 0);
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		buffer_append(buf, data, size);
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0) {
+		i_fatal("read(%s) failed: %s", i_stream_get_name(input),
+			i_stream_get_error(input));
+	}
+}
+
+static const char *corpus_get_message_id(const buffer_t *buf)
+{
+	struct istream *input;
+	struct message_header_parser_ctx *parser;
+	struct message_header_line *hdr;
+	struct message_size hdr_size;
+	const char *message_id = NULL;
+
+	input = i_stream_create_from_data(buf->data, buf->used);
+	parser = message_parse_header_init(input, &hdr_size, 0);
+	while (message_parse_header_next(parser, &hdr) > 0) {
+		if (hdr->continues) {
+			hdr->use_full_value = TRUE;
+			continue;
+		}
+		if (message_id == NULL &&
+		    strcasecmp(hdr->name, "Message-ID") == 0) {
+			message_id = t_strndup(hdr->full_value,
+					       hdr->full_value_len);
+		}
+	}
+	message_parse_header_deinit(&parser);
+	i_stream_unref(&input);
+	return message_id;
+}
+
+static void
+corpus_write(int fd, const char *path, const void *data, size_t size,
+	     uoff_t offset)
+{
+	if (pwrite_full(fd, data, size, offset) < 0)
+		i_fatal("write(%s) failed: %m", path);
+}
+
+void mailbox_source_corpus_build(struct mailbox_source *source,
+				 const char *path)
+{
+	static const unsigned char zeros[CORPUS_RECORD_ALIGN] = { 0 };
+	HASH_TABLE(char *, void *) message_ids;
+	struct hash_iterate_context *iter;
+	ARRAY(struct corpus_record) records;
+	struct corpus_header hdr;
+	struct corpus_record *rec;
+	struct istream *input;
+	buffer_t *buf;
+	const char *temp_path, *message_id;
+	char *key;
+	void *value;
+	uoff_t offset, vsize;
+	time_t t;
+	int tz, fd;
+	unsigned int missing_ids = 0, duplicate_ids = 0;
+
+	/* write to a temporary file first, so processes using the old
+	   corpus never see a partially written one */
+	temp_path = t_strconcat(path, ".tmp", NULL);
+	fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", temp_path);
+
+	i_array_init(&records, 1024);
+	hash_table_create(&message_ids, default_pool, 0, str_hash, strcmp);
+	buf = buffer_create_dynamic(default_pool, 1024*64);
+
+	offset = sizeof(hdr);
+	do {
+		input = mailbox_source_get_next(source, &vsize, &t, &tz);
+		corpus_read_message(input, buf);
+		i_stream_unref(&input);
+		if (buf->used != vsize) {
+			i_fatal("Message %u: vsize %"PRIuUOFF_T" doesn't "
+				"match its size %"PRIuSIZE_T,
+				array_count(&records) + 1, vsize, buf->used);
+		}
+
+		/* Message-IDs identify the messages in imaptest's message
+		   tracking, so duplicates with different contents would
+		   cause false errors */
+		T_BEGIN {
+			message_id = corpus_get_message_id(buf);
+			if (message_id == NULL)
+				missing_ids++;
+			else if (hash_table_lookup(message_ids,
+						   message_id) != NULL)
+				duplicate_ids++;
+			else {
+				hash_table_insert(message_ids,
+						  i_strdup(message_id),
+						  POINTER_CAST(1));
+			}
+		} T_END;
+
+		rec = array_append_space(&records);
+		rec->offset = offset;
+		rec->size = buf->used;
+		rec->time = t;
+		rec->tz_offset = tz;
+		corpus_write(fd, temp_path, buf->data, buf->used, offset);
+		offset += buf->used;
+	} while (!mailbox_source_eof(source));
+
+	if (offset % CORPUS_RECORD_ALIGN != 0) {
+		size_t pad = CORPUS_RECORD_ALIGN - offset % CORPUS_RECORD_ALIGN;
+
+		corpus_write(fd, temp_path, zeros, pad, offset);
+		offset += pad;
+	}
+	corpus_write(fd, temp_path, array_idx(&records, 0),
+		     sizeof(*rec) * array_count(&records), offset);
+
+	i_zero(&hdr);
+	memcpy(hdr.magic, CORPUS_MAGIC, sizeof(hdr.magic));
+	hdr.version = CORPUS_VERSION;
+	hdr.message_count = array_count(&records);
+	hdr.records_offset = offset;
+	corpus_write(fd, temp_path, &hdr, sizeof(hdr), 0);
+
+	if (fdatasync(fd) < 0)
+		i_fatal("fdatasync(%s) failed: %m", temp_path);
+	i_close_fd(&fd);
+	if (rename(temp_path, path) < 0)
+		i_fatal("rename(%s, %s) failed: %m", temp_path, path);
+
+	printf("%u messages written to corpus %s\n", hdr.message_count, path);
+	if (missing_ids > 0)
+		i_warning("%u messages have no Message-ID", missing_ids);
+	if (duplicate_ids > 0) {
+		i_warning("%u messages have a duplicate Message-ID",
+			  duplicate_ids);
+	}
+
+	iter = hash_table_iterate_init(message_ids);
+	while (hash_table_iterate(iter, message_ids, &key, &value))
+		i_free(key);
+	hash_table_iterate_deinit(&iter);
+	hash_table_destroy(&message_ids);
+	buffer_free(&buf);
+	array_free(&records);
+}
@@ -0,0 +1,276 @@
+/* Copyright (c) 2007-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "istream.h"
+#include "istream-crlf.h"
+#include "mailbox.h"
+#include "mailbox-source-private.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct dir_message {
+	/* path relative to the source's directory */
+	const char *path;
+	time_t mtime;
+
+	/* vsize is counted when the message is first used. It's counted again
+	   if the file's size, mtime or inode has changed since then. */
+	uoff_t vsize, vsize_file_size;
+	time_t vsize_mtime;
+	ino_t vsize_ino;
+	bool vsize_set:1;
+	/* all the lines already end with CRLF */
+	bool crlf:1;
+};
+
+struct dir_mailbox_source {
+	struct mailbox_source source;
+
+	char *path;
+	bool random_order;
+
+	pool_t pool;
+	ARRAY(struct dir_message) messages;
+	unsigned int next_idx;
+};
+
+struct dir_mmap {
+	void *base;
+	size_t size;
+	const char *path;
+};
+
+static void dir_mailbox_source_free(struct mailbox_source *_source)
+{
+	struct dir_mailbox_source *source =
+		(struct dir_mailbox_source *)_source;
+
+	if (array_is_created(&source->messages)) {
+		array_free(&source->messages);
+		pool_unref(&source->pool);
+	}
+	i_free(source->path);
+	i_free(source);
+}
+
+static bool dir_is_message_file(const char *dir, const char *name)
+{
+	const char *p, *parent;
+	size_t len = strlen(name);
+
+	/* .eml files anywhere, and all files in maildir's cur/ and new/ */
+	if (len > 4 && strcasecmp(name + len - 4, ".eml") == 0)
+		return TRUE;
+	p = strrchr(dir, '/');
+	parent = p == NULL ? dir : p + 1;
+	return strcmp(parent, "cur") == 0 || strcmp(parent, "new") == 0;
+}
+
+static void
+dir_mailbox_source_scan(struct dir_mailbox_source *source, string_t *path)
+{
+	struct dir_message *msg;
+	struct dirent *d;
+	struct stat st;
+	DIR *dirp;
+	const char *dir = t_strdup(str_c(path));
+	size_t dir_len = str_len(path), root_len = strlen(source->path) + 1;
+
+	dirp = opendir(dir);
+	if (dirp == NULL)
+		i_fatal("opendir(%s) failed: %m", dir);
+
+	errno = 0;
+	while ((d = readdir(dirp)) != NULL) {
+		if (strcmp(d->d_name, ".") == 0 ||
+		    strcmp(d->d_name, "..") == 0)
+			continue;
+
+		str_truncate(path, dir_len);
+		str_append_c(path, '/');
+		str_append(path, d->d_name);
+		/* don't follow symlinks, so loops aren't possible */
+		if (lstat(str_c(path), &st) < 0)
+			i_fatal("lstat(%s) failed: %m", str_c(path));
+
+		if (S_ISDIR(st.st_mode))
+			dir_mailbox_source_scan(source, path);
+		else if (S_ISREG(st.st_mode) && st.st_size > 0 &&
+			 dir_is_message_file(dir, d->d_name)) {
+			msg = array_append_space(&source->messages);
+			msg->path = p_strdup(source->pool,
+					     str_c(path) + root_len);
+			msg->mtime = st.st_mtime;
+		}
+		errno = 0;
+	}
+	if (errno != 0)
+		i_fatal("readdir(%s) failed: %m", dir);
+	if (closedir(dirp) < 0)
+		i_error("closedir(%s) failed: %m", dir);
+	str_truncate(path, dir_len);
+}
+
+static int dir_message_cmp(const struct dir_message *m1,
+			   const struct dir_message *m2)
+{
+	return strcmp(m1->path, m2->path);
+}
+
+static void dir_mailbox_source_open(struct dir_mailbox_source *source)
+{
+	string_t *path;
+
+	if (array_is_created(&source->messages))
+		return;
+
+	/* only the file list is read here. The files are read when they're
+	   first used. */
+	source->pool = pool_alloconly_create("dir mailbox source", 1024*16);
+	i_array_init(&source->messages, 1024);
+	T_BEGIN {
+		path = t_str_new(256);
+		str_append(path, source->path);
+		dir_mailbox_source_scan(source, path);
+	} T_END;
+
+	if (array_count(&source->messages) == 0)
+		i_fatal("No messages found in directory %s", source->path);
+	/* readdir() order is random, make it stable */
+	array_sort(&source->messages, dir_message_cmp);
+}
+
+static bool
+dir_message_vsize_valid(const struct dir_message *msg, const struct stat *st)
+{
+	return msg->vsize_set &&
+		msg->vsize_file_size == (uoff_t)st->st_size &&
+		msg->vsize_mtime == st->st_mtime &&
+		msg->vsize_ino == st->st_ino;
+}
+
+static void
+dir_message_count_vsize(struct dir_message *msg, const unsigned char *data,
+			size_t size, const struct stat *st)
+{
+	const unsigned char *p, *end = data + size;
+
+	msg->vsize = size;
+	msg->crlf = TRUE;
+	for (p = data; (p = memchr(p, '\n', end - p)) != NULL; p++) {
+		if (p == data || p[-1] != '\r') {
+			/* LF gets converted to CRLF */
+			msg->vsize++;
+			msg->crlf = FALSE;
+		}
+	}
+	msg->vsize_file_size = size;
+	msg->vsize_mtime = st->st_mtime;
+	msg->vsize_ino = st->st_ino;
+	msg->vsize_set = TRUE;
+}
+
+static void dir_mmap_free(struct dir_mmap *mmap_ctx)
+{
+	if (munmap(mmap_ctx->base, mmap_ctx->size) < 0)
+		i_error("munmap(%s) failed: %m", mmap_ctx->path);
+	i_free(mmap_ctx);
+}
+
+static bool dir_mailbox_source_eof(struct mailbox_source *_source)
+{
+	struct dir_mailbox_source *source =
+		(struct dir_mailbox_source *)_source;
+
+	dir_mailbox_source_open(source);
+	return source->next_idx == array_count(&source->messages);
+}
+
+static struct istream *
+dir_mailbox_source_get_next(struct mailbox_source *_source,
+			    uoff_t *vsize_r, time_t *time_r, int *tz_offset_r)
+{
+	struct dir_mailbox_source *source =
+		(struct dir_mailbox_source *)_source;
+	struct dir_message *msg;
+	struct dir_mmap *mmap_ctx;
+	struct istream *input, *input2;
+	struct stat st;
+	const char *path;
+	unsigned int idx, count;
+	int fd;
+
+	dir_mailbox_source_open(source);
+	count = array_count(&source->messages);
+	if (source->next_idx == count)
+		source->next_idx = 0;
+	idx = source->random_order ? i_rand_limit(count) : source->next_idx;
+	source->next_idx++;
+	msg = array_idx_modifiable(&source->messages, idx);
+
+	path = t_strconcat(source->path, "/", msg->path, NULL);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (fstat(fd, &st) < 0)
+		i_fatal("fstat(%s) failed: %m", path);
+	if (st.st_size == 0)
+		i_fatal("File became empty: %s", path);
+	if ((uoff_t)st.st_size > (size_t)-1)
+		i_fatal("File too large: %s", path);
+
+	/* the mapping stays until the stream is destroyed */
+	mmap_ctx = i_new(struct dir_mmap, 1);
+	mmap_ctx->size = st.st_size;
+	mmap_ctx->base = mmap(NULL, mmap_ctx->size, PROT_READ, MAP_SHARED,
+			      fd, 0);
+	if (mmap_ctx->base == MAP_FAILED)
+		i_fatal("mmap(%s) failed: %m", path);
+	mmap_ctx->path = msg->path;
+	i_close_fd(&fd);
+
+	if (!dir_message_vsize_valid(msg, &st)) {
+		dir_message_count_vsize(msg, mmap_ctx->base, mmap_ctx->size,
+					&st);
+	}
+
+	*vsize_r = msg->vsize;
+	*time_r = msg->mtime;
+	*tz_offset_r = 0;
+
+	input = i_stream_create_from_data(mmap_ctx->base, mmap_ctx->size);
+	i_stream_add_destroy_callback(input, dir_mmap_free, mmap_ctx);
+	if (msg->crlf)
+		return input;
+	input2 = i_stream_create_crlf(input);
+	i_stream_unref(&input);
+	return input2;
+}
+
+static const struct mailbox_source_vfuncs dir_mailbox_source_vfuncs = {
+	dir_mailbox_source_free,
+	dir_mailbox_source_eof,
+	dir_mailbox_source_get_next,
+};
+
+struct mailbox_source *
+mailbox_source_new_dir(const char *path, bool random_order)
+{
+	struct dir_mailbox_source *source;
+	size_t len = strlen(path);
+
+	source = i_new(struct dir_mailbox_source, 1);
+	while (len > 1 && path[len-1] == '/')
+		len--;
+	source->path = i_strndup(path, len);
+	source->random_order = random_order;
+	source->source.v = dir_mailbox_source_vfuncs;
+	mailbox_source_init(&source->source);
+	return &source->source;
+}
@@ -1,6 +1,7 @@
 /* Copyright (c) 2007-2018 ImapTest authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
 #include "hash.h"
 #include "istream.h"
 #include "istream-crlf.h"
@@ -10,14 +11,30 @@
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct mbox_message {
+	/* message body offset in the mbox file (after the From-line) */
+	size_t offset, size;
+	/* size with all line feeds as CRLF */
+	uoff_t vsize;
+	time_t time;
+	int tz_offset;
+	/* all the lines already end with CRLF */
+	bool crlf;
+};
 
 struct mbox_mailbox_source {
 	struct mailbox_source source;
 
 	int fd;
 	char *path;
-	struct istream *input;
-	uoff_t next_offset;
+	const unsigned char *mmap_base;
+	size_t mmap_size;
+
+	ARRAY(struct mbox_message) messages;
+	unsigned int next_idx;
 };
 
 static void mbox_mailbox_source_free(struct mailbox_source *_source)
@@ -25,24 +42,108 @@ static void mbox_mailbox_source_free(struct mailbox_source *_source)
 	struct mbox_mailbox_source *source =
 		(struct mbox_mailbox_source *)_source;
 
-	if (source->input != NULL)
-		i_stream_unref(&source->input);
+	if (source->mmap_base != NULL) {
+		if (munmap((void *)source->mmap_base, source->mmap_size) < 0)
+			i_error("munmap(%s) failed: %m", source->path);
+	}
 	if (source->fd != -1)
 		i_close_fd(&source->fd);
+	if (array_is_created(&source->messages))
+		array_free(&source->messages);
 	i_free(source->path);
 	i_free(source);
 }
 
+static bool
+mbox_is_from_line(const unsigned char *line, size_t len,
+		  time_t *time_r, int *tz_offset_r)
+{
+	char *sender;
+
+	if (len < 5 || memcmp(line, "From ", 5) != 0)
+		return FALSE;
+	if (mbox_from_parse(line + 5, len - 5, time_r, tz_offset_r,
+			    &sender) < 0)
+		return FALSE;
+	i_free(sender);
+	return TRUE;
+}
+
+static void mbox_mailbox_source_index(struct mbox_mailbox_source *source)
+{
+	const unsigned char *data = source->mmap_base, *line, *lf;
+	size_t pos, next_pos, line_len, size = source->mmap_size;
+	struct mbox_message *msg = NULL;
+	time_t next_time;
+	int next_tz;
+
+	/* Find the message boundaries once. Each message starts after its
+	   From-line and ends where the next From-line begins. A From-line
+	   right after the previous From-line is part of the body. */
+	i_array_init(&source->messages, 128);
+	for (pos = 0; pos < size; pos = next_pos) {
+		line = data + pos;
+		lf = memchr(line, '\n', size - pos);
+		line_len = lf == NULL ? size - pos : (size_t)(lf - line);
+		next_pos = lf == NULL ? size : pos + line_len + 1;
+
+		if ((msg == NULL || pos != msg->offset) &&
+		    mbox_is_from_line(line, line_len, &next_time, &next_tz)) {
+			if (msg != NULL)
+				msg->size = pos - msg->offset;
+			msg = array_append_space(&source->messages);
+			msg->offset = next_pos;
+			msg->time = next_time;
+			msg->tz_offset = next_tz;
+			msg->crlf = TRUE;
+			continue;
+		}
+		if (msg == NULL)
+			i_fatal("Not a valid mbox file: %s", source->path);
+
+		msg->vsize += line_len;
+		if (lf == NULL) {
+			/* last line without LF */
+		} else if (line_len > 0 && line[line_len-1] == '\r') {
+			msg->vsize++;
+		} else {
+			/* LF gets converted to CRLF */
+			msg->vsize += 2;
+			msg->crlf = FALSE;
+		}
+	}
+	if (msg == NULL)
+		i_fatal("Empty mbox file: %s", source->path);
+	if (msg->offset == size)
+		i_fatal("mbox file ends with From-line: %s", source->path);
+	msg->size = size - msg->offset;
+}
+
 static void mbox_mailbox_source_open(struct mbox_mailbox_source *source)
 {
+	struct stat st;
+	void *mmap_base;
+
 	if (source->fd != -1)
 		return;
 
 	source->fd = open(source->path, O_RDONLY);
 	if (source->fd == -1)
 		i_fatal("open(%s) failed: %m", source->path);
-	source->input = i_stream_create_fd(source->fd, (size_t)-1);
-	i_stream_set_name(source->input, source->path);
+	if (fstat(source->fd, &st) < 0)
+		i_fatal("fstat(%s) failed: %m", source->path);
+	if (st.st_size == 0)
+		i_fatal("Empty mbox file: %s", source->path);
+	if ((uoff_t)st.st_size > (size_t)-1)
+		i_fatal("mbox file too large: %s", source->path);
+
+	source->mmap_size = st.st_size;
+	mmap_base = mmap(NULL, source->mmap_size, PROT_READ, MAP_SHARED,
+			 source->fd, 0);
+	if (mmap_base == MAP_FAILED)
+		i_fatal("mmap(%s) failed: %m", source->path);
+	source->mmap_base = mmap_base;
+	mbox_mailbox_source_index(source);
 }
 
 static bool mbox_mailbox_source_eof(struct mailbox_source *_source)
@@ -51,7 +152,7 @@ static bool mbox_mailbox_source_eof(struct mailbox_source *_source)
 		(struct mbox_mailbox_source *)_source;
 
 	mbox_mailbox_source_open(source);
-	return i_stream_read_eof(source->input);
+	return source->next_idx == array_count(&source->messages);
 }
 
 static struct istream *
@@ -60,66 +161,24 @@ mbox_mailbox_source_get_next(struct mailbox_source *_source,
 {
 	struct mbox_mailbox_source *source =
 		(struct mbox_mailbox_source *)_source;
-	const char *line;
-	char *sender;
-	uoff_t offset, last_offset, vsize;
-	time_t next_time;
-	unsigned int linelen;
-	int next_tz;
+	const struct mbox_message *msg;
+	struct istream *input, *input2;
 
 	mbox_mailbox_source_open(source);
-	i_stream_seek(source->input, source->next_offset);
-
-	line = i_stream_read_next_line(source->input);
-	if (line == NULL) {
-		if (source->input->v_offset == 0)
-			i_fatal("Empty mbox file: %s", source->path);
-
-		source->next_offset = 0;
-		return mbox_mailbox_source_get_next(_source, vsize_r,
-						    time_r, tz_offset_r);
-	}
-
-	/* should be From-line */
-	if (strncmp(line, "From ", 5) != 0 ||
-	    mbox_from_parse((const unsigned char *)line+5, strlen(line+5),
-			    time_r, tz_offset_r, &sender) < 0) {
-		if (source->input->v_offset == 0)
-			i_fatal("Not a valid mbox file: %s", source->path);
-		i_panic("From-line not found at %"PRIuUOFF_T,
-			source->input->v_offset);
-	}
-	i_free(sender);
-
-	vsize = 0;
-        offset = last_offset = source->input->v_offset;
-        while ((line = i_stream_read_next_line(source->input)) != NULL) {
-		linelen = strlen(line);
-		if (strncmp(line, "From ", 5) == 0 &&
-		    mbox_from_parse((const unsigned char *)line+5,
-				    linelen-5, &next_time, &next_tz,
-				    &sender) == 0) {
-			i_free(sender);
-			if (offset != last_offset)
-                                break;
-
-                        /* empty body */
-                        offset = last_offset;
-                }
-		vsize += linelen + 2; /* count lines always as CR+LFs */
-                last_offset = source->input->v_offset;
-        }
-        if (offset == last_offset)
-                i_fatal("mbox file ends with From-line: %s", source->path);
-
-	i_stream_seek(source->input, offset);
-
-	source->next_offset = last_offset;
-	*vsize_r = vsize;
-
-	struct istream *input =
-		i_stream_create_limit(source->input, last_offset - offset);
-	struct istream *input2 = i_stream_create_crlf(input);
+	if (source->next_idx == array_count(&source->messages))
+		source->next_idx = 0;
+	msg = array_idx(&source->messages, source->next_idx++);
+
+	*vsize_r = msg->vsize;
+	*time_r = msg->time;
+	*tz_offset_r = msg->tz_offset;
+
+	/* each message gets its own stream directly on top of the mmap */
+	input = i_stream_create_from_data(source->mmap_base + msg->offset,
+					  msg->size);
+	if (msg->crlf)
+		return input;
+	input2 = i_stream_create_crlf(input);
 	i_stream_unref(&input);
 	return input2;
 }
@@ -15,8 +15,14 @@ struct mailbox_source {
 	int refcount;
 	struct mailbox_source_vfuncs v;
 
-	pool_t messages_pool;
+	/* Message-ID => message */
 	HASH_TABLE(char *, struct message_global *) messages;
+	/* interned string => struct mailbox_source_string */
+	HASH_TABLE(char *, struct mailbox_source_string *) strings;
+	/* messages with refcount=0, least recently used first */
+	struct message_global *unused_head, *unused_tail;
+	/* approximate memory used by the messages and strings */
+	size_t memory_used, max_memory;
 };
 
 void mailbox_source_init(struct mailbox_source *source);
@@ -2,21 +2,163 @@
 
 #include "lib.h"
 #include "hash.h"
-#include "istream.h"
-#include "istream-crlf.h"
-#include "mbox-from.h"
+#include "istream-private.h"
 #include "mailbox.h"
 #include "mailbox-source-private.h"
 
-#include <fcntl.h>
-#include <unistd.h>
+#include <stdlib.h>
 #include <time.h>
 
 struct random_mailbox_source {
 	struct mailbox_source source;
 	size_t max_size;
+	/* generates the per-message seeds */
+	uint64_t state;
 };
 
+/* Message contents are generated on demand while the stream is read, so
+   even huge messages don't need any memory. Each byte depends only on the
+   seed and its offset, so the same seed always gives the same contents
+   regardless of how the stream is read. */
+struct random_istream {
+	struct istream_private istream;
+
+	uint64_t seed;
+	uoff_t size, offset;
+	/* CR was the last byte returned, LF must come next */
+	bool pending_lf;
+};
+
+#define RANDOM_SPLITMIX64_GAMMA 0x9e3779b97f4a7c15ULL
+
+static uint64_t random_mix64(uint64_t z)
+{
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static uint64_t random_splitmix64(uint64_t *state)
+{
+	return random_mix64(*state += RANDOM_SPLITMIX64_GAMMA);
+}
+
+/* Returns the stream's idx'th 64bit word. This is the same as the idx'th
+   output of splitmix64 seeded with seed, but any word can be generated
+   directly. */
+static uint64_t random_istream_word(uint64_t seed, uoff_t idx)
+{
+	return random_mix64(seed + (idx + 1) * RANDOM_SPLITMIX64_GAMMA);
+}
+
+static void random_istream_reset(struct random_istream *rstream)
+{
+	rstream->offset = 0;
+	rstream->pending_lf = FALSE;
+}
+
+static void
+random_istream_fill(struct random_istream *rstream,
+		    unsigned char *data, size_t size)
+{
+	uoff_t word_idx = rstream->offset / sizeof(uint64_t);
+	size_t i = 0, skip = rstream->offset % sizeof(uint64_t), n;
+	uint64_t value;
+
+	/* generate 8 bytes at a time. the first and the last words may be
+	   partial, if the offsets aren't aligned. */
+	while (i < size) {
+		value = random_istream_word(rstream->seed, word_idx++);
+		n = I_MIN(sizeof(value) - skip, size - i);
+		memcpy(data + i, (const unsigned char *)&value + skip, n);
+		i += n;
+		skip = 0;
+	}
+
+	/* any CR or LF becomes a CRLF pair, or a space if it's the last
+	   byte of the message */
+	i = 0;
+	if (rstream->pending_lf) {
+		data[i++] = '\n';
+		rstream->pending_lf = FALSE;
+	}
+	for (; i < size; i++) {
+		if (data[i] != '\r' && data[i] != '\n')
+			continue;
+		if (rstream->offset + i + 1 == rstream->size)
+			data[i] = ' ';
+		else {
+			data[i] = '\r';
+			if (i + 1 == size)
+				rstream->pending_lf = TRUE;
+			else
+				data[++i] = '\n';
+		}
+	}
+	rstream->offset += size;
+}
+
+static ssize_t i_stream_random_read(struct istream_private *stream)
+{
+	struct random_istream *rstream = (struct random_istream *)stream;
+	size_t size;
+
+	if (rstream->offset == rstream->size) {
+		stream->istream.eof = TRUE;
+		return -1;
+	}
+	if (!i_stream_try_alloc(stream, 1, &size))
+		return -2;
+	if (size > rstream->size - rstream->offset)
+		size = rstream->size - rstream->offset;
+
+	random_istream_fill(rstream, stream->w_buffer + stream->pos, size);
+	stream->pos += size;
+	return size;
+}
+
+static void
+i_stream_random_seek(struct istream_private *stream,
+		     uoff_t v_offset, bool mark)
+{
+	struct random_istream *rstream = (struct random_istream *)stream;
+
+	/* regenerate the contents from the beginning up to the offset */
+	random_istream_reset(rstream);
+	stream->istream.v_offset = 0;
+	stream->skip = stream->pos = 0;
+	i_stream_default_seek_nonseekable(stream, v_offset, mark);
+}
+
+static int i_stream_random_stat(struct istream_private *stream,
+				bool exact ATTR_UNUSED)
+{
+	struct random_istream *rstream = (struct random_istream *)stream;
+
+	stream->statbuf.st_size = rstream->size;
+	return 0;
+}
+
+static struct istream *i_stream_create_random(uint64_t seed, uoff_t size)
+{
+	struct random_istream *rstream;
+
+	rstream = i_new(struct random_istream, 1);
+	rstream->seed = seed;
+	rstream->size = size;
+	random_istream_reset(rstream);
+
+	rstream->istream.max_buffer_size = IO_BLOCK_SIZE;
+	rstream->istream.read = i_stream_random_read;
+	rstream->istream.seek = i_stream_random_seek;
+	rstream->istream.stat = i_stream_random_stat;
+
+	rstream->istream.istream.readable_fd = FALSE;
+	rstream->istream.istream.blocking = TRUE;
+	rstream->istream.istream.seekable = TRUE;
+	return i_stream_create(&rstream->istream, NULL, -1, 0);
+}
+
 static void random_mailbox_source_free(struct mailbox_source *_source)
 {
 	i_free(_source);
@@ -34,27 +176,16 @@ random_mailbox_source_get_next(struct mailbox_source *_source,
 {
 	struct random_mailbox_source *source =
 		(struct random_mailbox_source *)_source;
-	size_t buf_size = i_rand_limit(source->max_size) + 1;
-	unsigned char *buf = i_malloc(buf_size);
-	for (size_t i = 0; i < buf_size; i++) {
-		buf[i] = i_rand_limit(256);
-		if (buf[i] == '\r' || buf[i] == '\n') {
-			if (i+1 == buf_size)
-				buf[i] = ' ';
-			else {
-				buf[i] = '\r';
-				buf[++i] = '\n';
-			}
-		}
-	}
+	uint64_t seed = random_splitmix64(&source->state);
+	uoff_t size = 1;
+
+	if (source->max_size > 0)
+		size += random_splitmix64(&source->state) % source->max_size;
 
-	struct istream *input =
-		i_stream_create_copy_from_data(buf, buf_size);
-	i_free(buf);
 	*time_r = time(NULL);
 	*tz_offset_r = 0;
-	*vsize_r = buf_size;
-	return input;
+	*vsize_r = size;
+	return i_stream_create_random(seed, size);
 }
 
 static const struct mailbox_source_vfuncs random_mailbox_source_vfuncs = {
@@ -69,6 +200,9 @@ struct mailbox_source *mailbox_source_new_random(size_t max_size)
 
 	source = i_new(struct random_mailbox_source, 1);
 	source->max_size = max_size;
+	/* rand() follows the seed=<n> parameter, so the generated messages
+	   can be reproduced */
+	source->state = ((uint64_t)rand() << 32) ^ (uint64_t)rand();
 	source->source.v = random_mailbox_source_vfuncs;
 	mailbox_source_init(&source->source);
 	return &source->source;
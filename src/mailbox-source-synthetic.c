@@ -0,0 +1,463 @@
+/* Copyright (c) 2007-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "str.h"
+#include "istream.h"
+#include "message-date.h"
+#include "mailbox.h"
+#include "mailbox-source-private.h"
+
+#include <time.h>
+
+/* message/rfc822 parts can contain messages this deep */
+#define SYNTH_MAX_DEPTH 2
+#define SYNTH_LINE_LEN 72
+#define SYNTH_BASE64_LINE_LEN 76
+#define SYNTH_MIN_BODY_SIZE 64
+/* Date: header is up to this old */
+#define SYNTH_MAX_DATE_AGE_SECS (30*24*3600)
+
+struct synthetic_mailbox_source {
+	struct mailbox_source source;
+	struct mailbox_source_synthetic_settings set;
+
+	/* makes the Message-IDs unique between processes and runs */
+	char *id_prefix;
+	unsigned int id_counter, boundary_counter;
+};
+
+struct synthetic_message {
+	struct synthetic_mailbox_source *source;
+	string_t *str;
+	time_t date;
+	/* number of MIME leaf parts that can still be added */
+	unsigned int parts_left;
+};
+
+struct synthetic_attachment_type {
+	const char *content_type, *extension;
+};
+
+static const char *synth_words[] = {
+	"the", "of", "and", "to", "in", "for", "is", "on", "that", "by",
+	"this", "with", "you", "it", "not", "or", "be", "are", "from", "at",
+	"as", "your", "all", "have", "new", "more", "an", "was", "we", "will",
+	"meeting", "report", "budget", "server", "mailbox", "project",
+	"schedule", "quarter", "review", "invoice", "customer", "release",
+	"deadline", "update", "attached", "please", "thanks", "regards",
+	"tomorrow", "agenda", "proposal", "contract", "delivery", "backup",
+	"storage", "network", "performance", "latency", "throughput",
+	"migration", "outage", "ticket", "question", "summary"
+};
+
+static const char *synth_names[] = {
+	"Alice Anderson", "Bob Brown", "Carol Clark", "Dave Davis",
+	"Eve Evans", "Frank Fisher", "Grace Green", "Heidi Hall",
+	"Ivan Irwin", "Judy Jones", "Mallory Moore", "Oscar Owens"
+};
+
+static const char *synth_domains[] = {
+	"example.com", "example.net", "example.org", "mail.example.com"
+};
+
+static const struct synthetic_attachment_type synth_attachment_types[] = {
+	{ "application/pdf", "pdf" },
+	{ "application/zip", "zip" },
+	{ "application/octet-stream", "bin" },
+	{ "image/png", "png" },
+	{ "image/jpeg", "jpg" },
+	{ "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet",
+	  "xlsx" }
+};
+
+static const char synth_base64_chars[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void
+synth_append_message(struct synthetic_message *msg, size_t size,
+		     unsigned int depth);
+
+static const char *synth_random_word(void)
+{
+	return synth_words[i_rand_limit(N_ELEMENTS(synth_words))];
+}
+
+static void synth_part_used(struct synthetic_message *msg)
+{
+	if (msg->parts_left > 0)
+		msg->parts_left--;
+}
+
+/* Append words until size bytes have been written. Lines are separated
+   with line_sep, which for headers also contains the folding whitespace. */
+static void
+synth_append_words(string_t *str, size_t size, const char *line_sep)
+{
+	size_t start = str_len(str), line_start = start;
+	const char *word;
+
+	while (str_len(str) - start < size) {
+		word = synth_random_word();
+		if (str_len(str) - line_start + strlen(word) >= SYNTH_LINE_LEN) {
+			str_append(str, line_sep);
+			line_start = str_len(str);
+		} else if (str_len(str) != line_start) {
+			str_append_c(str, ' ');
+		}
+		str_append(str, word);
+	}
+	str_append(str, "\r\n");
+}
+
+static void
+synth_append_base64(string_t *str, size_t size, const char *line_sep)
+{
+	unsigned char *data;
+	size_t i, line_len;
+
+	/* any string of base64 characters whose length is divisible by 4
+	   is valid base64, so there's no need to encode anything */
+	size = (size + 3) / 4 * 4;
+	while (size > 0) {
+		line_len = I_MIN(size, SYNTH_BASE64_LINE_LEN);
+		data = buffer_append_space_unsafe(str, line_len);
+		for (i = 0; i < line_len; i++)
+			data[i] = synth_base64_chars[i_rand_limit(64)];
+		size -= line_len;
+		str_append(str, size > 0 ? line_sep : "\r\n");
+	}
+}
+
+static void synth_append_address(string_t *str)
+{
+	const char *name = synth_names[i_rand_limit(N_ELEMENTS(synth_names))];
+	const char *domain =
+		synth_domains[i_rand_limit(N_ELEMENTS(synth_domains))];
+	const char *p;
+
+	str_printfa(str, "\"%s\" <", name);
+	for (p = name; *p != '\0'; p++)
+		str_append_c(str, *p == ' ' ? '.' : i_tolower(*p));
+	str_printfa(str, "@%s>", domain);
+}
+
+static void synth_append_addresses(string_t *str, const char *name,
+				   unsigned int count)
+{
+	unsigned int i;
+
+	str_printfa(str, "%s: ", name);
+	for (i = 0; i < count; i++) {
+		if (i > 0)
+			str_append(str, ",\r\n\t");
+		synth_append_address(str);
+	}
+	str_append(str, "\r\n");
+}
+
+static void synth_append_message_id(struct synthetic_message *msg)
+{
+	str_printfa(msg->str, "<%u.%s@imaptest.example.com>",
+		    ++msg->source->id_counter, msg->source->id_prefix);
+}
+
+static void synth_append_extra_header(struct synthetic_message *msg)
+{
+	string_t *str = msg->str;
+	unsigned int i, count;
+
+	switch (i_rand_limit(8)) {
+	case 0:
+		str_printfa(str, "Received: from mx%u.example.net "
+			    "(mx%u.example.net [10.0.%u.%u])\r\n"
+			    "\tby imap.example.com with ESMTPS id %08x\r\n"
+			    "\tfor <user@example.com>; %s\r\n",
+			    i_rand_limit(10), i_rand_limit(10),
+			    i_rand_limit(256), i_rand_limit(256), i_rand(),
+			    message_date_create(msg->date));
+		break;
+	case 1:
+		str_printfa(str, "X-Mailer: imaptest synthetic %u.%u\r\n",
+			    i_rand_limit(10), i_rand_limit(100));
+		break;
+	case 2:
+		str_append(str, "References:");
+		count = 1 + i_rand_limit(5);
+		for (i = 0; i < count; i++) {
+			str_append(str, i == 0 ? " " : "\r\n\t");
+			synth_append_message_id(msg);
+		}
+		str_append(str, "\r\n");
+		break;
+	case 3:
+		str_printfa(str, "List-Id: %s <%s.lists.example.org>\r\n",
+			    synth_random_word(), synth_random_word());
+		break;
+	case 4:
+		str_printfa(str, "X-Spam-Status: No, score=%d.%u\r\n",
+			    (int)i_rand_limit(10) - 5, i_rand_limit(10));
+		break;
+	case 5:
+		str_append(str, "DKIM-Signature: v=1; a=rsa-sha256; "
+			   "d=example.com; s=selector;\r\n\tb=");
+		synth_append_base64(str, SYNTH_BASE64_LINE_LEN * 4, "\r\n\t");
+		break;
+	case 6:
+		str_append(str, "Thread-Topic: ");
+		synth_append_words(str, 10 + i_rand_limit(40), "\r\n\t");
+		break;
+	case 7:
+		str_printfa(str, "X-Priority: %u\r\n", 1 + i_rand_limit(5));
+		break;
+	}
+}
+
+static void synth_append_headers(struct synthetic_message *msg)
+{
+	const struct mailbox_source_synthetic_settings *set =
+		&msg->source->set;
+	string_t *str = msg->str;
+	unsigned int i, count;
+
+	synth_append_addresses(str, "From", 1);
+	synth_append_addresses(str, "To", 1 + i_rand_limit(3));
+	if (i_rand_limit(3) == 0)
+		synth_append_addresses(str, "Cc", 1 + i_rand_limit(5));
+
+	str_append(str, "Subject: ");
+	if (i_rand_limit(4) == 0)
+		str_append(str, "Re: ");
+	if (i_rand_limit(10) == 0)
+		str_append(str, "=?utf-8?q?K=C3=A4ytt=C3=A4j=C3=A4?= ");
+	synth_append_words(str, 10 + i_rand_limit(50), "\r\n\t");
+
+	str_printfa(str, "Date: %s\r\n", message_date_create(msg->date));
+	str_append(str, "Message-ID: ");
+	synth_append_message_id(msg);
+	str_append(str, "\r\n");
+
+	count = set->max_extra_headers == 0 ? 0 :
+		i_rand_limit(set->max_extra_headers + 1);
+	for (i = 0; i < count; i++)
+		synth_append_extra_header(msg);
+	str_append(str, "MIME-Version: 1.0\r\n");
+}
+
+static const char *
+synth_append_multipart_header(struct synthetic_message *msg,
+			      const char *subtype)
+{
+	const char *boundary;
+
+	boundary = t_strdup_printf("=_imaptest_%u_%s",
+				   ++msg->source->boundary_counter,
+				   msg->source->id_prefix);
+	str_printfa(msg->str, "Content-Type: multipart/%s;\r\n"
+		    "\tboundary=\"%s\"\r\n\r\n"
+		    "This is a multi-part message in MIME format.\r\n",
+		    subtype, boundary);
+	return boundary;
+}
+
+static void synth_append_text_part(struct synthetic_message *msg,
+				   size_t size, bool html)
+{
+	synth_part_used(msg);
+	if (!html) {
+		str_append(msg->str, "Content-Type: text/plain; charset=utf-8\r\n"
+			   "Content-Transfer-Encoding: 7bit\r\n\r\n");
+		synth_append_words(msg->str, size, "\r\n");
+	} else {
+		str_append(msg->str, "Content-Type: text/html; charset=utf-8\r\n"
+			   "Content-Transfer-Encoding: 7bit\r\n\r\n"
+			   "<html><body>\r\n<p>");
+		synth_append_words(msg->str, size, "\r\n");
+		str_append(msg->str, "</p>\r\n</body></html>\r\n");
+	}
+}
+
+static void
+synth_append_alternative(struct synthetic_message *msg, size_t size)
+{
+	const char *boundary;
+
+	boundary = synth_append_multipart_header(msg, "alternative");
+	str_printfa(msg->str, "\r\n--%s\r\n", boundary);
+	synth_append_text_part(msg, size / 3, FALSE);
+	str_printfa(msg->str, "\r\n--%s\r\n", boundary);
+	synth_append_text_part(msg, size - size / 3, TRUE);
+	str_printfa(msg->str, "\r\n--%s--\r\n", boundary);
+}
+
+static void
+synth_append_attachment(struct synthetic_message *msg, size_t size,
+			unsigned int depth)
+{
+	const struct synthetic_attachment_type *type;
+	const char *filename;
+
+	if (depth < SYNTH_MAX_DEPTH && i_rand_limit(5) == 0) {
+		/* the message's own parts count towards the max. parts */
+		str_append(msg->str, "Content-Type: message/rfc822\r\n"
+			   "Content-Disposition: attachment\r\n\r\n");
+		synth_append_message(msg, size, depth + 1);
+		return;
+	}
+	synth_part_used(msg);
+
+	type = &synth_attachment_types[
+		i_rand_limit(N_ELEMENTS(synth_attachment_types))];
+	filename = t_strdup_printf("%s-%u.%s", synth_random_word(),
+				   i_rand_limit(1000), type->extension);
+	str_printfa(msg->str, "Content-Type: %s; name=\"%s\"\r\n"
+		    "Content-Disposition: attachment; filename=\"%s\"\r\n"
+		    "Content-Transfer-Encoding: base64\r\n\r\n",
+		    type->content_type, filename, filename);
+	synth_append_base64(msg->str, size, "\r\n");
+}
+
+static void
+synth_append_mixed(struct synthetic_message *msg, size_t size,
+		   unsigned int depth)
+{
+	const char *boundary;
+	size_t text_size = size / 8 + 1, attachment_size;
+	unsigned int i, count;
+
+	boundary = synth_append_multipart_header(msg, "mixed");
+	str_printfa(msg->str, "\r\n--%s\r\n", boundary);
+	if (msg->parts_left >= 3 && i_rand_limit(2) == 0)
+		synth_append_alternative(msg, text_size);
+	else
+		synth_append_text_part(msg, text_size, FALSE);
+
+	/* the attachments use most of the size */
+	count = 1 + i_rand_limit(I_MAX(msg->parts_left, 1));
+	attachment_size = (size - text_size) / count + 1;
+	for (i = 0; i < count && msg->parts_left > 0; i++) {
+		str_printfa(msg->str, "\r\n--%s\r\n", boundary);
+		synth_append_attachment(msg, attachment_size, depth);
+	}
+	str_printfa(msg->str, "\r\n--%s--\r\n", boundary);
+}
+
+static void
+synth_append_body(struct synthetic_message *msg, size_t size,
+		  unsigned int depth)
+{
+	const struct mailbox_source_synthetic_settings *set =
+		&msg->source->set;
+
+	if (msg->parts_left >= 2 &&
+	    i_rand_limit(100) < set->attachment_percentage)
+		synth_append_mixed(msg, size, depth);
+	else if (msg->parts_left >= 2 && i_rand_limit(2) == 0)
+		synth_append_alternative(msg, size);
+	else
+		synth_append_text_part(msg, size, FALSE);
+}
+
+static void
+synth_append_message(struct synthetic_message *msg, size_t size,
+		     unsigned int depth)
+{
+	size_t start = str_len(msg->str), hdr_size;
+
+	synth_append_headers(msg);
+	hdr_size = str_len(msg->str) - start;
+	synth_append_body(msg, size > hdr_size + SYNTH_MIN_BODY_SIZE ?
+			  size - hdr_size : SYNTH_MIN_BODY_SIZE, depth);
+}
+
+static size_t
+synth_get_random_size(const struct mailbox_source_synthetic_settings *set)
+{
+	size_t size;
+	int shift;
+
+	/* Roughly log-normal: 0.5..1.5 times the median, scaled by
+	   2^-3..2^3 with the extremes being rare. */
+	size = set->median_size / 2 + i_rand_limit(set->median_size + 1);
+	shift = (int)(i_rand_limit(3) + i_rand_limit(3) + i_rand_limit(3)) - 3;
+	if (shift < 0)
+		size >>= -shift;
+	else
+		size <<= shift;
+	return size;
+}
+
+static void synthetic_buffer_free(buffer_t *buf)
+{
+	buffer_free(&buf);
+}
+
+static void synthetic_mailbox_source_free(struct mailbox_source *_source)
+{
+	struct synthetic_mailbox_source *source =
+		(struct synthetic_mailbox_source *)_source;
+
+	i_free(source->id_prefix);
+	i_free(source);
+}
+
+static bool
+synthetic_mailbox_source_eof(struct mailbox_source *_source ATTR_UNUSED)
+{
+	return FALSE; /* never runs out of messages */
+}
+
+static struct istream *
+synthetic_mailbox_source_get_next(struct mailbox_source *_source,
+				  uoff_t *vsize_r, time_t *time_r,
+				  int *tz_offset_r)
+{
+	struct synthetic_mailbox_source *source =
+		(struct synthetic_mailbox_source *)_source;
+	struct synthetic_message msg;
+	struct istream *input;
+	size_t size;
+
+	size = synth_get_random_size(&source->set);
+
+	i_zero(&msg);
+	msg.source = source;
+	msg.str = buffer_create_dynamic(default_pool, size + 1024);
+	msg.date = time(NULL) - i_rand_limit(SYNTH_MAX_DATE_AGE_SECS);
+	msg.parts_left = I_MAX(source->set.max_parts, 1);
+	T_BEGIN {
+		synth_append_message(&msg, size, 0);
+	} T_END;
+
+	*vsize_r = msg.str->used;
+	*time_r = time(NULL);
+	*tz_offset_r = 0;
+
+	/* the stream owns the buffer */
+	input = i_stream_create_from_data(msg.str->data, msg.str->used);
+	i_stream_add_destroy_callback(input, synthetic_buffer_free, msg.str);
+	return input;
+}
+
+static const struct mailbox_source_vfuncs synthetic_mailbox_source_vfuncs = {
+	synthetic_mailbox_source_free,
+	synthetic_mailbox_source_eof,
+	synthetic_mailbox_source_get_next,
+};
+
+struct mailbox_source *
+mailbox_source_new_synthetic(const struct mailbox_source_synthetic_settings *set)
+{
+	struct synthetic_mailbox_source *source;
+
+	i_assert(set->median_size > 0);
+
+	source = i_new(struct synthetic_mailbox_source, 1);
+	source->set = *set;
+	source->id_prefix = i_strdup_printf("%lx.%s.%08x",
+					    (unsigned long)time(NULL),
+					    my_pid, i_rand());
+	source->source.v = synthetic_mailbox_source_vfuncs;
+	mailbox_source_init(&source->source);
+	return &source->source;
+}
@@ -1,17 +1,34 @@
 /* Copyright (c) 2007-2018 ImapTest authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
+#include "llist.h"
 #include "hash.h"
 #include "mailbox.h"
 #include "mailbox-source-private.h"
 
+#include <stddef.h>
+
+/* Strings shared between the messages. BODYSTRUCTUREs, ENVELOPEs and
+   subjects repeat a lot, especially when the same mails are appended to
+   many mailboxes. */
+struct mailbox_source_string {
+	unsigned int refcount;
+	char str[];
+};
+
 struct mailbox_source *mailbox_source;
 
+static void
+mailbox_source_msg_free(struct mailbox_source *source,
+			struct message_global *msg);
+
 void mailbox_source_init(struct mailbox_source *source)
 {
 	source->refcount = 1;
-	source->messages_pool = pool_alloconly_create("messages", 1024*1024);
+	source->max_memory = MAILBOX_SOURCE_DEFAULT_MAX_MEMORY;
 	hash_table_create(&source->messages, default_pool, 0, str_hash, strcmp);
+	hash_table_create(&source->strings, default_pool, 0, str_hash, strcmp);
 }
 
 void mailbox_source_ref(struct mailbox_source *source)
@@ -24,13 +41,22 @@ void mailbox_source_ref(struct mailbox_source *source)
 void mailbox_source_unref(struct mailbox_source **_source)
 {
 	struct mailbox_source *source = *_source;
+	struct hash_iterate_context *iter;
+	struct message_global *msg;
+	char *key;
 
 	i_assert(source->refcount > 0);
 	if (--source->refcount > 0)
 		return;
 
+	iter = hash_table_iterate_init(source->messages);
+	while (hash_table_iterate(iter, source->messages, &key, &msg))
+		mailbox_source_msg_free(source, msg);
+	hash_table_iterate_deinit(&iter);
+	i_assert(hash_table_count(source->strings) == 0);
+
 	hash_table_destroy(&source->messages);
-	pool_unref(&source->messages_pool);
+	hash_table_destroy(&source->strings);
 	source->v.free(source);
 }
 
@@ -46,9 +72,144 @@ mailbox_source_get_next(struct mailbox_source *source,
 	return source->v.get_next(source, vsize_r, time_r, tz_offset_r);
 }
 
-pool_t mailbox_source_get_messages_pool(struct mailbox_source *source)
+static const char *
+mailbox_source_string_get(struct mailbox_source *source, const char *str)
 {
-	return source->messages_pool;
+	struct mailbox_source_string *sstr;
+	size_t len;
+
+	sstr = hash_table_lookup(source->strings, str);
+	if (sstr == NULL) {
+		len = strlen(str) + 1;
+		sstr = i_malloc(sizeof(*sstr) + len);
+		memcpy(sstr->str, str, len);
+		hash_table_insert(source->strings, sstr->str, sstr);
+		source->memory_used += sizeof(*sstr) + len;
+	}
+	sstr->refcount++;
+	return sstr->str;
+}
+
+static void
+mailbox_source_string_unref(struct mailbox_source *source, const char **_str)
+{
+	struct mailbox_source_string *sstr;
+	const char *str = *_str;
+
+	*_str = NULL;
+	if (str == NULL)
+		return;
+
+	sstr = (struct mailbox_source_string *)
+		(str - offsetof(struct mailbox_source_string, str));
+	i_assert(sstr->refcount > 0);
+	if (--sstr->refcount > 0)
+		return;
+
+	hash_table_remove(source->strings, sstr->str);
+	source->memory_used -= sizeof(*sstr) + strlen(sstr->str) + 1;
+	i_free(sstr);
+}
+
+void mailbox_source_msg_set_string(struct mailbox_source *source,
+				   const char **str, const char *value)
+{
+	const char *old_str = *str;
+
+	*str = value == NULL ? NULL :
+		mailbox_source_string_get(source, value);
+	mailbox_source_string_unref(source, &old_str);
+}
+
+static void
+mailbox_source_msg_add_memory(struct mailbox_source *source,
+			      struct message_global *msg, size_t size)
+{
+	msg->memory_size += size;
+	source->memory_used += size;
+}
+
+void mailbox_source_msg_add_header(struct mailbox_source *source,
+				   struct message_global *msg,
+				   const struct message_header *hdr)
+{
+	struct message_header *new_hdr;
+	unsigned char *value;
+
+	new_hdr = array_append_space(&msg->headers);
+	new_hdr->name = mailbox_source_string_get(source, hdr->name);
+	new_hdr->value_len = hdr->value_len;
+	new_hdr->missing = hdr->missing;
+	if (hdr->value_len > 0) {
+		value = i_malloc(hdr->value_len);
+		memcpy(value, hdr->value, hdr->value_len);
+		new_hdr->value = value;
+	}
+	mailbox_source_msg_add_memory(source, msg,
+				      sizeof(*new_hdr) + hdr->value_len);
+}
+
+void mailbox_source_msg_add_body_word(struct mailbox_source *source,
+				      struct message_global *msg,
+				      const char *word, size_t len)
+{
+	const char *str = i_strndup(word, len);
+
+	array_append(&msg->body_words, &str, 1);
+	mailbox_source_msg_add_memory(source, msg, sizeof(str) + len + 1);
+}
+
+static void
+mailbox_source_msg_free(struct mailbox_source *source,
+			struct message_global *msg)
+{
+	struct message_header *hdr;
+	const char *const *wordp;
+	void *mem;
+
+	mailbox_source_string_unref(source, &msg->body);
+	mailbox_source_string_unref(source, &msg->bodystructure);
+	mailbox_source_string_unref(source, &msg->envelope);
+	mailbox_source_string_unref(source, &msg->subject_utf8_tcase);
+	if (array_is_created(&msg->headers)) {
+		array_foreach_modifiable(&msg->headers, hdr) {
+			mailbox_source_string_unref(source, &hdr->name);
+			mem = (void *)hdr->value;
+			i_free(mem);
+		}
+		array_free(&msg->headers);
+	}
+	if (array_is_created(&msg->body_words)) {
+		array_foreach(&msg->body_words, wordp) {
+			mem = (void *)*wordp;
+			i_free(mem);
+		}
+		array_free(&msg->body_words);
+	}
+	source->memory_used -= msg->memory_size;
+	i_free(msg->message_id);
+	i_free(msg);
+}
+
+static void mailbox_source_free_unused(struct mailbox_source *source)
+{
+	struct message_global *msg;
+
+	while (source->memory_used > source->max_memory &&
+	       (msg = source->unused_head) != NULL) {
+		i_assert(msg->refcount == 0);
+		DLLIST2_REMOVE_FULL(&source->unused_head, &source->unused_tail,
+				    msg, unused_prev, unused_next);
+		hash_table_remove(source->messages, msg->message_id);
+		mailbox_source_msg_free(source, msg);
+	}
+}
+
+void mailbox_source_set_max_memory(struct mailbox_source *source,
+				   size_t max_memory)
+{
+	source->max_memory = max_memory;
+	mailbox_source_free_unused(source);
 }
 
 struct message_global *
@@ -57,12 +218,42 @@ mailbox_source_get_msg(struct mailbox_source *source, const char *message_id)
 	struct message_global *msg;
 
 	msg = hash_table_lookup(source->messages, message_id);
-	if (msg != NULL)
+	if (msg != NULL) {
+		if (msg->refcount++ == 0) {
+			DLLIST2_REMOVE_FULL(&source->unused_head,
+					    &source->unused_tail, msg,
+					    unused_prev, unused_next);
+		}
 		return msg;
+	}
 
 	/* new message */
-	msg = p_new(source->messages_pool, struct message_global, 1);
-	msg->message_id = p_strdup(source->messages_pool, message_id);
+	msg = i_new(struct message_global, 1);
+	msg->message_id = i_strdup(message_id);
+	msg->refcount = 1;
+	mailbox_source_msg_add_memory(source, msg, sizeof(*msg) +
+				      strlen(message_id) + 1);
 	hash_table_insert(source->messages, msg->message_id, msg);
+	mailbox_source_free_unused(source);
 	return msg;
 }
+
+void mailbox_source_msg_unref(struct mailbox_source *source,
+			      struct message_global **_msg)
+{
+	struct message_global *msg = *_msg;
+
+	*_msg = NULL;
+	if (msg == NULL)
+		return;
+
+	i_assert(msg->refcount > 0);
+	if (--msg->refcount > 0)
+		return;
+
+	/* keep it around in case the message is seen again, unless we're
+	   already using too much memory */
+	DLLIST2_APPEND_FULL(&source->unused_head, &source->unused_tail, msg,
+			    unused_prev, unused_next);
+	mailbox_source_free_unused(source);
+}
@@ -1,10 +1,37 @@
 #ifndef MAILBOX_SOURCE_H
 #define MAILBOX_SOURCE_H
 
+/* Default max. memory used for messages, see
+   mailbox_source_set_max_memory() */
+#define MAILBOX_SOURCE_DEFAULT_MAX_MEMORY (64*1024*1024)
+
+struct message_header;
+
 extern struct mailbox_source *mailbox_source;
 
+struct mailbox_source_synthetic_settings {
+	/* message sizes are spread around this median size */
+	unsigned int median_size;
+	/* max. number of MIME leaf parts in a message */
+	unsigned int max_parts;
+	/* percentage of messages with attachments */
+	unsigned int attachment_percentage;
+	/* max. number of headers in addition to the standard ones */
+	unsigned int max_extra_headers;
+};
+
 struct mailbox_source *mailbox_source_new_mbox(const char *path);
 struct mailbox_source *mailbox_source_new_random(size_t max_size);
+/* Generate MIME messages with text/html alternatives, attachments and
+   nested message/rfc822 parts. */
+struct mailbox_source *
+mailbox_source_new_synthetic(const struct mailbox_source_synthetic_settings *set);
+/* Messages from a maildir or a directory tree of .eml files, served
+   in path order or randomly. */
+struct mailbox_source *
+mailbox_source_new_dir(const char *path, bool random_order);
+/* Corpus files are built with mailbox_source_corpus_build(). */
+struct mailbox_source *mailbox_source_new_corpus(const char *path);
 void mailbox_source_ref(struct mailbox_source *source);
 void mailbox_source_unref(struct mailbox_source **source);
 
@@ -13,8 +40,33 @@ struct istream *
 mailbox_source_get_next(struct mailbox_source *source,
 			uoff_t *vsize_r, time_t *time_r, int *tz_offset_r);
 
-pool_t mailbox_source_get_messages_pool(struct mailbox_source *source);
+/* Write all the messages from the source into a corpus file. */
+void mailbox_source_corpus_build(struct mailbox_source *source,
+				 const char *path);
+
+/* Returns the message with the given Message-ID, creating it if needed.
+   The message is referenced, and must be unreferenced when it's no longer
+   used. */
 struct message_global *
 mailbox_source_get_msg(struct mailbox_source *source, const char *message_id);
+/* Unreferenced messages are kept until the source's memory usage exceeds
+   the max_memory set with mailbox_source_set_max_memory(). Then the least
+   recently used ones are freed. */
+void mailbox_source_msg_unref(struct mailbox_source *source,
+			      struct message_global **msg);
+void mailbox_source_set_max_memory(struct mailbox_source *source,
+				   size_t max_memory);
+
+/* Replace *str with a shared copy of value (which may be NULL). */
+void mailbox_source_msg_set_string(struct mailbox_source *source,
+				   const char **str, const char *value);
+/* Add a copy of the header to msg->headers. The array must be created. */
+void mailbox_source_msg_add_header(struct mailbox_source *source,
+				   struct message_global *msg,
+				   const struct message_header *hdr);
+/* Add a copy of the word to msg->body_words. The array must be created. */
+void mailbox_source_msg_add_body_word(struct mailbox_source *source,
+				      struct message_global *msg,
+				      const char *word, size_t len);
 
 #endif
@@ -80,21 +80,24 @@ struct msg_old_flags {
 
 static bool
 have_unexpected_changes(struct imap_client *client, const struct msg_old_flags *old,
-			const struct message_metadata_dynamic *metadata)
+			const struct message_metadata_dynamic *metadata,
+			const uint8_t *keyword_bitmask)
 {
 	if (metadata->mail_flags != old->flags)
 		return TRUE;
 
 	if (old->kw_alloc_size != client->view->keyword_bitmask_alloc_size)
 		return TRUE;
-	return memcmp(old->keyword_bitmask, metadata->keyword_bitmask,
-		      old->kw_alloc_size) != 0;
+	return old->kw_alloc_size > 0 &&
+		memcmp(old->keyword_bitmask, keyword_bitmask,
+		       old->kw_alloc_size) != 0;
 }
 
 static void
 check_unexpected_flag_changes(struct imap_client *client,
 			      const struct msg_old_flags *old,
-			      const struct message_metadata_dynamic *metadata)
+			      const struct message_metadata_dynamic *metadata,
+			      const uint8_t *keyword_bitmask)
 {
 	struct mailbox_storage *storage = client->storage;
 	const struct mailbox_keyword *keywords;
@@ -121,7 +124,7 @@ check_unexpected_flag_changes(struct imap_client *client,
 	for (i = 0; i < new_alloc_size; i++) {
 		old_set = i >= old->kw_alloc_size ? FALSE :
 			(old->keyword_bitmask[i/8] & (1 << (i%8))) != 0;
-		new_set = (metadata->keyword_bitmask[i/8] & (1 << (i%8))) != 0;
+		new_set = (keyword_bitmask[i/8] & (1 << (i%8))) != 0;
 		if (old_set != new_set &&
 		    keywords[i].name->owner_client_idx1 == client->client.idx + 1) {
 			imap_client_state_error(client,
@@ -133,12 +136,13 @@ check_unexpected_flag_changes(struct imap_client *client,
 
 static void
 message_metadata_set_flags(struct imap_client *client, const struct imap_arg *args,
-			   struct message_metadata_dynamic *metadata)
+			   uint32_t seq, struct message_metadata_dynamic *metadata)
 {
 	struct mailbox_view *view = client->view;
 	struct mailbox_keyword *kw;
 	struct msg_old_flags old_flags;
 	enum mail_flags flag, flags = 0;
+	uint8_t *keyword_bitmask;
 	unsigned int idx;
 	const char *atom;
 
@@ -146,12 +150,13 @@ message_metadata_set_flags(struct imap_client *client, const struct imap_arg *ar
 	old_flags.kw_alloc_size = view->keyword_bitmask_alloc_size;
 	old_flags.keyword_bitmask = old_flags.kw_alloc_size == 0 ? NULL :
 		t_malloc0(old_flags.kw_alloc_size);
-	if (metadata->keyword_bitmask != NULL) {
-		memcpy(old_flags.keyword_bitmask, metadata->keyword_bitmask,
+	if (old_flags.kw_alloc_size > 0) {
+		memcpy(old_flags.keyword_bitmask,
+		       mailbox_view_get_keywords(view, seq),
 		       old_flags.kw_alloc_size);
 	}
 
-	mailbox_keywords_clear(view, metadata);
+	mailbox_keywords_clear(view, seq);
 	while (!IMAP_ARG_IS_EOL(args)) {
 		if (!imap_arg_get_atom(args, &atom)) {
 			imap_client_input_error(client,
@@ -182,12 +187,15 @@ message_metadata_set_flags(struct imap_client *client, const struct imap_arg *ar
 			kw = array_idx_modifiable(&view->keywords, idx);
 			kw->msg_refcount++;
 			i_assert(kw->msg_refcount <= array_count(&view->uidmap));
-			metadata->keyword_bitmask[idx/8] |= 1 << (idx % 8);
+			/* adding the keyword may have reallocated them */
+			keyword_bitmask = mailbox_view_get_keywords(view, seq);
+			keyword_bitmask[idx/8] |= 1 << (idx % 8);
 		}
 
 		args++;
 	}
 	metadata->mail_flags = flags | MAIL_FLAGS_SET;
+	keyword_bitmask = mailbox_view_get_keywords(view, seq);
 
 	if ((old_flags.flags & MAIL_FLAGS_SET) == 0) {
 		/* we don't know the old flags */
@@ -197,12 +205,14 @@ message_metadata_set_flags(struct imap_client *client, const struct imap_arg *ar
 	} else if (metadata->ms == NULL) {
 		/* UID now known yet, don't do any owning checks */
 	} else if (metadata->ms->owner_client_idx1 == client->client.idx+1) {
-		if (have_unexpected_changes(client, &old_flags, metadata)) {
+		if (have_unexpected_changes(client, &old_flags, metadata,
+					    keyword_bitmask)) {
 			imap_client_state_error(client,
 				"Flags unexpectedly changed for owned message");
 		}
 	} else if (client->storage->assign_flag_owners)
-		check_unexpected_flag_changes(client, &old_flags, metadata);
+		check_unexpected_flag_changes(client, &old_flags, metadata,
+					      keyword_bitmask);
 
 	if ((flags & MAIL_RECENT) != 0 && metadata->ms != NULL &&
 	    !client->storage->dont_track_recent) {
@@ -330,14 +340,12 @@ static void
 headers_match(struct imap_client *client, ARRAY_TYPE(message_header) *headers_arr,
 	      struct message_global *msg)
 {
-	pool_t pool = mailbox_source_get_messages_pool(client->storage->source);
+	struct mailbox_source *source = client->storage->source;
 	const struct message_header *fetch_headers, *orig_headers;
-	struct message_header msg_header;
-	unsigned char *value;
 	unsigned int i, j, fetch_count, orig_count;
 
 	if (!array_is_created(&msg->headers))
-		p_array_init(&msg->headers, pool, 8);
+		i_array_init(&msg->headers, 8);
 
 	fetch_headers = array_get_modifiable(headers_arr, &fetch_count);
 	orig_headers = array_get(&msg->headers, &orig_count);
@@ -349,16 +357,9 @@ headers_match(struct imap_client *client, ARRAY_TYPE(message_header) *headers_ar
 		}
 		if (j == orig_count) {
 			/* first time we've seen this, add it */
-			i_zero(&msg_header);
-			msg_header.name = p_strdup(pool, fetch_headers[i].name);
-			msg_header.value_len = fetch_headers[i].value_len;
-			msg_header.missing = fetch_headers[i].missing;
-			if (msg_header.value_len != 0) {
-				value = p_malloc(pool, msg_header.value_len);
-				memcpy(value, fetch_headers[i].value,
-				       msg_header.value_len);
-				msg_header.value = value;
-				array_append(&msg->headers, &msg_header, 1);
+			if (fetch_headers[i].value_len != 0) {
+				mailbox_source_msg_add_header(source, msg,
+							      &fetch_headers[i]);
 			}
 			orig_headers = array_get(&msg->headers, &orig_count);
 		} else if (fetch_headers[i].missing != orig_headers[j].missing ||
@@ -445,7 +446,6 @@ fetch_parse_header_fields(struct imap_client *client, const struct imap_arg *arg
 static void fetch_parse_body1(struct imap_client *client, const struct imap_arg *arg,
 			      struct message_metadata_static *ms)
 {
-	pool_t pool = mailbox_source_get_messages_pool(client->storage->source);
 	const char *body;
 	unsigned int i, start, len;
 
@@ -453,7 +453,7 @@ static void fetch_parse_body1(struct imap_client *client, const struct imap_arg
 		if (array_count(&ms->msg->body_words) >= MSG_MAX_BODY_WORDS)
 			return;
 	} else {
-		p_array_init(&ms->msg->body_words, pool, MSG_MAX_BODY_WORDS);
+		i_array_init(&ms->msg->body_words, MSG_MAX_BODY_WORDS);
 	}
 	if (!imap_arg_get_nstring(arg, &body) || body == NULL)
 		return;
@@ -475,8 +475,9 @@ static void fetch_parse_body1(struct imap_client *client, const struct imap_arg
 			}
 		}
 		if (len > 0) {
-			body = p_strndup(pool, body + start, len);
-			array_append(&ms->msg->body_words, &body, 1);
+			mailbox_source_msg_add_body_word(client->storage->source,
+							 ms->msg, body + start,
+							 len);
 		}
 	}
 }
@@ -578,12 +579,15 @@ void mailbox_state_handle_fetch(struct imap_client *client, unsigned int seq,
 					"FLAGS reply isn't a list");
 				continue;
 			}
-			message_metadata_set_flags(client, listargs, metadata);
+			message_metadata_set_flags(client, listargs, seq,
+						   metadata);
+			mailbox_storage_set_dirty(view->storage, uid);
 			continue;
 		}
 
 		if (strcmp(name, "MODSEQ") == 0) {
 			message_metadata_set_modseq(client, value, metadata);
+			mailbox_storage_set_dirty(view->storage, uid);
 			continue;
 		}
 
@@ -675,8 +679,8 @@ void mailbox_state_handle_fetch(struct imap_client *client, unsigned int seq,
 					metadata->ms->msg->message_id, name,
 					*p, value);
 			}
-			*p = p_strdup(mailbox_source_get_messages_pool(view->storage->source),
-				      value);
+			mailbox_source_msg_set_string(view->storage->source,
+						      p, value);
 		} else if (sizep != NULL) {
 			if (value_size == (uoff_t)-1) {
 				/* not RFC822.SIZE - get the size */
@@ -3,7 +3,7 @@
 #include "lib.h"
 #include "ioloop.h"
 #include "array.h"
-#include "bsearch-insert-pos.h"
+#include "llist.h"
 #include "str.h"
 #include "hash.h"
 #include "istream.h"
@@ -17,12 +17,20 @@
 #include "client.h"
 #include "mailbox-source.h"
 #include "mailbox.h"
+#include "checkpoint.h"
+#include "uid-tree.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
 
 #define MESSAGE_STATIC_REF0_KEEP_SECS 5
 
+/* Number of storages listed by mailbox_storages_print_memory_usage() */
+#define MAILBOX_STORAGES_PRINT_MAX 10
+/* Flush queued expunges when they're split into this many ranges */
+#define MAILBOX_VIEW_MAX_PENDING_EXPUNGE_RANGES 64
+
 HASH_TABLE_TYPE(mailbox_storage) storages;
 
 const char *mail_flag_names[] = {
@@ -34,13 +42,6 @@ const char *mail_flag_names[] = {
 	"\\Recent"
 };
 
-static int metadata_static_cmp(const uint32_t *uidp,
-			       struct message_metadata_static *const *ms)
-{
-	return *uidp < (*ms)->uid ? -1 :
-		(*uidp > (*ms)->uid ? 1 : 0);
-}
-
 struct message_metadata_static *
 message_metadata_static_lookup_seq(struct mailbox_view *view, uint32_t seq)
 {
@@ -51,11 +52,18 @@ message_metadata_static_lookup_seq(struct mailbox_view *view, uint32_t seq)
 	return seq > count ? NULL : metadata[seq-1].ms;
 }
 
+static void
+message_metadata_static_free(struct mailbox_storage *storage,
+			     struct message_metadata_static *ms)
+{
+	mailbox_source_msg_unref(storage->source, &ms->msg);
+	i_free(ms);
+}
+
 void message_metadata_static_unref(struct mailbox_storage *storage,
 				   struct message_metadata_static **_ms)
 {
 	struct message_metadata_static *ms = *_ms;
-	unsigned int idx;
 
 	*_ms = NULL;
 	i_assert(ms->refcount > 0);
@@ -63,78 +71,62 @@ void message_metadata_static_unref(struct mailbox_storage *storage,
 		return;
 	if (!ms->expunged) {
 		/* unreferencing non-expunged messages get problematic if the
-		   message owner client changes. so delay the final free. */
+		   message owner client changes. so delay the final free.
+		   the timeout is always the same, so appending keeps the
+		   queue sorted. */
 		ms->ref0_timeout = ioloop_time + MESSAGE_STATIC_REF0_KEEP_SECS;
-		if (storage->static_metadata_ref0_count++ == 0) {
-			storage->static_metadata_ref0_next_scan =
-				ioloop_time + MESSAGE_STATIC_REF0_KEEP_SECS;
-		}
+		DLLIST2_APPEND_FULL(&storage->static_metadata_ref0_head,
+				    &storage->static_metadata_ref0_tail, ms,
+				    ref0_prev, ref0_next);
 		return;
 	}
 
-	if (!array_bsearch_insert_pos(&storage->static_metadata,
-				      &ms->uid, metadata_static_cmp, &idx))
+	if (uid_tree_remove(storage->static_metadata, ms->uid) != ms)
 		i_unreached();
-	else
-		array_delete(&storage->static_metadata, idx, 1);
-	i_free(ms);
+	message_metadata_static_free(storage, ms);
 }
 
 static void message_metadata_static_free_old(struct mailbox_storage *storage)
 {
-	struct message_metadata_static **ms;
-	unsigned int i, count, seen = 0;
-	time_t oldest = 0;
-
-	ms = array_get_modifiable(&storage->static_metadata, &count);
-	i = 0;
-	while (i < count && seen < storage->static_metadata_ref0_count) {
-		if (ms[i]->refcount != 0) {
-			i++;
-			continue;
-		}
-		/* removed */
-		if (ioloop_time < ms[i]->ref0_timeout) {
-			if (oldest == 0 || oldest > ms[i]->ref0_timeout)
-				oldest = ms[i]->ref0_timeout;
-			i++; seen++;
-			continue;
-		}
-		storage->static_metadata_ref0_count--;
-		i_free(ms[i]);
-
-		array_delete(&storage->static_metadata, i, 1);
-		ms = array_get_modifiable(&storage->static_metadata, &count);
+	struct message_metadata_static *ms;
+
+	while ((ms = storage->static_metadata_ref0_head) != NULL &&
+	       ioloop_time >= ms->ref0_timeout) {
+		i_assert(ms->refcount == 0);
+		DLLIST2_REMOVE_FULL(&storage->static_metadata_ref0_head,
+				    &storage->static_metadata_ref0_tail, ms,
+				    ref0_prev, ref0_next);
+		if (uid_tree_remove(storage->static_metadata, ms->uid) != ms)
+			i_unreached();
+		message_metadata_static_free(storage, ms);
 	}
-	storage->static_metadata_ref0_next_scan = oldest;
 }
 
 struct message_metadata_static *
 message_metadata_static_get(struct mailbox_storage *storage, uint32_t uid)
 {
-	struct message_metadata_static **base, *ms;
+	struct message_metadata_static *ms;
 	const struct seq_range *range;
-	unsigned int count, idx;
+	unsigned int count;
 	uint32_t first_uid;
 
-	if (storage->static_metadata_ref0_count > 0 &&
-	    ioloop_time >= storage->static_metadata_ref0_next_scan)
-		message_metadata_static_free_old(storage);
+	message_metadata_static_free_old(storage);
 
-	base = array_get_modifiable(&storage->static_metadata, &count);
-	if (bsearch_insert_pos(&uid, base, count, sizeof(*base),
-			       metadata_static_cmp, &idx)) {
-		ms = base[idx];
+	ms = uid_tree_lookup(storage->static_metadata, uid);
+	if (ms != NULL) {
 		if (ms->refcount++ == 0) {
-			i_assert(storage->static_metadata_ref0_count > 0);
-			storage->static_metadata_ref0_count--;
+			DLLIST2_REMOVE_FULL(&storage->static_metadata_ref0_head,
+					    &storage->static_metadata_ref0_tail,
+					    ms, ref0_prev, ref0_next);
 			ms->ref0_timeout = 0;
 		}
 		return ms;
 	}
 
 	/* see if we could compact expunged_uids array */
-	first_uid = idx == 0 ? uid : base[0]->uid;
+	first_uid = uid_tree_first_uid(storage->static_metadata);
+	if (first_uid == 0 || uid < first_uid)
+		first_uid = uid;
 	range = array_get(&storage->expunged_uids, &count);
 	if (count > 32 && first_uid > 2 && range[0].seq2 < first_uid-1) {
 		seq_range_array_add_range(&storage->expunged_uids,
@@ -144,10 +136,8 @@ message_metadata_static_get(struct mailbox_storage *storage, uint32_t uid)
 	ms = i_new(struct message_metadata_static, 1);
 	ms->uid = uid;
 	ms->refcount = 1;
-	array_insert(&storage->static_metadata, idx, &ms, 1);
-
-	base = array_idx_modifiable(&storage->static_metadata, idx);
-	return *base;
+	uid_tree_insert(storage->static_metadata, uid, ms);
+	return ms;
 }
 
 void message_metadata_static_assign_owner(struct mailbox_storage *storage,
@@ -163,19 +153,6 @@ void message_metadata_static_assign_owner(struct mailbox_storage *storage,
 		ms->owner_client_idx1 = clients_get_random_idx() + 1;
 }
 
-static void
-mailbox_keywords_ref(struct mailbox_view *view, const uint8_t *bitmask)
-{
-	struct mailbox_keyword *keywords;
-	unsigned int i, count;
-
-	keywords = array_get_modifiable(&view->keywords, &count);
-	for (i = 0; i < count; i++) {
-		if ((bitmask[i/8] & (1 << (i%8))) != 0)
-			keywords[i].msg_refcount++;
-	}
-}
-
 static void
 mailbox_keywords_drop(struct mailbox_view *view, const uint8_t *bitmask)
 {
@@ -191,15 +168,30 @@ mailbox_keywords_drop(struct mailbox_view *view, const uint8_t *bitmask)
 	}
 }
 
-void mailbox_view_expunge(struct mailbox_view *view, unsigned int seq)
+uint8_t *mailbox_view_get_keywords(struct mailbox_view *view,
+				   unsigned int seq)
 {
-	struct message_metadata_dynamic *metadata;
-	const uint32_t *uidp;
+	size_t size = view->keyword_bitmask_alloc_size;
+	size_t pos = (size_t)(seq - 1) * size;
+	uint8_t *data;
+
+	if (size == 0)
+		return NULL;
+	if (pos + size > view->keyword_bitmasks->used) {
+		buffer_append_zero(view->keyword_bitmasks,
+				   pos + size - view->keyword_bitmasks->used);
+	}
+	data = buffer_get_modifiable_data(view->keyword_bitmasks, NULL);
+	return data + pos;
+}
 
-	metadata = array_idx_modifiable(&view->messages, seq - 1);
-	if (metadata->keyword_bitmask != NULL)
-		mailbox_keywords_drop(view, metadata->keyword_bitmask);
-	i_free(metadata->keyword_bitmask);
+static void
+mailbox_view_expunge_metadata(struct mailbox_view *view,
+			      struct message_metadata_dynamic *metadata,
+			      const uint8_t *keywords)
+{
+	if (keywords != NULL)
+		mailbox_keywords_drop(view, keywords);
 
 	if (metadata->ms != NULL) {
 		seq_range_array_add(&view->storage->expunged_uids,
@@ -207,30 +199,157 @@ void mailbox_view_expunge(struct mailbox_view *view, unsigned int seq)
 		metadata->ms->expunged = TRUE;
 		message_metadata_static_unref(view->storage, &metadata->ms);
 	}
-	uidp = array_idx(&view->uidmap, seq-1);
-	if (*uidp != 0)
-		view->known_uid_count--;
-	array_delete(&view->uidmap, seq - 1, 1);
-	array_delete(&view->messages, seq - 1, 1);
+}
+
+unsigned int mailbox_view_pending_expunge_seq(struct mailbox_view *view,
+					      unsigned int seq)
+{
+	const struct seq_range *range;
+	unsigned int i, count;
+
+	range = array_get(&view->pending_expunges, &count);
+	for (i = 0; i < count && range[i].seq1 <= seq; i++)
+		seq += range[i].seq2 - range[i].seq1 + 1;
+	return seq;
+}
+
+void mailbox_view_expunge(struct mailbox_view *view, unsigned int seq)
+{
+	seq = mailbox_view_pending_expunge_seq(view, seq);
+	i_assert(seq > 0 && seq <= array_count(&view->uidmap));
+
+	seq_range_array_add(&view->pending_expunges, seq);
+	view->pending_expunge_count++;
+
+	/* mapping the sequences is linear in the number of ranges, so don't
+	   let them grow without bound */
+	if (array_count(&view->pending_expunges) >=
+	    MAILBOX_VIEW_MAX_PENDING_EXPUNGE_RANGES)
+		mailbox_view_expunges_flush(view);
+}
+
+void mailbox_view_expunges_flush(struct mailbox_view *view)
+{
+	if (view->pending_expunge_count == 0)
+		return;
+
+	mailbox_view_expunge_seqs(view, &view->pending_expunges);
+	array_clear(&view->pending_expunges);
+	view->pending_expunge_count = 0;
+}
+
+void mailbox_view_expunge_seqs(struct mailbox_view *view,
+			       const ARRAY_TYPE(seq_range) *seqs)
+{
+	struct message_metadata_dynamic *messages;
+	const struct seq_range *range;
+	uint32_t *uidmap;
+	uint8_t *keywords = NULL;
+	size_t kw_size = view->keyword_bitmask_alloc_size, kw_used;
+	unsigned int i, src, dest, uid_count, msg_count, range_count;
+	unsigned int kw_count = 0, kw_expunged = 0;
+
+	range = array_get(seqs, &range_count);
+	if (range_count == 0)
+		return;
+	i_assert(range[0].seq1 > 0);
+	i_assert(range[range_count-1].seq2 <= array_count(&view->uidmap));
+
+	/* make sure all the expunged messages have metadata, so the
+	   messages array doesn't need to be handled specially below */
+	(void)array_idx_get_space(&view->messages,
+				  range[range_count-1].seq2 - 1);
+	uidmap = array_get_modifiable(&view->uidmap, &uid_count);
+	messages = array_get_modifiable(&view->messages, &msg_count);
+	if (kw_size > 0) {
+		keywords = buffer_get_modifiable_data(view->keyword_bitmasks,
+						      &kw_used);
+		kw_count = kw_used / kw_size;
+	}
+
+	/* move the remaining messages over the expunged ones in a single
+	   pass instead of deleting them one at a time */
+	src = dest = range[0].seq1 - 1;
+	for (i = 0; i < range_count; i++) {
+		for (; src < range[i].seq1 - 1; src++, dest++) {
+			uidmap[dest] = uidmap[src];
+			messages[dest] = messages[src];
+			if (src < kw_count) {
+				memcpy(keywords + dest * kw_size,
+				       keywords + src * kw_size, kw_size);
+			}
+		}
+		for (; src < range[i].seq2; src++) {
+			if (src < kw_count) {
+				mailbox_view_expunge_metadata(view,
+					&messages[src], keywords + src * kw_size);
+				kw_expunged++;
+			} else {
+				mailbox_view_expunge_metadata(view,
+					&messages[src], NULL);
+			}
+			if (uidmap[src] != 0)
+				view->known_uid_count--;
+		}
+	}
+	for (i = src; i < msg_count; i++)
+		messages[dest + (i - src)] = messages[i];
+	memmove(uidmap + dest, uidmap + src,
+		(uid_count - src) * sizeof(*uidmap));
+	if (src < kw_count) {
+		memmove(keywords + dest * kw_size, keywords + src * kw_size,
+			(kw_count - src) * kw_size);
+	}
+	if (kw_size > 0) {
+		buffer_set_used_size(view->keyword_bitmasks,
+				     (kw_count - kw_expunged) * kw_size);
+	}
+	array_delete(&view->uidmap, uid_count - (src - dest), src - dest);
+	array_delete(&view->messages, msg_count - (src - dest), src - dest);
 
 	if (array_count(&view->uidmap) == 0)
 		view->storage->seen_all_recent = TRUE;
 }
 
+bool mailbox_view_uid_lookup(struct mailbox_view *view, uint32_t uid,
+			     unsigned int *idx_r)
+{
+	const uint32_t *uidmap;
+	unsigned int idx, left, right, count, found;
+
+	/* binary search over the known UIDs. unknown UIDs (0) are skipped
+	   by moving to the next known UID, so this degrades to a linear scan
+	   only when most of the UIDs are unknown. */
+	uidmap = array_get(&view->uidmap, &count);
+	found = count;
+	left = 0; right = count;
+	while (left < right) {
+		idx = (left + right) / 2;
+		while (idx < right && uidmap[idx] == 0)
+			idx++;
+		if (idx == right)
+			right = (left + right) / 2;
+		else if (uidmap[idx] >= uid) {
+			found = idx;
+			right = (left + right) / 2;
+		} else {
+			left = idx + 1;
+		}
+	}
+	*idx_r = found;
+	return found < count && uidmap[found] == uid;
+}
+
 bool mailbox_view_keyword_find(struct mailbox_view *view, const char *name,
 			       unsigned int *idx_r)
 {
-	const struct mailbox_keyword *keywords;
-	unsigned int i, count;
+	void *value;
 
-	keywords = array_get(&view->keywords, &count);
-	for (i = 0; i < count; i++) {
-		if (strcasecmp(keywords[i].name->name, name) == 0) {
-			*idx_r = i;
-			return TRUE;
-		}
-	}
-	return FALSE;
+	value = hash_table_lookup(view->keywords_hash, name);
+	if (value == NULL)
+		return FALSE;
+	*idx_r = POINTER_CAST_TO(value, unsigned int) - 1;
+	return TRUE;
 }
 
 struct mailbox_keyword *mailbox_view_keyword_get(struct mailbox_view *view,
@@ -258,20 +377,18 @@ mailbox_view_keyword_get_by_name(struct mailbox_view *view,
 static struct mailbox_keyword_name *
 mailbox_keyword_name_get(struct mailbox_storage *storage, const char *name)
 {
-	struct mailbox_keyword_name *const *names, *kw;
-	unsigned int i, count;
+	struct mailbox_keyword_name *kw;
 
-	names = array_get(&storage->keyword_names, &count);
-	for (i = 0; i < count; i++) {
-		if (strcasecmp(names[i]->name, name) == 0)
-			return names[i];
-	}
+	kw = hash_table_lookup(storage->keyword_names_hash, name);
+	if (kw != NULL)
+		return kw;
 
 	kw = i_new(struct mailbox_keyword_name, 1);
 	kw->name = i_strdup(name);
 	if (storage->assign_flag_owners)
 		kw->owner_client_idx1 = clients_get_random_idx() + 1;
 	array_append(&storage->keyword_names, &kw, 1);
+	hash_table_insert(storage->keyword_names_hash, kw->name, kw);
 	return kw;
 }
 
@@ -286,41 +403,51 @@ void mailbox_view_keyword_add(struct mailbox_view *view, const char *name)
 	array_append(&view->keywords, &keyword, 1);
 
 	count = array_count(&view->keywords);
+	hash_table_insert(view->keywords_hash, keyword.name->name,
+			  POINTER_CAST(count));
 	if ((count+7)/8 > view->keyword_bitmask_alloc_size)
 		mailbox_view_keywords_realloc(view, (count+7) / 8 * 4);
 }
 
-void mailbox_keywords_clear(struct mailbox_view *view,
-			    struct message_metadata_dynamic *metadata)
+void mailbox_keywords_clear(struct mailbox_view *view, unsigned int seq)
 {
-	if (view->keyword_bitmask_alloc_size == 0)
+	uint8_t *keywords;
+
+	keywords = mailbox_view_get_keywords(view, seq);
+	if (keywords == NULL)
 		return;
 
-	if (metadata->keyword_bitmask == NULL) {
-		metadata->keyword_bitmask =
-			i_malloc(view->keyword_bitmask_alloc_size);
-	} else {
-		mailbox_keywords_drop(view, metadata->keyword_bitmask);
-	}
-	memset(metadata->keyword_bitmask, 0,
-	       view->keyword_bitmask_alloc_size);
+	mailbox_keywords_drop(view, keywords);
+	memset(keywords, 0, view->keyword_bitmask_alloc_size);
 }
 
 void mailbox_view_keywords_realloc(struct mailbox_view *view,
 				   unsigned int new_alloc_size)
 {
-	struct message_metadata_dynamic *metadata;
-	unsigned int i, count, old_alloc_size;
+	buffer_t *new_bitmasks;
+	const uint8_t *data;
+	unsigned int old_alloc_size;
+	size_t i, count, used;
 
 	old_alloc_size = view->keyword_bitmask_alloc_size;
+	i_assert(new_alloc_size >= old_alloc_size);
 	view->keyword_bitmask_alloc_size = new_alloc_size;
+	if (old_alloc_size == 0 || view->keyword_bitmasks->used == 0)
+		return;
 
-	metadata = array_get_modifiable(&view->messages, &count);
+	/* widen all the bitmasks with a single pass over the buffer */
+	data = buffer_get_data(view->keyword_bitmasks, &used);
+	count = used / old_alloc_size;
+	new_bitmasks = buffer_create_dynamic(default_pool,
+					     count * new_alloc_size);
 	for (i = 0; i < count; i++) {
-		metadata[i].keyword_bitmask =
-			i_realloc(metadata[i].keyword_bitmask,
-				  old_alloc_size, new_alloc_size);
+		buffer_append(new_bitmasks, data + i * old_alloc_size,
+			      old_alloc_size);
+		buffer_append_zero(new_bitmasks,
+				   new_alloc_size - old_alloc_size);
 	}
+	buffer_free(&view->keyword_bitmasks);
+	view->keyword_bitmasks = new_bitmasks;
 }
 
 enum mail_flags mail_flag_parse(const char *str)
@@ -393,6 +520,33 @@ const char *mailbox_view_keywords_to_str(struct mailbox_view *view,
 	return str_c(str);
 }
 
+static void
+mailbox_view_append_random_keyword(struct mailbox_view *view,
+				   unsigned int client_idx, const char *name,
+				   string_t *str)
+{
+	struct mailbox_keyword *kw;
+	unsigned int idx;
+
+	if (!mailbox_view_keyword_find(view, name, &idx))
+		kw = NULL;
+	else
+		kw = mailbox_view_keyword_get(view, idx);
+	if (kw == NULL && !view->keywords_can_create_more) {
+		/* can't create it */
+		return;
+	}
+
+	if (view->storage->assign_flag_owners && kw != NULL &&
+	    kw->name->owner_client_idx1 != client_idx + 1) {
+		/* not our keyword, can't set it */
+		return;
+	}
+	if (str_len(str) != 0)
+		str_append_c(str, ' ');
+	str_append(str, name);
+}
+
 const char *mailbox_view_get_random_flags(struct mailbox_view *view,
 					  unsigned int client_idx)
 {
@@ -400,8 +554,7 @@ const char *mailbox_view_get_random_flags(struct mailbox_view *view,
 	static const char *keywords[] = {
 		"$Label1", "$Label2", "$Label3", "$Label4", "$Label5"
 	};
-	struct mailbox_keyword *kw;
-	unsigned int i, idx;
+	unsigned int i, count;
 	string_t *str;
 
 	if (!storage->flag_owner_clients_assigned &&
@@ -439,24 +592,20 @@ const char *mailbox_view_get_random_flags(struct mailbox_view *view,
 	for (i = 0; i < N_ELEMENTS(keywords); i++) {
 		if ((i_rand_limit(4)) != 0)
 			continue;
+		mailbox_view_append_random_keyword(view, client_idx,
+						   keywords[i], str);
+	}
 
-		if (!mailbox_view_keyword_find(view, keywords[i], &idx))
-			kw = NULL;
-		else
-			kw = mailbox_view_keyword_get(view, idx);
-		if (kw == NULL && !view->keywords_can_create_more) {
-			/* can't create it */
-			continue;
-		}
-
-		if (storage->assign_flag_owners && kw != NULL &&
-		    kw->name->owner_client_idx1 != client_idx + 1) {
-			/* not our keyword, can't set it */
-			continue;
+	if (conf.keywords_count > 0) {
+		/* keyword storm: pick a few from a large vocabulary, so the
+		   mailbox gradually accumulates all of them */
+		count = i_rand_limit(KEYWORD_STORM_MAX_PER_MSG) + 1;
+		for (i = 0; i < count; i++) {
+			mailbox_view_append_random_keyword(view, client_idx,
+				t_strdup_printf("$Storm%u",
+					i_rand_limit(conf.keywords_count) + 1),
+				str);
 		}
-		if (str_len(str) != 0)
-			str_append_c(str, ' ');
-		str_append(str, keywords[i]);
 	}
 
 #ifdef RAND_KEYWORDS
@@ -481,7 +630,6 @@ mailbox_metadata_free(struct mailbox_storage *storage,
 
 	metadata = array_get_modifiable(messages, &count);
 	for (i = 0; i < count; i++) {
-		i_free(metadata[i].keyword_bitmask);
 		if (metadata[i].ms != NULL)
 			message_metadata_static_unref(storage, &metadata[i].ms);
 	}
@@ -498,6 +646,8 @@ mailbox_offline_cache_alloc(struct mailbox_storage *storage)
 	i_array_init(&cache->keywords, 64);
 	i_array_init(&cache->uidmap, 128);
 	i_array_init(&cache->messages, 128);
+	i_array_init(&cache->keyword_msg_counts, 64);
+	cache->keyword_bitmasks = buffer_create_dynamic(default_pool, 256);
 	return cache;
 }
 
@@ -507,6 +657,8 @@ static void mailbox_offline_cache_free(struct mailbox_offline_cache *cache)
 	array_free(&cache->keywords);
 	array_free(&cache->uidmap);
 	array_free(&cache->messages);
+	array_free(&cache->keyword_msg_counts);
+	buffer_free(&cache->keyword_bitmasks);
 	i_free(cache);
 }
 
@@ -544,10 +696,15 @@ mailbox_storage_get(struct mailbox_source *source, const char *username,
 		storage->assign_msg_owners = conf.own_msgs;
 		storage->assign_flag_owners = conf.own_flags;
 		i_array_init(&storage->expunged_uids, 128);
-		i_array_init(&storage->static_metadata, 128);
+		i_array_init(&storage->checkpoint_dirty_uids, 64);
+		storage->checkpoint_full = TRUE;
+		storage->static_metadata = uid_tree_init();
 		i_array_init(&storage->keyword_names, 64);
+		hash_table_create(&storage->keyword_names_hash, default_pool,
+				  0, strcase_hash, strcasecmp);
 		hash_table_insert(storages, storage->guid, storage);
 		mailbox_source_ref(storage->source);
+		checkpoint_storage_add(storage);
 	} else {
 		i_assert(storage->source == source);
 		storage->refcount++;
@@ -563,23 +720,38 @@ void mailbox_storage_unref(struct mailbox_storage **_storage)
 
 	if (--storage->refcount > 0)
 		return;
+	i_assert(storage->clients_head == NULL);
 
+	checkpoint_storage_remove(storage);
 	hash_table_remove(storages, storage->guid);
 	mailbox_storage_reset(storage);
 
 	mailbox_source_unref(&storage->source);
 	array_free(&storage->expunged_uids);
-	array_free(&storage->static_metadata);
+	array_free(&storage->checkpoint_dirty_uids);
+	uid_tree_deinit(&storage->static_metadata);
 	array_free(&storage->keyword_names);
+	hash_table_destroy(&storage->keyword_names_hash);
 	i_free(storage->name);
 	i_free(storage->guid);
 	i_free(storage);
 }
 
+void mailbox_storage_set_dirty(struct mailbox_storage *storage, uint32_t uid)
+{
+	if (uid == 0) {
+		storage->checkpoint_full = TRUE;
+		array_clear(&storage->checkpoint_dirty_uids);
+	} else if (!storage->checkpoint_full)
+		seq_range_array_add(&storage->checkpoint_dirty_uids, uid);
+}
+
 void mailbox_storage_reset(struct mailbox_storage *storage)
 {
 	struct mailbox_keyword_name **names;
-	struct message_metadata_static **ms;
+	struct message_metadata_static *ms;
+	struct uid_tree_iter iter;
+	void *value;
 	unsigned int i, count;
 
 	if (storage->cache != NULL) {
@@ -588,6 +760,7 @@ void mailbox_storage_reset(struct mailbox_storage *storage)
 		storage->cache = NULL;
 	}
 
+	hash_table_clear(storage->keyword_names_hash, FALSE);
 	names = array_get_modifiable(&storage->keyword_names, &count);
 	for (i = 0; i < count; i++) {
 		i_free(names[i]->name);
@@ -595,18 +768,21 @@ void mailbox_storage_reset(struct mailbox_storage *storage)
 	}
 	array_clear(&storage->keyword_names);
 
-	ms = array_get_modifiable(&storage->static_metadata, &count);
-	for (i = 0; i < count; i++) {
-		i_assert(ms[i]->refcount == 0);
-		i_free(ms[i]);
+	uid_tree_iter_init(storage->static_metadata, 0, &iter);
+	while (uid_tree_iter_next(&iter, &value)) {
+		ms = value;
+		i_assert(ms->refcount == 0);
+		message_metadata_static_free(storage, ms);
 	}
-	array_clear(&storage->static_metadata);
+	uid_tree_clear(storage->static_metadata);
+	storage->static_metadata_ref0_head = NULL;
+	storage->static_metadata_ref0_tail = NULL;
 
 	array_clear(&storage->expunged_uids);
+	array_clear(&storage->checkpoint_dirty_uids);
+	storage->checkpoint_full = TRUE;
 
 	storage->uidvalidity = 0;
-	storage->static_metadata_ref0_count = 0;
-	storage->static_metadata_ref0_next_scan = 0;
 
 	memset(storage->flags_owner_client_idx1, 0,
 	       sizeof(storage->flags_owner_client_idx1));
@@ -626,6 +802,10 @@ struct mailbox_view *mailbox_view_new(struct mailbox_storage *storage)
 	i_array_init(&view->uidmap, 100);
 	i_array_init(&view->messages, 100);
 	i_array_init(&view->keywords, 128);
+	hash_table_create(&view->keywords_hash, default_pool, 0,
+			  strcase_hash, strcasecmp);
+	view->keyword_bitmasks = buffer_create_dynamic(default_pool, 256);
+	i_array_init(&view->pending_expunges, 8);
 	return view;
 }
 
@@ -640,21 +820,25 @@ void mailbox_offline_cache_unref(struct mailbox_offline_cache **_cache)
 		mailbox_offline_cache_free(cache);
 }
 
-bool mailbox_view_save_offline_cache(struct mailbox_view *view)
+bool mailbox_view_can_save_offline_cache(struct mailbox_view *view)
 {
-	struct mailbox_offline_cache *cache;
-	const struct mailbox_keyword *keywords;
-	const struct message_metadata_dynamic *metadata;
-	struct message_metadata_dynamic new_metadata;
-	unsigned int i, count, keyword_bytecount;
-
 	if (view->known_uid_count != array_count(&view->uidmap)) {
 		/* some UIDs are not known, can't really handle this */
 		return FALSE;
 	}
+	return view->highest_modseq != 0;
+}
 
-	if (view->highest_modseq == 0)
-		return FALSE;
+void mailbox_view_save_offline_cache(struct mailbox_view *view)
+{
+	struct mailbox_offline_cache *cache;
+	struct mailbox_keyword *keywords;
+	struct message_metadata_dynamic *metadata;
+	buffer_t *bitmasks;
+	unsigned int i, count;
+
+	i_assert(mailbox_view_can_save_offline_cache(view));
+	i_assert(view->pending_expunge_count == 0);
 
 	if (view->storage->cache != NULL)
 		mailbox_offline_cache_unref(&view->storage->cache);
@@ -664,39 +848,32 @@ bool mailbox_view_save_offline_cache(struct mailbox_view *view)
 	cache->uidvalidity = view->storage->uidvalidity;
 	cache->highest_modseq = view->highest_modseq;
 
-	/* copy keywords */
-	array_clear(&cache->keywords);
-	keywords = array_get(&view->keywords, &count);
-	keyword_bytecount = (count + 7) / 8;
-	i_assert(keyword_bytecount <= view->keyword_bitmask_alloc_size);
-	for (i = 0; i < count; i++)
+	/* copy keywords. their message counts move to the cache along with
+	   the messages. */
+	keywords = array_get_modifiable(&view->keywords, &count);
+	for (i = 0; i < count; i++) {
 		array_append(&cache->keywords, &keywords[i].name, 1);
+		array_append(&cache->keyword_msg_counts,
+			     &keywords[i].msg_refcount, 1);
+		keywords[i].msg_refcount = 0;
+	}
 
-	/* copy UID map */
-	array_clear(&cache->uidmap);
-	array_append_array(&cache->uidmap, &view->uidmap);
+	/* move the UID map, messages and their keywords */
+	array_swap(&cache->uidmap, &view->uidmap);
+	array_swap(&cache->messages, &view->messages);
+	bitmasks = cache->keyword_bitmasks;
+	cache->keyword_bitmasks = view->keyword_bitmasks;
+	cache->keyword_bitmask_size = view->keyword_bitmask_alloc_size;
+	view->keyword_bitmasks = bitmasks;
+	view->known_uid_count = 0;
 
-	/* copy messages */
-	array_clear(&cache->messages);
-	metadata = array_get(&view->messages, &count);
+	metadata = array_get_modifiable(&cache->messages, &count);
 	for (i = 0; i < count; i++) {
-		new_metadata = metadata[i];
 		/* \Recent flags get dropped after a reconnection */
-		new_metadata.mail_flags &= ~MAIL_RECENT;
-		new_metadata.fetch_refcount = 0;
-		new_metadata.flagchange_dirty_type = FLAGCHANGE_DIRTY_NO;
-
-		if (metadata[i].keyword_bitmask != NULL) {
-			new_metadata.keyword_bitmask =
-				i_malloc(keyword_bytecount);
-			memcpy(new_metadata.keyword_bitmask,
-			       metadata[i].keyword_bitmask, keyword_bytecount);
-		}
-		if (new_metadata.ms != NULL)
-			new_metadata.ms->refcount++;
-		array_append(&cache->messages, &new_metadata, 1);
+		metadata[i].mail_flags &= ~MAIL_RECENT;
+		metadata[i].fetch_refcount = 0;
+		metadata[i].flagchange_dirty_type = FLAGCHANGE_DIRTY_NO;
 	}
-	return TRUE;
 }
 
 void mailbox_view_restore_offline_cache(struct mailbox_view *view,
@@ -705,14 +882,19 @@ void mailbox_view_restore_offline_cache(struct mailbox_view *view,
 	ARRAY_TYPE(mailbox_keyword) old_keywords;
 	struct mailbox_keyword_name *const *kw_names;
 	const struct mailbox_keyword *keywords;
-	struct mailbox_keyword *new_kw;
-	const struct message_metadata_dynamic *metadata;
-	struct message_metadata_dynamic new_metadata;
-	unsigned int i, count;
+	struct mailbox_keyword *new_kw, *new_keywords;
+	struct message_metadata_dynamic *metadata;
+	const unsigned int *msg_counts;
+	const uint8_t *cache_bitmasks;
+	uint8_t *bitmask;
+	size_t used;
+	unsigned int i, count, kw_size;
 
 	i_assert(array_count(&view->messages) == 0);
 
 	view->highest_modseq = cache->highest_modseq;
+	/* the restored flags didn't go through the FETCH handling */
+	mailbox_storage_set_dirty(view->storage, 0);
 
 	/* make a copy of old keywords - we need to set them back */
 	t_array_init(&old_keywords, array_count(&view->keywords) + 1);
@@ -720,6 +902,7 @@ void mailbox_view_restore_offline_cache(struct mailbox_view *view,
 
 	/* copy keywords */
 	array_clear(&view->keywords);
+	hash_table_clear(view->keywords_hash, TRUE);
 	kw_names = array_get(&cache->keywords, &count);
 	for (i = 0; i < count; i++)
 		mailbox_view_keyword_add(view, kw_names[i]->name);
@@ -731,21 +914,34 @@ void mailbox_view_restore_offline_cache(struct mailbox_view *view,
 
 	/* copy messages */
 	array_clear(&view->messages);
-	metadata = array_get(&cache->messages, &count);
+	array_append_array(&view->messages, &cache->messages);
+	metadata = array_get_modifiable(&view->messages, &count);
 	for (i = 0; i < count; i++) {
-		new_metadata = metadata[i];
-		if (metadata[i].keyword_bitmask != NULL) {
-			new_metadata.keyword_bitmask =
-				i_malloc(view->keyword_bitmask_alloc_size);
-			memcpy(new_metadata.keyword_bitmask,
-			       metadata[i].keyword_bitmask,
-			       view->keyword_bitmask_alloc_size);
-			mailbox_keywords_ref(view, new_metadata.keyword_bitmask);
+		if (metadata[i].ms != NULL)
+			metadata[i].ms->refcount++;
+	}
+
+	/* copy message keywords. the keywords are in the same order as in
+	   the cache, so the bitmasks can be copied as-is. */
+	buffer_set_used_size(view->keyword_bitmasks, 0);
+	cache_bitmasks = buffer_get_data(cache->keyword_bitmasks, &used);
+	kw_size = cache->keyword_bitmask_size;
+	if (kw_size == view->keyword_bitmask_alloc_size)
+		buffer_append(view->keyword_bitmasks, cache_bitmasks, used);
+	else if (kw_size > 0 && view->keyword_bitmask_alloc_size > 0) {
+		count = used / kw_size;
+		for (i = 0; i < count; i++) {
+			bitmask = mailbox_view_get_keywords(view, i + 1);
+			memcpy(bitmask, cache_bitmasks + i * kw_size,
+			       I_MIN(kw_size,
+				     view->keyword_bitmask_alloc_size));
 		}
-		if (new_metadata.ms != NULL)
-			new_metadata.ms->refcount++;
-		array_append(&view->messages, &new_metadata, 1);
 	}
+	new_keywords = array_get_modifiable(&view->keywords, &count);
+	msg_counts = array_get(&cache->keyword_msg_counts, &i);
+	i_assert(i == count);
+	for (i = 0; i < count; i++)
+		new_keywords[i].msg_refcount = msg_counts[i];
 
 	/* add missing keywords and update permanent state of cached keywords */
 	keywords = array_get(&old_keywords, &count);
@@ -765,8 +961,11 @@ void mailbox_view_free(struct mailbox_view **_mailbox)
 	mailbox_metadata_free(view->storage, &view->messages);
 	array_free(&view->messages);
 	array_free(&view->keywords);
+	hash_table_destroy(&view->keywords_hash);
+	buffer_free(&view->keyword_bitmasks);
 
 	array_free(&view->uidmap);
+	array_free(&view->pending_expunges);
 	i_free(view->last_thread_reply);
 	i_free(view);
 }
@@ -783,7 +982,7 @@ mailbox_global_parse_envelope(struct mailbox_source *source,
 		return FALSE;
 
 	msg->sent_date = (time_t)-1;
-	msg->subject_utf8_tcase = NULL;
+	mailbox_source_msg_set_string(source, &msg->subject_utf8_tcase, NULL);
 	if (!imap_envelope_parse(msg->envelope,
 		pool_datastack_create(), &env, &error)) {
 		i_error("Error parsing IMAP envelope: %s", error);
@@ -800,8 +999,8 @@ mailbox_global_parse_envelope(struct mailbox_source *source,
 			uni_utf8_to_decomposed_titlecase);
 		subject = str_c(tmp);
 	}
-	msg->subject_utf8_tcase = p_strdup
-		(mailbox_source_get_messages_pool(source), subject);
+	mailbox_source_msg_set_string(source, &msg->subject_utf8_tcase,
+				      subject);
 
 	if (env->date == NULL) {
 		msg->sent_date = (time_t)-1;
@@ -839,6 +1038,93 @@ bool mailbox_global_get_subject_utf8(struct mailbox_source *source,
 	return TRUE;
 }
 
+static size_t
+mailbox_offline_cache_get_memory_usage(struct mailbox_offline_cache *cache)
+{
+	return sizeof(*cache) +
+		array_count(&cache->keywords) *
+		sizeof(struct mailbox_keyword_name *) +
+		array_count(&cache->keyword_msg_counts) * sizeof(unsigned int) +
+		array_count(&cache->uidmap) * sizeof(uint32_t) +
+		array_count(&cache->messages) *
+		sizeof(struct message_metadata_dynamic) +
+		cache->keyword_bitmasks->used;
+}
+
+size_t mailbox_storage_get_memory_usage(struct mailbox_storage *storage,
+					size_t *cache_size_r)
+{
+	struct mailbox_keyword_name *const *namep;
+	size_t size;
+
+	size = sizeof(*storage) +
+		uid_tree_get_memory_usage(storage->static_metadata) +
+		uid_tree_count(storage->static_metadata) *
+		sizeof(struct message_metadata_static) +
+		array_count(&storage->expunged_uids) * sizeof(struct seq_range);
+	array_foreach(&storage->keyword_names, namep) {
+		size += sizeof(**namep) + sizeof(*namep) +
+			strlen((*namep)->name) + 1;
+	}
+
+	*cache_size_r = storage->cache == NULL ? 0 :
+		mailbox_offline_cache_get_memory_usage(storage->cache);
+	return size + *cache_size_r;
+}
+
+struct storage_memory_usage {
+	struct mailbox_storage *storage;
+	size_t size, cache_size;
+};
+
+static int
+storage_memory_usage_cmp(const struct storage_memory_usage *u1,
+			 const struct storage_memory_usage *u2)
+{
+	return u1->size < u2->size ? 1 : (u1->size > u2->size ? -1 : 0);
+}
+
+void mailbox_storages_print_memory_usage(void)
+{
+	ARRAY(struct storage_memory_usage) usages;
+	struct storage_memory_usage *usage;
+	struct hash_iterate_context *iter;
+	struct mailbox_storage *storage;
+	uint64_t total = 0, cache_total = 0;
+	unsigned int i, count;
+	char *key;
+
+	if (hash_table_count(storages) == 0)
+		return;
+
+	t_array_init(&usages, hash_table_count(storages));
+	iter = hash_table_iterate_init(storages);
+	while (hash_table_iterate(iter, storages, &key, &storage)) {
+		usage = array_append_space(&usages);
+		usage->storage = storage;
+		usage->size = mailbox_storage_get_memory_usage(storage,
+							&usage->cache_size);
+		total += usage->size;
+		cache_total += usage->cache_size;
+	}
+	hash_table_iterate_deinit(&iter);
+	array_sort(&usages, storage_memory_usage_cmp);
+
+	printf("\nStorage memory: %u storages, %llu bytes "
+	       "(%llu in offline caches)\n", array_count(&usages),
+	       (unsigned long long)total, (unsigned long long)cache_total);
+	usage = array_get_modifiable(&usages, &count);
+	for (i = 0; i < count && i < MAILBOX_STORAGES_PRINT_MAX; i++) {
+		printf("  %s %s: %llu bytes, %u messages, "
+		       "%llu in offline cache\n",
+		       t_strcut(usage[i].storage->guid, '\t'),
+		       usage[i].storage->name,
+		       (unsigned long long)usage[i].size,
+		       uid_tree_count(usage[i].storage->static_metadata),
+		       (unsigned long long)usage[i].cache_size);
+	}
+}
+
 void mailboxes_init(void)
 {
 	hash_table_create(&storages, default_pool, 0, str_hash, strcmp);
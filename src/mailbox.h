@@ -1,9 +1,13 @@
 #ifndef MAILBOX_H
 #define MAILBOX_H
 
+#include "priorityq.h"
 #include "seq-range-array.h"
 #include "mail-types.h"
 
+struct uid_tree;
+struct imap_client;
+
 struct message_header {
 	const char *name;
 	const unsigned char *value;
@@ -14,6 +18,15 @@ ARRAY_DEFINE_TYPE(message_header, struct message_header);
 
 struct message_global {
 	char *message_id;
+	/* number of message_metadata_static pointing to this message */
+	unsigned int refcount;
+	/* source's unused messages list while refcount=0 */
+	struct message_global *unused_prev, *unused_next;
+	/* memory used by the message, except for the shared strings */
+	size_t memory_size;
+
+	/* these strings are shared between messages, set them with
+	   mailbox_source_msg_set_string() */
 	const char *body, *bodystructure, *envelope;
 	uoff_t header_size, body_size, full_size, mime1_size;
 
@@ -35,6 +48,8 @@ struct message_metadata_static {
 	/* timestamp when this message should be removed if it still has
 	   refcount=0 */
 	time_t ref0_timeout;
+	/* storage's static_metadata_ref0 queue */
+	struct message_metadata_static *ref0_prev, *ref0_next;
 
 	time_t internaldate;
 	int internaldate_tz;
@@ -67,9 +82,9 @@ enum flagchange_dirty_type {
 struct message_metadata_dynamic {
 #define MAIL_FLAGS_SET 0x40000000
 	uint64_t modseq;
-	/* flags and keywords are set only if MAIL_FLAGS_SET is set */
+	/* flags and keywords are set only if MAIL_FLAGS_SET is set. keywords
+	   are in view->keyword_bitmasks. */
 	enum mail_flags mail_flags;
-	uint8_t *keyword_bitmask; /* [view->keyword_bitmask_alloc_size] */
 
 	struct message_metadata_static *ms;
 	/* Number of commands currently expected to return FETCH FLAGS for
@@ -99,6 +114,13 @@ struct mailbox_keyword {
 };
 ARRAY_DEFINE_TYPE(mailbox_keyword, struct mailbox_keyword);
 
+struct mailbox_checkpoint_schedule {
+	struct priorityq_item item;
+	struct mailbox_storage *storage;
+	/* when to start the next checkpoint */
+	time_t time;
+};
+
 struct mailbox_offline_cache {
 	struct mailbox_storage *storage;
 	int refcount;
@@ -108,10 +130,15 @@ struct mailbox_offline_cache {
 
 	/* all keywords used currently in a mailbox */
 	ARRAY(struct mailbox_keyword_name *) keywords;
+	/* keyword index -> number of messages having it */
+	ARRAY(unsigned int) keyword_msg_counts;
 	/* seq -> uid */
 	ARRAY(uint32_t) uidmap;
 	/* seq -> metadata */
 	ARRAY_TYPE(message_metadata_dynamic) messages;
+	/* seq -> keyword bitmask, keyword_bitmask_size bytes each */
+	buffer_t *keyword_bitmasks;
+	unsigned int keyword_bitmask_size;
 };
 
 struct mailbox_storage {
@@ -121,6 +148,14 @@ struct mailbox_storage {
 	char *name;
 
 	struct mailbox_checkpoint_context *checkpoint;
+	struct mailbox_checkpoint_schedule checkpoint_schedule;
+	/* UIDs whose flags or modseq some view has updated since the last
+	   checkpoint. Only these messages are compared, except in the
+	   periodic full comparisons. */
+	ARRAY_TYPE(seq_range) checkpoint_dirty_uids;
+	unsigned int checkpoints_since_full;
+	/* imap_clients whose client->storage is this storage */
+	struct imap_client *clients_head, *clients_tail;
 
 	/* we assume that uidvalidity doesn't change while imaptest
 	   is running */
@@ -131,15 +166,16 @@ struct mailbox_storage {
 	   client gets disconnected. */
 	struct mailbox_offline_cache *cache;
 
-	/* Number of messages in static_metadata with refcount=0 */
-	unsigned int static_metadata_ref0_count;
-	/* Timestamp when static_metadata should next be scanned for
-	   removal of old refcount=0 messages */
-	time_t static_metadata_ref0_next_scan;
+	/* Messages in static_metadata with refcount=0, ordered by
+	   ref0_timeout (oldest first) */
+	struct message_metadata_static *static_metadata_ref0_head;
+	struct message_metadata_static *static_metadata_ref0_tail;
 
-	/* static metadata for this mailbox. sorted by UID. */
-	ARRAY(struct message_metadata_static *) static_metadata;
+	/* UID => struct message_metadata_static */
+	struct uid_tree *static_metadata;
 	ARRAY(struct mailbox_keyword_name *) keyword_names;
+	/* case-insensitive name => keyword_names entry */
+	HASH_TABLE(char *, struct mailbox_keyword_name *) keyword_names_hash;
 	/* List of UIDs that are definitely expunged. May contain UIDs that
 	   have never even existed. */
 	ARRAY_TYPE(seq_range) expunged_uids;
@@ -153,6 +189,8 @@ struct mailbox_storage {
 	bool flag_owner_clients_assigned:1;
 	bool seen_all_recent:1;
 	bool dont_track_recent:1;
+	/* next checkpoint must compare all messages */
+	bool checkpoint_full:1;
 };
 
 struct mailbox_view {
@@ -167,13 +205,23 @@ struct mailbox_view {
 
 	/* all keywords used currently in a mailbox */
 	ARRAY_TYPE(mailbox_keyword) keywords;
+	/* case-insensitive name => keywords index + 1 */
+	HASH_TABLE(const char *, void *) keywords_hash;
 
 	/* seq -> uid */
 	ARRAY(uint32_t) uidmap;
 	/* seq -> metadata */
 	ARRAY_TYPE(message_metadata_dynamic) messages;
+	/* seq -> keyword bitmask, keyword_bitmask_alloc_size bytes each.
+	   All the messages' keywords are kept in this one buffer. It may be
+	   shorter than messages, in which case the rest have no keywords. */
+	buffer_t *keyword_bitmasks;
 	/* number of non-zero UIDs in uidmap. */
 	unsigned int known_uid_count;
+	/* EXPUNGEd sequences not yet removed from uidmap and messages,
+	   numbered as before any of them were expunged */
+	ARRAY_TYPE(seq_range) pending_expunges;
+	unsigned int pending_expunge_count;
 
 	bool readwrite:1;
 	bool keywords_can_create_more:1;
@@ -192,11 +240,17 @@ mailbox_storage_get(struct mailbox_source *source, const char *username,
 		    const char *mailbox);
 void mailbox_storage_unref(struct mailbox_storage **storage);
 void mailbox_storage_reset(struct mailbox_storage *storage);
+/* A view's flags or modseq for the UID were updated. uid=0 means the
+   UID isn't known, so the next checkpoint must compare everything. */
+void mailbox_storage_set_dirty(struct mailbox_storage *storage, uint32_t uid);
 
 struct mailbox_view *mailbox_view_new(struct mailbox_storage *storage);
 void mailbox_view_free(struct mailbox_view **_mailbox);
 
-bool mailbox_view_save_offline_cache(struct mailbox_view *view);
+bool mailbox_view_can_save_offline_cache(struct mailbox_view *view);
+/* Move the view's messages to the storage's offline cache instead of
+   copying them. The view is left without any messages. */
+void mailbox_view_save_offline_cache(struct mailbox_view *view);
 void mailbox_view_restore_offline_cache(struct mailbox_view *view,
 					struct mailbox_offline_cache *cache);
 void mailbox_offline_cache_unref(struct mailbox_offline_cache **cache);
@@ -209,8 +263,12 @@ struct mailbox_keyword *
 mailbox_view_keyword_get_by_name(struct mailbox_view *view,
 				 const char *name);
 void mailbox_view_keyword_add(struct mailbox_view *view, const char *name);
-void mailbox_keywords_clear(struct mailbox_view *view,
-			    struct message_metadata_dynamic *metadata);
+/* Returns the message's keyword bitmask, or NULL if no keywords have been
+   seen yet. The pointer is valid until keywords are reallocated or
+   messages are expunged. */
+uint8_t *mailbox_view_get_keywords(struct mailbox_view *view,
+				   unsigned int seq);
+void mailbox_keywords_clear(struct mailbox_view *view, unsigned int seq);
 void mailbox_view_keywords_realloc(struct mailbox_view *view,
 				   unsigned int new_alloc_size);
 
@@ -231,7 +289,25 @@ void message_metadata_static_assign_owner(struct mailbox_storage *storage,
 					  struct message_metadata_static *ms);
 void message_metadata_static_unref(struct mailbox_storage *storage,
 				   struct message_metadata_static **ms);
+/* Queue expunging the given sequence. The sequence is in the numbering
+   after the previously queued expunges, i.e. like in consecutive EXPUNGE
+   replies. The view isn't updated until mailbox_view_expunges_flush(). */
 void mailbox_view_expunge(struct mailbox_view *view, unsigned int seq);
+/* Convert a sequence in the numbering after the queued expunges to the
+   sequence still used by the view. */
+unsigned int mailbox_view_pending_expunge_seq(struct mailbox_view *view,
+					      unsigned int seq);
+/* Remove all the queued expunges from the view. */
+void mailbox_view_expunges_flush(struct mailbox_view *view);
+/* Expunge all the given sequences at once. The sequences refer to the view
+   before any of them are expunged. */
+void mailbox_view_expunge_seqs(struct mailbox_view *view,
+			       const ARRAY_TYPE(seq_range) *seqs);
+/* Find the first known UID that is >= uid. Returns TRUE if it's the uid
+   itself. *idx_r is set to its index in uidmap (seq-1), or to the uidmap
+   count if there are no such UIDs. */
+bool mailbox_view_uid_lookup(struct mailbox_view *view, uint32_t uid,
+			     unsigned int *idx_r);
 
 bool mailbox_global_get_sent_date(struct mailbox_source *source,
 				  struct message_global *msg,
@@ -240,6 +316,13 @@ bool mailbox_global_get_subject_utf8(struct mailbox_source *source,
 				     struct message_global *msg,
 				     const char **subject_r);
 
+/* Returns the approximate memory used by the storage's messages and
+   keywords, and separately the part used by its offline cache. */
+size_t mailbox_storage_get_memory_usage(struct mailbox_storage *storage,
+					size_t *cache_size_r);
+/* Print the storages using the most memory. */
+void mailbox_storages_print_memory_usage(void);
+
 void mailboxes_init(void);
 void mailboxes_deinit(void);
 
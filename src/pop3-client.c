@@ -6,7 +6,6 @@
 #include "str.h"
 #include "istream.h"
 #include "ostream.h"
-#include "time-util.h"
 
 #include "settings.h"
 #include "mailbox.h"
@@ -47,7 +46,7 @@ static void pop3_command_send(struct pop3_client *client, const char *cmdline,
 	cmd->cmdline = i_strconcat(cmdline, "\r\n", NULL);
 	cmd->state = client->client.state;
 	cmd->callback = callback;
-	i_gettimeofday(&cmd->tv_start);
+	cmd->start_usecs = client_state_timer_now();
 
 	o_stream_nsend_str(client->client.output, cmd->cmdline);
 	array_append(&client->commands, &cmd, 1);
@@ -69,7 +68,7 @@ pop3_command_finish(struct pop3_client *client, struct pop3_command *cmd)
 	i_assert(i < count);
 
 	counters[cmd->state]++;
-	client_state_add_to_timer(cmd->state, &cmd->tv_start);
+	client_state_add_to_timer(cmd->state, cmd->start_usecs, 0);
 	pop3_command_free(cmd);
 }
 
@@ -81,6 +80,7 @@ static int pop3_client_input_line(struct pop3_client *client, const char *line)
 	if (!client->seen_banner) {
 		/* we haven't received the banner yet */
 		client->seen_banner = TRUE;
+		client_banner_received(&client->client);
 
 		if (strncasecmp(line, "+OK", 3) != 0) {
 			pop3_client_input_error(client, "Malformed banner");
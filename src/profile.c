@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "ioloop.h"
+#include "priorityq.h"
 #include "istream.h"
 #include "str.h"
 #include "var-expand.h"
@@ -14,6 +15,7 @@
 #include "commands.h"
 #include "imaptest-lmtp.h"
 #include "profile.h"
+#include "worker.h"
 
 #include <stdlib.h>
 #include <math.h>
@@ -24,8 +26,18 @@
 #define weighted_rand(n) \
 	(int)RANDN2(n, n/2)
 
-static time_t users_min_timestamp = INT_MAX;
+/* Run scheduled users' actions at least this much in the future */
+#define USERS_MIN_DELAY_MSECS 10
+/* Run users_timeout() at least this often, so disconnect_clients is
+   handled */
+#define USERS_MAX_DELAY_MSECS 1000
+
+#define IOLOOP_MSECS() \
+	((uint64_t)ioloop_timeval.tv_sec * 1000 + ioloop_timeval.tv_usec / 1000)
+
+static struct priorityq *users_queue;
 static struct timeout *to_users;
+static uint64_t to_users_msecs;
 
 static void user_mailbox_action_move(struct imap_client *client,
 				     const char *mailbox, uint32_t uid);
@@ -70,7 +82,7 @@ int imap_client_profile_send_more_commands(struct client *_client)
 	struct imap_client *client = (struct imap_client *)_client;
 	string_t *cmd = t_str_new(128);
 
-	if (array_count(&client->commands) > 0)
+	if (client->commands_count > 0)
 		return 0;
 
 	switch (_client->login_state) {
@@ -454,6 +466,7 @@ static int user_timestamp_handle(struct user *user, enum user_timestamp ts,
 		if (ts == USER_TIMESTAMP_LOGIN) {
 			user->timestamps[ts] = user_get_next_login_time(user);
 			user_set_min_timestamp(user, user->timestamps[ts]);
+			user_update_ready(user);
 		} else if (ts == USER_TIMESTAMP_LOGOUT && user_connected) {
 			/* have to have a logout timestamp when there are
 			   connected clients. */
@@ -529,6 +542,7 @@ static void user_fill_timestamps(struct user *user, time_t start_time)
 	enum user_timestamp ts;
 	unsigned int interval;
 
+	user->sched_offset_msecs = i_rand_limit(1000);
 	for (ts = 0; ts < USER_TIMESTAMP_COUNT; ts++) {
 		interval = user_get_timeout_interval(user, ts);
 		user->timestamps[ts] = interval == 0 ? (time_t)-1 :
@@ -537,21 +551,40 @@ static void user_fill_timestamps(struct user *user, time_t start_time)
 	}
 	user->timestamps[USER_TIMESTAMP_LOGIN] = start_time;
 	user_set_min_timestamp(user, start_time);
+	user_update_ready(user);
+}
+
+static int user_sched_cmp(const void *p1, const void *p2)
+{
+	const struct user *u1 = p1, *u2 = p2;
+
+	if (u1->next_run_msecs < u2->next_run_msecs)
+		return -1;
+	if (u1->next_run_msecs > u2->next_run_msecs)
+		return 1;
+	return 0;
 }
 
 static void users_timeout(void *context ATTR_UNUSED)
 {
-	const ARRAY_TYPE(user) *users = users_get_sort_by_min_timestamp();
+	struct priorityq_item *item;
 	struct user *user;
+	uint64_t now_msecs = IOLOOP_MSECS();
 
 	timeout_remove(&to_users);
-	array_foreach_elem(users, user) {
-		if (ioloop_time < user->next_min_timestamp &&
-		    !disconnect_clients) {
-			/* wait for the next user's event */
-			break;
+	if (disconnect_clients) {
+		array_foreach_elem(users_get_all(), user)
+			user_run_actions(user);
+	} else {
+		/* users that are rescheduled while running are always
+		   queued to the future, so this loop ends */
+		while ((item = priorityq_peek(users_queue)) != NULL) {
+			user = (struct user *)item;
+			if (user->next_run_msecs > now_msecs)
+				break;
+			(void)priorityq_pop(users_queue);
+			user_run_actions(user);
 		}
-		user_run_actions(user);
 	}
 	/* make sure a timeout is always set */
 	if (to_users == NULL)
@@ -560,32 +593,46 @@ static void users_timeout(void *context ATTR_UNUSED)
 
 static void users_timeout_update(void)
 {
+	struct priorityq_item *item = priorityq_peek(users_queue);
+	uint64_t now_msecs = IOLOOP_MSECS();
+
 	if (to_users != NULL)
 		timeout_remove(&to_users);
-	if (users_min_timestamp <= ioloop_time)
-		to_users = timeout_add_short(500, users_timeout, (void *)NULL);
-	else {
-		to_users = timeout_add((users_min_timestamp - ioloop_time) * 1000,
-				       users_timeout, (void *)NULL);
+	to_users_msecs = now_msecs + USERS_MAX_DELAY_MSECS;
+	if (item != NULL && !disconnect_clients) {
+		to_users_msecs = I_MIN(to_users_msecs,
+				       ((struct user *)item)->next_run_msecs);
 	}
+	to_users = timeout_add_short(to_users_msecs - now_msecs,
+				     users_timeout, (void *)NULL);
 }
 
 static void user_set_min_timestamp(struct user *user, time_t min_timestamp)
 {
+	uint64_t now_msecs = IOLOOP_MSECS();
+
 	if (min_timestamp <= 0)
 		return;
-	if (min_timestamp <= ioloop_time) {
-		/* always set timestamps to future so we don't run the timeout
-		   multiple times within second (which is bad if users are
-		   sorted multiple times a second) */
+	if (min_timestamp <= ioloop_time)
 		min_timestamp = ioloop_time;
+	if (user->next_min_timestamp <= min_timestamp &&
+	    user->sched_item.idx != UINT_MAX)
+		return;
+	user->next_min_timestamp = min_timestamp;
+
+	if (user->sched_item.idx != UINT_MAX)
+		priorityq_remove(users_queue, &user->sched_item);
+	user->next_run_msecs = (uint64_t)min_timestamp * 1000 +
+		user->sched_offset_msecs;
+	if (user->next_run_msecs < now_msecs + USERS_MIN_DELAY_MSECS) {
+		/* always schedule to the future so the user isn't run
+		   multiple times within the same users_timeout() */
+		user->next_run_msecs = now_msecs + USERS_MIN_DELAY_MSECS;
 	}
-	if (user->next_min_timestamp > min_timestamp)
-		user->next_min_timestamp = min_timestamp;
-	if (users_min_timestamp > min_timestamp) {
-		users_min_timestamp = min_timestamp;
+	priorityq_add(users_queue, &user->sched_item);
+
+	if (to_users == NULL || user->next_run_msecs < to_users_msecs)
 		users_timeout_update();
-	}
 }
 
 static void
@@ -664,7 +711,8 @@ get_next_username(const struct profile_user *user_profile,
 static void
 users_add_from_user_profile(const struct profile_user *user_profile,
 			    struct profile *profile, ARRAY_TYPE(user) *users,
-			    struct mailbox_source *source)
+			    struct mailbox_source *source,
+			    unsigned int *user_idx)
 {
 	struct user *user;
 	struct istream *users_input;
@@ -686,6 +734,8 @@ users_add_from_user_profile(const struct profile_user *user_profile,
 
 		get_next_username(user_profile, users_input,
 				  username, password, i);
+		if (!worker_owns_idx((*user_idx)++))
+			continue;
 
 		user = user_get(str_c(username), source);
 		if (str_len(password) > 0)
@@ -702,14 +752,20 @@ void profile_add_users(struct profile *profile, ARRAY_TYPE(user) *users,
 		       struct mailbox_source *source)
 {
 	struct profile_user *user;
+	unsigned int user_idx = 0;
 
+	users_queue = priorityq_init(user_sched_cmp, 128);
 	i_array_init(users, 128);
-	array_foreach_elem(&profile->users, user)
-		users_add_from_user_profile(user, profile, users, source);
+	array_foreach_elem(&profile->users, user) {
+		users_add_from_user_profile(user, profile, users, source,
+					    &user_idx);
+	}
 }
 
 void profile_deinit(void)
 {
 	if (to_users != NULL)
 		timeout_remove(&to_users);
+	if (users_queue != NULL)
+		priorityq_deinit(&users_queue);
 }
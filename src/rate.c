@@ -0,0 +1,118 @@
+/* Copyright (c) 2007-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "llist.h"
+#include "settings.h"
+#include "client.h"
+#include "client-state.h"
+#include "imap-client.h"
+#include "rate.h"
+
+#define RATE_TIMEOUT_MSECS 1
+
+static struct timeout *to_rate;
+static double rate_interval_usecs;
+static uint64_t rate_start_usecs, rate_slot_idx;
+/* Clients that may be able to take a slot, in the order they became able
+   to. They're checked only when their turn comes. */
+static struct imap_client *rate_clients_head, *rate_clients_tail;
+
+static uint64_t rate_get_slot_usecs(uint64_t slot_idx)
+{
+	return rate_start_usecs + (uint64_t)(slot_idx * rate_interval_usecs);
+}
+
+static bool rate_client_can_take_slot(struct client *_client)
+{
+	struct imap_client *client = imap_client(_client);
+	unsigned int max_cmds = conf.no_pipelining ? 1 : MAX_COMMAND_QUEUE_LEN;
+
+	return client != NULL && client->seen_banner && !client->seen_bye &&
+		!_client->disconnected && !_client->logout_sent &&
+		!_client->delayed && client->rate_slot_usecs == 0 &&
+		client->commands_count < max_cmds;
+}
+
+static struct imap_client *rate_next_client(void)
+{
+	struct imap_client *client;
+
+	while ((client = rate_clients_head) != NULL) {
+		rate_client_remove(client);
+		/* if it can't take a slot now, it's queued again by
+		   rate_client_wakeup() once it can */
+		if (rate_client_can_take_slot(&client->client))
+			return client;
+	}
+	return NULL;
+}
+
+static void rate_timeout(void *context ATTR_UNUSED)
+{
+	struct imap_client *client;
+	uint64_t slot_usecs, now = client_state_timer_now();
+
+	while (!disconnect_clients) {
+		slot_usecs = rate_get_slot_usecs(rate_slot_idx);
+		if (slot_usecs > now)
+			break;
+
+		client = rate_next_client();
+		if (client == NULL) {
+			/* all clients are busy. the slot stays due, so its
+			   response time keeps growing until it's sent. */
+			break;
+		}
+		client->rate_slot_usecs = slot_usecs;
+		rate_slot_idx++;
+		(void)client_send_more_commands(&client->client);
+	}
+}
+
+void rate_client_wakeup(struct client *_client)
+{
+	struct imap_client *client = imap_client(_client);
+
+	if (client == NULL || client->rate_queued)
+		return;
+	client->rate_queued = TRUE;
+	DLLIST2_APPEND_FULL(&rate_clients_head, &rate_clients_tail,
+			    client, rate_prev, rate_next);
+}
+
+void rate_client_remove(struct imap_client *client)
+{
+	if (!client->rate_queued)
+		return;
+	client->rate_queued = FALSE;
+	DLLIST2_REMOVE_FULL(&rate_clients_head, &rate_clients_tail,
+			    client, rate_prev, rate_next);
+}
+
+unsigned int rate_get_backlog(void)
+{
+	uint64_t now = client_state_timer_now();
+	uint64_t slot_idx = rate_slot_idx;
+
+	if (to_rate == NULL || rate_get_slot_usecs(slot_idx) > now)
+		return 0;
+	return (now - rate_get_slot_usecs(slot_idx)) / rate_interval_usecs + 1;
+}
+
+void rate_init(double cmds_per_sec)
+{
+	i_assert(cmds_per_sec > 0);
+
+	rate_interval_usecs = 1000000.0 / cmds_per_sec;
+	rate_start_usecs = client_state_timer_now();
+	rate_slot_idx = 0;
+	to_rate = timeout_add_short(RATE_TIMEOUT_MSECS, rate_timeout,
+				    (void *)NULL);
+}
+
+void rate_deinit(void)
+{
+	if (to_rate != NULL)
+		timeout_remove(&to_rate);
+}
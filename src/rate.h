@@ -0,0 +1,19 @@
+#ifndef RATE_H
+#define RATE_H
+
+/* Open-loop mode: commands are scheduled on a fixed timeline of
+   cmds_per_sec slots, regardless of how fast the server replies. Each slot
+   is given to an idle IMAP client and the command's response time is
+   measured from the slot's intended start time. */
+void rate_init(double cmds_per_sec);
+void rate_deinit(void);
+
+/* The client may have become able to take a new slot. This must be called
+   whenever something that prevented it from taking one goes away. */
+void rate_client_wakeup(struct client *client);
+/* Remove the client from the slot queue. Called when it's being freed. */
+void rate_client_remove(struct imap_client *client);
+/* Returns the number of slots that are due, but not yet sent. */
+unsigned int rate_get_backlog(void);
+
+#endif
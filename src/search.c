@@ -9,6 +9,7 @@
 #include "imap-arg.h"
 #include "commands.h"
 #include "mailbox.h"
+#include "uid-tree.h"
 #include "imap-client.h"
 #include "search.h"
 
@@ -79,163 +80,344 @@ struct search_context {
 	ARRAY_TYPE(seq_range) result;
 };
 
-static int
-search_node_verify_msg(struct imap_client *client, struct search_node *node,
-		       const struct message_metadata_static *ms)
+/* Search results are verified over the whole view at once. Each node is
+   evaluated into two bitmaps indexed by seq-1: messages that definitely
+   match and messages that definitely don't. Messages in neither are
+   unknown, which makes AND/OR simple word-wide bit operations. */
+#define SEARCH_BITMAP_WORD_BITS 64
+#define SEARCH_BITMAP_WORDS(count) \
+	(((count) + SEARCH_BITMAP_WORD_BITS - 1) / SEARCH_BITMAP_WORD_BITS)
+#define SEARCH_BITMAP_BIT(idx) \
+	((uint64_t)1 << ((idx) % SEARCH_BITMAP_WORD_BITS))
+#define SEARCH_BITMAP_SET(bitmap, idx) \
+	((bitmap)[(idx) / SEARCH_BITMAP_WORD_BITS] |= SEARCH_BITMAP_BIT(idx))
+#define SEARCH_BITMAP_ISSET(bitmap, idx) \
+	(((bitmap)[(idx) / SEARCH_BITMAP_WORD_BITS] & \
+	  SEARCH_BITMAP_BIT(idx)) != 0)
+
+struct search_verify_context {
+	struct imap_client *client;
+	unsigned int msgs_count, words_count;
+
+	/* seq-1 -> message's static metadata, NULL if it's not known */
+	const struct message_metadata_static **ms;
+	/* seq-1 -> message's size, 0 if it's not known */
+	uoff_t *sizes;
+	/* seq-1 -> date/subject. These are valid only if the message's bit
+	   is set in the matching _known bitmap. The sent dates and subjects
+	   are looked up only when some node needs them. */
+	time_t *dates, *sent_dates;
+	const char **subjects;
+	uint64_t *dates_known, *sent_dates_known, *subjects_known;
+};
+
+static void
+search_verify_init(struct search_verify_context *vctx,
+		   struct imap_client *client, unsigned int msgs_count)
 {
-	const char *str, *const *words;
-	unsigned int i, count;
+	const struct message_metadata_static *ms;
+	unsigned int i;
+
+	i_zero(vctx);
+	vctx->client = client;
+	vctx->msgs_count = msgs_count;
+	vctx->words_count = SEARCH_BITMAP_WORDS(msgs_count);
+
+	vctx->ms = t_new(const struct message_metadata_static *, msgs_count);
+	vctx->sizes = t_new(uoff_t, msgs_count);
+	vctx->dates = t_new(time_t, msgs_count);
+	vctx->dates_known = t_new(uint64_t, vctx->words_count);
+	for (i = 0; i < msgs_count; i++) {
+		ms = message_metadata_static_lookup_seq(client->view, i + 1);
+		vctx->ms[i] = ms;
+		if (ms == NULL)
+			continue;
+		if (ms->msg != NULL)
+			vctx->sizes[i] = ms->msg->full_size;
+		if (ms->internaldate != 0) {
+			vctx->dates[i] = ms->internaldate +
+				ms->internaldate_tz*60;
+			SEARCH_BITMAP_SET(vctx->dates_known, i);
+		}
+	}
+}
+
+static void search_verify_get_sent_dates(struct search_verify_context *vctx)
+{
+	struct mailbox_source *source = vctx->client->storage->source;
+	const struct message_metadata_static *ms;
+	unsigned int i;
 	time_t t;
 	int tz;
 
+	if (vctx->sent_dates != NULL)
+		return;
+
+	vctx->sent_dates = t_new(time_t, vctx->msgs_count);
+	vctx->sent_dates_known = t_new(uint64_t, vctx->words_count);
+	for (i = 0; i < vctx->msgs_count; i++) {
+		ms = vctx->ms[i];
+		if (ms == NULL || ms->msg == NULL)
+			continue;
+		if (!mailbox_global_get_sent_date(source, ms->msg, &t, &tz))
+			continue;
+		if (t == (time_t)-1)
+			continue;
+		vctx->sent_dates[i] = t + tz * 60;
+		SEARCH_BITMAP_SET(vctx->sent_dates_known, i);
+	}
+}
+
+static void search_verify_get_subjects(struct search_verify_context *vctx)
+{
+	struct mailbox_source *source = vctx->client->storage->source;
+	const struct message_metadata_static *ms;
+	unsigned int i;
+
+	if (vctx->subjects != NULL)
+		return;
+
+	vctx->subjects = t_new(const char *, vctx->msgs_count);
+	vctx->subjects_known = t_new(uint64_t, vctx->words_count);
+	for (i = 0; i < vctx->msgs_count; i++) {
+		ms = vctx->ms[i];
+		if (ms == NULL || ms->msg == NULL)
+			continue;
+		/* NULL subject means the Subject: header doesn't exist */
+		if (mailbox_global_get_subject_utf8(source, ms->msg,
+						    &vctx->subjects[i]))
+			SEARCH_BITMAP_SET(vctx->subjects_known, i);
+	}
+}
+
+static void
+search_node_eval_date(struct search_verify_context *vctx,
+		      const struct search_node *node,
+		      enum search_arg_type type, const time_t *dates,
+		      const uint64_t *dates_known, uint64_t *yes, uint64_t *no)
+{
+	unsigned int i;
+	bool match;
+
+	for (i = 0; i < vctx->msgs_count; i++) {
+		if (!SEARCH_BITMAP_ISSET(dates_known, i))
+			continue;
+
+		switch (type) {
+		case SEARCH_BEFORE:
+			match = dates[i] < node->date;
+			break;
+		case SEARCH_ON:
+			match = dates[i] >= node->date &&
+				dates[i] < node->date + 3600*24;
+			break;
+		case SEARCH_SINCE:
+			match = dates[i] >= node->date;
+			break;
+		default:
+			i_unreached();
+		}
+		SEARCH_BITMAP_SET(match ? yes : no, i);
+	}
+}
+
+static void
+search_node_eval_msgs(struct search_verify_context *vctx,
+		      const struct search_node *node,
+		      uint64_t *yes, uint64_t *no)
+{
+	const struct message_metadata_static *ms;
+	const char *const *words;
+	unsigned int i, j, count;
+
 	switch (node->type) {
 	case SEARCH_SMALLER:
 	case SEARCH_LARGER:
-		if (ms->msg == NULL || ms->msg->full_size == 0)
-			break;
-		if (node->type == SEARCH_SMALLER)
-			return (ms->msg->full_size < node->size ? 1 : 0);
-		else
-			return (ms->msg->full_size > node->size ? 1 : 0);
+		for (i = 0; i < vctx->msgs_count; i++) {
+			if (vctx->sizes[i] == 0)
+				continue;
+			if (node->type == SEARCH_SMALLER ?
+			    vctx->sizes[i] < node->size :
+			    vctx->sizes[i] > node->size)
+				SEARCH_BITMAP_SET(yes, i);
+			else
+				SEARCH_BITMAP_SET(no, i);
+		}
 		break;
 	case SEARCH_BEFORE:
 	case SEARCH_ON:
 	case SEARCH_SINCE:
-		if (ms->internaldate == 0)
-			break;
-		t = ms->internaldate + ms->internaldate_tz*60;
-		switch (node->type) {
-		case SEARCH_BEFORE:
-			return (t < node->date ? 1 : 0);
-		case SEARCH_ON:
-			return (t >= node->date && t < node->date + 3600*24 ? 1 : 0);
-		case SEARCH_SINCE:
-			return (t >= node->date ? 1 : 0);
-		default:
-			i_unreached();
-		}
+		search_node_eval_date(vctx, node, node->type, vctx->dates,
+				      vctx->dates_known, yes, no);
+		break;
 	case SEARCH_SENTBEFORE:
 	case SEARCH_SENTON:
 	case SEARCH_SENTSINCE:
-		if (ms->msg == NULL)
-			break;
-
-		if (!mailbox_global_get_sent_date(client->storage->source,
-						  ms->msg, &t, &tz))
-			break;
-		if (t == (time_t)-1)
-			break;
-
-		t += tz * 60;
-		switch (node->type) {
-		case SEARCH_SENTBEFORE:
-			return (t < node->date ? 1 : 0);
-		case SEARCH_SENTON:
-			return (t >= node->date && t < node->date + 3600*24 ? 1 : 0);
-		case SEARCH_SENTSINCE:
-			return (t >= node->date ? 1 : 0);
-		default:
-			i_unreached();
-		}
+		/* the SENT* types are in the same order as the
+		   internaldate types */
+		search_verify_get_sent_dates(vctx);
+		search_node_eval_date(vctx, node, node->type -
+				      (SEARCH_SENTBEFORE - SEARCH_BEFORE),
+				      vctx->sent_dates, vctx->sent_dates_known,
+				      yes, no);
 		break;
 	case SEARCH_SUBJECT:
-		if (ms->msg == NULL)
-			break;
-		if (!mailbox_global_get_subject_utf8(client->storage->source,
-						     ms->msg, &str))
-			break;
-		if (str == NULL) {
-			/* Subject: header doesn't exist */
-			return 0;
+		search_verify_get_subjects(vctx);
+		for (i = 0; i < vctx->msgs_count; i++) {
+			if (!SEARCH_BITMAP_ISSET(vctx->subjects_known, i))
+				continue;
+			if (vctx->subjects[i] != NULL &&
+			    strstr(vctx->subjects[i], node->str) != NULL)
+				SEARCH_BITMAP_SET(yes, i);
+			else
+				SEARCH_BITMAP_SET(no, i);
 		}
-		return (strstr(str, node->str) != NULL ? 1 : 0);
-
+		break;
 	case SEARCH_BODY:
 	case SEARCH_TEXT:
-		if (ms->msg == NULL || !array_is_created(&ms->msg->body_words))
-			break;
-
-		words = array_get(&ms->msg->body_words, &count);
-		for (i = 0; i < count; i++) {
-			if (strstr(words[i], node->str) != NULL)
-				return 1;
+		for (i = 0; i < vctx->msgs_count; i++) {
+			ms = vctx->ms[i];
+			if (ms == NULL || ms->msg == NULL ||
+			    !array_is_created(&ms->msg->body_words))
+				continue;
+
+			/* if the word isn't found, we can't be sure that it
+			   doesn't exist */
+			words = array_get(&ms->msg->body_words, &count);
+			for (j = 0; j < count; j++) {
+				if (strstr(words[j], node->str) != NULL) {
+					SEARCH_BITMAP_SET(yes, i);
+					break;
+				}
+			}
 		}
-		/* we can't be sure that it doesn't exist */
 		break;
-
 	case SEARCH_OR:
 	case SEARCH_SUB:
 	case SEARCH_SEQSET:
 	case SEARCH_TYPE_COUNT:
 		i_unreached();
 	}
-	return -1;
 }
 
-static int
-search_node_verify(struct imap_client *client, struct search_node *node,
-		   uint32_t seq, bool parent_or)
+static void search_bitmap_set_all(struct search_verify_context *vctx,
+				  uint64_t *bitmap)
 {
-	const struct message_metadata_static *ms;
-	int ret = -1, ret2;
+	unsigned int tail_bits = vctx->msgs_count % SEARCH_BITMAP_WORD_BITS;
+
+	if (vctx->words_count == 0)
+		return;
+	memset(bitmap, 0xff, sizeof(*bitmap) * vctx->words_count);
+	if (tail_bits != 0)
+		bitmap[vctx->words_count - 1] = ((uint64_t)1 << tail_bits) - 1;
+}
+
+static void
+search_node_eval(struct search_verify_context *vctx,
+		 const struct search_node *node, uint64_t *yes, uint64_t *no)
+{
+	const struct search_node *child;
+	const struct seq_range *range;
+	uint64_t *child_yes, *child_no;
+	size_t bitmap_size = sizeof(uint64_t) * vctx->words_count;
+	unsigned int i, count, seq;
+	bool is_or = node->type == SEARCH_OR;
 
 	switch (node->type) {
 	case SEARCH_OR:
 	case SEARCH_SUB:
-		ret = search_node_verify(client, node->first_child, seq,
-					 node->type == SEARCH_OR);
+		/* children are ANDed or ORed together. start with all
+		   messages matching for AND and none matching for OR. */
+		search_bitmap_set_all(vctx, is_or ? no : yes);
+		if (node->first_child == NULL)
+			break;
+
+		child_yes = t_new(uint64_t, vctx->words_count);
+		child_no = t_new(uint64_t, vctx->words_count);
+		for (child = node->first_child; child != NULL;
+		     child = child->next_sibling) {
+			memset(child_yes, 0, bitmap_size);
+			memset(child_no, 0, bitmap_size);
+			search_node_eval(vctx, child, child_yes, child_no);
+			for (i = 0; i < vctx->words_count; i++) {
+				if (is_or) {
+					yes[i] |= child_yes[i];
+					no[i] &= child_no[i];
+				} else {
+					yes[i] &= child_yes[i];
+					no[i] |= child_no[i];
+				}
+			}
+		}
 		break;
 	case SEARCH_SEQSET:
-		ret = (seq_range_exists(&node->seqset, seq) ? 1 : 0);
+		range = array_get(&node->seqset, &count);
+		for (i = 0; i < count; i++) {
+			for (seq = range[i].seq1; seq <= range[i].seq2 &&
+			     seq <= vctx->msgs_count; seq++)
+				SEARCH_BITMAP_SET(yes, seq - 1);
+		}
+		search_bitmap_set_all(vctx, no);
+		for (i = 0; i < vctx->words_count; i++)
+			no[i] &= ~yes[i];
 		break;
 	default:
-		ms = message_metadata_static_lookup_seq(client->view, seq);
-		if (ms != NULL)
-			ret = search_node_verify_msg(client, node, ms);
+		search_node_eval_msgs(vctx, node, yes, no);
 		break;
 	}
+}
 
-	if (ret == 0 && !parent_or)
-		return 0;
-	if (ret > 0 && parent_or)
-		return 1;
-
-	if (node->next_sibling == NULL)
-		return ret;
-	ret2 = search_node_verify(client, node->next_sibling, seq, parent_or);
-	if (parent_or) {
-		if (ret == -1 && ret2 == 0)
-			ret2 = -1;
-	} else {
-		if (ret == -1 && ret2 > 0)
-			ret2 = -1;
+static void
+search_verify_warn(struct imap_client *client, uint64_t word,
+		   unsigned int word_idx, const char *what)
+{
+	const uint32_t *uids = array_idx(&client->view->uidmap, 0);
+	unsigned int i, idx;
+
+	for (i = 0; word != 0; i++, word >>= 1) {
+		if ((word & 1) == 0)
+			continue;
+		idx = word_idx * SEARCH_BITMAP_WORD_BITS + i;
+		imap_client_input_warn(client,
+			"SEARCH result %s seq %u (uid %u)",
+			what, idx + 1, uids[idx]);
 	}
-	return ret2;
 }
 
 static void search_verify_result(struct imap_client *client)
 {
 	struct search_context *ctx = client->search_ctx;
-	const uint32_t *uids;
+	struct search_verify_context vctx;
+	const struct seq_range *range;
+	uint64_t *yes, *no, *found;
 	uint32_t seq, msgs;
-	int ret;
-	bool found;
+	unsigned int i, count;
 	bool expunged =
 		imap_arg_atom_equals(client->cur_args+2, "[EXPUNGEISSUED]");
 
-	uids = array_get(&client->view->uidmap, &msgs);
-	for (seq = 1; seq <= msgs; seq++) {
-		ret = search_node_verify(client, &ctx->root, seq, FALSE);
-		found = seq_range_exists(&ctx->result, seq);
-		if (ret > 0 && !found && !expunged) {
-			imap_client_input_warn(client,
-				"SEARCH result missing seq %u (uid %u)",
-				seq, uids[seq-1]);
-		} else if (ret == 0 && found) {
-			imap_client_input_warn(client,
-				"SEARCH result has extra seq %u (uid %u)",
-				seq, uids[seq-1]);
+	msgs = array_count(&client->view->uidmap);
+	if (msgs == 0)
+		return;
+	search_verify_init(&vctx, client, msgs);
+
+	yes = t_new(uint64_t, vctx.words_count);
+	no = t_new(uint64_t, vctx.words_count);
+	search_node_eval(&vctx, &ctx->root, yes, no);
+
+	found = t_new(uint64_t, vctx.words_count);
+	range = array_get(&ctx->result, &count);
+	for (i = 0; i < count; i++) {
+		for (seq = range[i].seq1; seq <= range[i].seq2 &&
+		     seq <= msgs; seq++)
+			SEARCH_BITMAP_SET(found, seq - 1);
+	}
+
+	for (i = 0; i < vctx.words_count; i++) {
+		if (!expunged) {
+			search_verify_warn(client, yes[i] & ~found[i], i,
+					   "missing");
 		}
+		search_verify_warn(client, no[i] & found[i], i, "has extra");
 	}
 }
 
@@ -319,14 +501,16 @@ search_command_build(struct search_context *ctx, struct search_node *parent,
 {
 	struct imap_client *client = ctx->client;
 	pool_t pool = client->search_ctx->pool;
-	struct message_metadata_static *const *ms, *m1 = NULL, *m2 = NULL;
+	struct message_metadata_static *ms, *m1 = NULL, *m2 = NULL;
 	struct search_node *node;
-	unsigned int i, n, randstart, msgs, ms_count;
+	struct uid_tree_iter iter;
+	void *value;
+	unsigned int randstart, msgs, ms_count;
 
 	if ((i_rand_limit(100)) >= probability)
 		return FALSE;
 
-	ms = array_get(&client->storage->static_metadata, &ms_count);
+	ms_count = uid_tree_count(client->storage->static_metadata);
 	randstart = ms_count == 0 ? 0 : i_rand_limit(ms_count);
 
 	node = p_new(pool, struct search_node, 1);
@@ -368,13 +552,15 @@ again:
 	case SEARCH_SMALLER:
 	case SEARCH_LARGER:
 		/* find two messages with known sizes and use their average */
-		for (n = 0; n < ms_count; n++) {
-			i = (randstart + n) % ms_count;
-			if (ms[i]->msg != NULL && ms[i]->msg->full_size != 0) {
+		uid_tree_iter_init(client->storage->static_metadata,
+				   randstart, &iter);
+		while (uid_tree_iter_next(&iter, &value)) {
+			ms = value;
+			if (ms->msg != NULL && ms->msg->full_size != 0) {
 				if (m1 == NULL)
-					m1 = ms[i];
+					m1 = ms;
 				else {
-					m2 = ms[i];
+					m2 = ms;
 					break;
 				}
 			}
@@ -391,13 +577,15 @@ again:
 	case SEARCH_SINCE:
 		/* find two messages with known internalsizes and use their
 		   average */
-		for (n = 0; n < ms_count; n++) {
-			i = (randstart + n) % ms_count;
-			if (ms[i]->internaldate != 0) {
+		uid_tree_iter_init(client->storage->static_metadata,
+				   randstart, &iter);
+		while (uid_tree_iter_next(&iter, &value)) {
+			ms = value;
+			if (ms->internaldate != 0) {
 				if (m1 == NULL)
-					m1 = ms[i];
+					m1 = ms;
 				else {
-					m2 = ms[i];
+					m2 = ms;
 					break;
 				}
 			}
@@ -416,11 +604,13 @@ again:
 		int tz;
 
 		/* find two messages with known dates and use their average */
-		for (n = 0; n < ms_count; n++) {
-			i = (randstart + n) % ms_count;
-			if (ms[i]->msg != NULL &&
+		uid_tree_iter_init(client->storage->static_metadata,
+				   randstart, &iter);
+		while (uid_tree_iter_next(&iter, &value)) {
+			ms = value;
+			if (ms->msg != NULL &&
 			    mailbox_global_get_sent_date(client->storage->source,
-						ms[i]->msg, &t, &tz) &&
+						ms->msg, &t, &tz) &&
 			    t != 0 && t != (time_t)-1) {
 				t += tz * 60;
 				if (t1 == 0)
@@ -444,10 +634,12 @@ again:
 		unsigned int len, count, start;
 
 		/* find a random subject */
-		for (n = 0; n < ms_count; n++) {
-			i = (randstart + n) % ms_count;
-			if (ms[i]->msg != NULL &&
-			    mailbox_global_get_subject_utf8(source, ms[i]->msg,
+		uid_tree_iter_init(client->storage->static_metadata,
+				   randstart, &iter);
+		while (uid_tree_iter_next(&iter, &value)) {
+			ms = value;
+			if (ms->msg != NULL &&
+			    mailbox_global_get_subject_utf8(source, ms->msg,
 							    &str) &&
 			    str != NULL && *str != '\0')
 				break;
@@ -480,11 +672,13 @@ again:
 		unsigned int len, count, start;
 
 		/* find a random subject */
-		for (n = 0; n < ms_count; n++) {
-			i = (randstart + n) % ms_count;
-			if (ms[i]->msg != NULL &&
-			    array_is_created(&ms[i]->msg->body_words)) {
-				words = array_get(&ms[i]->msg->body_words,
+		uid_tree_iter_init(client->storage->static_metadata,
+				   randstart, &iter);
+		while (uid_tree_iter_next(&iter, &value)) {
+			ms = value;
+			if (ms->msg != NULL &&
+			    array_is_created(&ms->msg->body_words)) {
+				words = array_get(&ms->msg->body_words,
 						  &count);
 				if (count > 0) {
 					str = words[i_rand_limit(count)];
@@ -29,6 +29,14 @@
 
 /* Add random keywords with max. length n */
 //#define RAND_KEYWORDS 40
+/* keywords=n: max. number of keywords from the vocabulary to add per
+   message */
+#define KEYWORD_STORM_MAX_PER_MSG 5
+/* synthetic=<size>: default max. MIME parts, percentage of messages with
+   attachments and max. extra headers */
+#define SYNTHETIC_MAX_PARTS 8
+#define SYNTHETIC_ATTACHMENTS 30
+#define SYNTHETIC_HEADERS 10
 
 #define DELAY_MSECS 1000
 #define MAX_COMMAND_QUEUE_LEN 10
@@ -37,7 +45,8 @@
 struct settings {
 	const char *username_template, *username2_template;
 	const char *host, *master_user, *password;
-	const char *mailbox, *copy_dest, *mbox_path;
+	const char *mailbox, *copy_dest, *mbox_path, *corpus_path;
+	const char *msgdir_path;
 	unsigned int port;
 
 	ARRAY_TYPE(const_string) usernames;
@@ -46,13 +55,21 @@ struct settings {
 	unsigned int message_count_threshold;
 	unsigned int checkpoint_interval;
 	unsigned int random_msg_size;
+	/* max. MB used for remembering the messages' contents */
+	unsigned int msg_memory_mb;
+	unsigned int synthetic_msg_size, synthetic_max_parts;
+	unsigned int synthetic_attachments, synthetic_headers;
 	unsigned int stalled_disconnect_timeout;
+	unsigned int workers_count;
+	unsigned int rate;
+	unsigned int keywords_count;
 
 	unsigned int users_rand_start, users_rand_count;
 	unsigned int domains_rand_start, domains_rand_count;
 
 	bool random_states, no_pipelining, disconnect_quit;
 	bool no_tracking, rawlog, error_quit, own_msgs, own_flags, qresync;
+	bool idle_lowmem, msgdir_random;
 
 	struct ip_addr *ips;
 	unsigned int ip_idx, ips_count;
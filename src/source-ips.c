@@ -0,0 +1,241 @@
+/* Copyright (c) 2007-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+#include "net.h"
+#include "source-ips.h"
+
+#include <stdio.h>
+
+/* Largest CIDR range that is expanded, in host bits */
+#define SOURCE_IPS_MAX_RANGE_BITS 16
+/* Print the connection counts of each source IP if there are at most this
+   many of them. Otherwise only print a summary. */
+#define SOURCE_IPS_MAX_PRINT 4
+#define SOURCE_IPS_WARN_INTERVAL_SECS 10
+
+struct source_ip {
+	struct ip_addr ip;
+	unsigned int connections;
+	/* connecting failed with EADDRNOTAVAIL - skip this IP until one of
+	   its connections is closed */
+	bool exhausted;
+};
+
+static ARRAY(struct source_ip) source_ips = ARRAY_INIT;
+static unsigned int source_ips_next_idx = 0;
+static time_t source_ips_last_warning = 0;
+
+static void source_ips_add(const struct ip_addr *ip)
+{
+	struct source_ip *src;
+
+	src = array_append_space(&source_ips);
+	src->ip = *ip;
+}
+
+static void
+ip_set_host_bits(unsigned char *addr, size_t size,
+		 unsigned int host_bits, unsigned int host)
+{
+	unsigned int mask;
+
+	while (host_bits > 0) {
+		size--;
+		mask = host_bits >= 8 ? 0xff : (1U << host_bits) - 1;
+		addr[size] = (addr[size] & ~mask) | (host & mask);
+		host >>= 8;
+		host_bits -= I_MIN(host_bits, 8);
+	}
+}
+
+static void source_ips_add_range(const char *range)
+{
+	struct ip_addr ip;
+	unsigned char *addr;
+	unsigned int i, count, bits, host_bits;
+	size_t addr_size;
+
+	if (net_parse_range(range, &ip, &bits) < 0)
+		i_fatal("Invalid source_ips range: %s", range);
+	if (IPADDR_IS_V4(&ip)) {
+		addr = (void *)&ip.u.ip4;
+		addr_size = 4;
+	} else {
+		addr = (void *)&ip.u.ip6;
+		addr_size = 16;
+	}
+	host_bits = addr_size * 8 - bits;
+	if (host_bits > SOURCE_IPS_MAX_RANGE_BITS) {
+		i_fatal("source_ips range too large: %s (max /%u)", range,
+			(unsigned int)addr_size * 8 - SOURCE_IPS_MAX_RANGE_BITS);
+	}
+
+	count = 1U << host_bits;
+	for (i = 0; i < count; i++) {
+		/* skip IPv4 network and broadcast addresses */
+		if (IPADDR_IS_V4(&ip) && host_bits >= 2 &&
+		    (i == 0 || i == count - 1))
+			continue;
+		ip_set_host_bits(addr, addr_size, host_bits, i);
+		source_ips_add(&ip);
+	}
+}
+
+void source_ips_parse(const char *value)
+{
+	const char *const *args;
+	struct ip_addr ip;
+
+	if (!array_is_created(&source_ips))
+		i_array_init(&source_ips, 16);
+
+	for (args = t_strsplit_spaces(value, ", "); *args != NULL; args++) {
+		if (strchr(*args, '/') != NULL)
+			source_ips_add_range(*args);
+		else if (net_addr2ip(*args, &ip) < 0)
+			i_fatal("Invalid source_ips address: %s", *args);
+		else
+			source_ips_add(&ip);
+	}
+	if (array_count(&source_ips) == 0)
+		i_fatal("source_ips: No addresses given");
+}
+
+void source_ips_deinit(void)
+{
+	if (array_is_created(&source_ips))
+		array_free(&source_ips);
+}
+
+unsigned int source_ips_count(void)
+{
+	return array_is_created(&source_ips) ? array_count(&source_ips) : 0;
+}
+
+int source_ips_get_next(const struct ip_addr **ip_r)
+{
+	struct source_ip *src;
+	unsigned int i, idx, count = source_ips_count();
+
+	for (i = 0; i < count; i++) {
+		idx = source_ips_next_idx;
+		if (++source_ips_next_idx == count)
+			source_ips_next_idx = 0;
+
+		src = array_idx_modifiable(&source_ips, idx);
+		if (!src->exhausted) {
+			src->connections++;
+			*ip_r = &src->ip;
+			return idx;
+		}
+	}
+	return -1;
+}
+
+void source_ips_connection_closed(int source_idx)
+{
+	struct source_ip *src;
+
+	if (source_idx < 0)
+		return;
+
+	src = array_idx_modifiable(&source_ips, source_idx);
+	i_assert(src->connections > 0);
+	src->connections--;
+	/* a local port was freed */
+	src->exhausted = FALSE;
+}
+
+static void source_ips_warn_exhausted(void)
+{
+	if (source_ips_last_warning + SOURCE_IPS_WARN_INTERVAL_SECS >
+	    ioloop_time)
+		return;
+	source_ips_last_warning = ioloop_time;
+
+	if (source_ips_count() == 0) {
+		i_warning("connect() failed: %m - out of local ports, "
+			  "add more source_ips");
+	} else {
+		i_warning("connect() failed: %m - all %u source_ips are "
+			  "out of local ports", source_ips_count());
+	}
+}
+
+int source_ips_connect(const struct ip_addr *ip, unsigned int port,
+		       int *source_idx_r)
+{
+	const struct ip_addr *my_ip;
+	struct source_ip *src;
+	int fd, idx;
+
+	*source_idx_r = -1;
+	if (source_ips_count() == 0) {
+		fd = net_connect_ip(ip, port, NULL);
+		if (fd < 0 && errno == EADDRNOTAVAIL)
+			source_ips_warn_exhausted();
+		return fd;
+	}
+
+	while ((idx = source_ips_get_next(&my_ip)) >= 0) {
+		fd = net_connect_ip(ip, port, my_ip);
+		if (fd >= 0) {
+			*source_idx_r = idx;
+			return fd;
+		}
+
+		src = array_idx_modifiable(&source_ips, idx);
+		src->connections--;
+		if (errno != EADDRNOTAVAIL)
+			return -1;
+		/* no more local ports available for this source IP
+		   (or it's not configured in this host) */
+		src->exhausted = TRUE;
+	}
+	errno = EADDRNOTAVAIL;
+	source_ips_warn_exhausted();
+	return -1;
+}
+
+unsigned int source_ips_get_connections(unsigned int source_idx)
+{
+	return array_idx(&source_ips, source_idx)->connections;
+}
+
+void source_ips_set_connections(unsigned int source_idx, unsigned int count)
+{
+	array_idx_modifiable(&source_ips, source_idx)->connections = count;
+}
+
+void source_ips_print_status(void)
+{
+	const struct source_ip *src;
+	unsigned int min_conns = UINT_MAX, max_conns = 0, exhausted = 0;
+	unsigned int count = source_ips_count();
+
+	if (count == 0)
+		return;
+
+	if (count <= SOURCE_IPS_MAX_PRINT) {
+		printf(" [src");
+		array_foreach(&source_ips, src) {
+			printf(" %s:%u%s", net_ip2addr(&src->ip),
+			       src->connections, src->exhausted ? "!" : "");
+		}
+		printf("]");
+		return;
+	}
+
+	array_foreach(&source_ips, src) {
+		min_conns = I_MIN(min_conns, src->connections);
+		max_conns = I_MAX(max_conns, src->connections);
+		if (src->exhausted)
+			exhausted++;
+	}
+	printf(" [%u src IPs, %u-%u conns each", count, min_conns, max_conns);
+	if (exhausted > 0)
+		printf(", %u out of ports", exhausted);
+	printf("]");
+}
@@ -0,0 +1,35 @@
+#ifndef SOURCE_IPS_H
+#define SOURCE_IPS_H
+
+struct ip_addr;
+
+/* Add source IPs from a comma-separated list of IP addresses and CIDR
+   ranges. i_fatal()s on errors. */
+void source_ips_parse(const char *value);
+void source_ips_deinit(void);
+
+/* Returns the number of configured source IPs, 0 if none. */
+unsigned int source_ips_count(void);
+
+/* Connect to ip:port, binding to the next source IP that still has free
+   local ports. *source_idx_r is set to the source IP index, or -1 if
+   source IPs aren't used. Returns the fd, or -1 with errno set. If all the
+   source IPs are out of ports, errno is EADDRNOTAVAIL and a warning has
+   already been logged. */
+int source_ips_connect(const struct ip_addr *ip, unsigned int port,
+		       int *source_idx_r);
+/* Reserve the next source IP for a connection created elsewhere. Returns
+   the source IP index, or -1 if there is none available. The caller can't
+   report EADDRNOTAVAIL back, so these connections never mark a source IP
+   exhausted. */
+int source_ips_get_next(const struct ip_addr **ip_r);
+/* The connection created with source_ips_connect() or source_ips_get_next()
+   was closed. Does nothing if source_idx is -1. */
+void source_ips_connection_closed(int source_idx);
+
+unsigned int source_ips_get_connections(unsigned int source_idx);
+void source_ips_set_connections(unsigned int source_idx, unsigned int count);
+/* Print the per-source IP connection counts for the status line. */
+void source_ips_print_status(void);
+
+#endif
@@ -0,0 +1,312 @@
+/* Copyright (c) 2007-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "bsearch-insert-pos.h"
+#include "uid-tree.h"
+
+#define UID_TREE_LEAF_SIZE 128
+/* merge a leaf to its neighbour when it drops below this many nodes */
+#define UID_TREE_LEAF_MIN_COUNT (UID_TREE_LEAF_SIZE / 4)
+
+struct uid_tree_node {
+	uint32_t uid;
+	void *value;
+};
+
+struct uid_tree_leaf {
+	unsigned int count;
+	struct uid_tree_node nodes[UID_TREE_LEAF_SIZE];
+};
+
+struct uid_tree {
+	/* leaves sorted by UID, and their first UIDs in a separate array
+	   so the binary search doesn't need to touch the leaves */
+	ARRAY(struct uid_tree_leaf *) leaves;
+	ARRAY(uint32_t) leaf_first_uids;
+	unsigned int count;
+};
+
+static int uid_tree_uid_cmp(const uint32_t *key, const uint32_t *uid)
+{
+	return *key < *uid ? -1 : (*key > *uid ? 1 : 0);
+}
+
+static int
+uid_tree_node_cmp(const uint32_t *key, const struct uid_tree_node *node)
+{
+	return uid_tree_uid_cmp(key, &node->uid);
+}
+
+struct uid_tree *uid_tree_init(void)
+{
+	struct uid_tree *tree;
+
+	tree = i_new(struct uid_tree, 1);
+	i_array_init(&tree->leaves, 16);
+	i_array_init(&tree->leaf_first_uids, 16);
+	return tree;
+}
+
+void uid_tree_deinit(struct uid_tree **_tree)
+{
+	struct uid_tree *tree = *_tree;
+
+	*_tree = NULL;
+	uid_tree_clear(tree);
+	array_free(&tree->leaves);
+	array_free(&tree->leaf_first_uids);
+	i_free(tree);
+}
+
+unsigned int uid_tree_count(const struct uid_tree *tree)
+{
+	return tree->count;
+}
+
+size_t uid_tree_get_memory_usage(const struct uid_tree *tree)
+{
+	unsigned int leaf_count = array_count(&tree->leaves);
+
+	return sizeof(*tree) + leaf_count *
+		(sizeof(struct uid_tree_leaf) +
+		 sizeof(struct uid_tree_leaf *) + sizeof(uint32_t));
+}
+
+uint32_t uid_tree_first_uid(const struct uid_tree *tree)
+{
+	const uint32_t *first_uid;
+
+	if (tree->count == 0)
+		return 0;
+	first_uid = array_idx(&tree->leaf_first_uids, 0);
+	return *first_uid;
+}
+
+static unsigned int
+uid_tree_find_leaf(const struct uid_tree *tree, uint32_t uid)
+{
+	unsigned int idx;
+
+	/* the last leaf whose first UID <= uid */
+	if (array_bsearch_insert_pos(&tree->leaf_first_uids, &uid,
+				     uid_tree_uid_cmp, &idx))
+		return idx;
+	return idx == 0 ? 0 : idx - 1;
+}
+
+static bool
+uid_tree_leaf_find(const struct uid_tree_leaf *leaf, uint32_t uid,
+		   unsigned int *idx_r)
+{
+	return bsearch_insert_pos(&uid, leaf->nodes, leaf->count,
+				  sizeof(leaf->nodes[0]), uid_tree_node_cmp,
+				  idx_r);
+}
+
+static void uid_tree_leaf_updated(struct uid_tree *tree, unsigned int leaf_idx)
+{
+	struct uid_tree_leaf *const *leafp;
+
+	leafp = array_idx(&tree->leaves, leaf_idx);
+	i_assert((*leafp)->count > 0);
+	array_idx_set(&tree->leaf_first_uids, leaf_idx, &(*leafp)->nodes[0].uid);
+}
+
+static void
+uid_tree_leaf_add(struct uid_tree *tree, unsigned int leaf_idx,
+		  struct uid_tree_leaf *leaf)
+{
+	array_insert(&tree->leaves, leaf_idx, &leaf, 1);
+	array_insert(&tree->leaf_first_uids, leaf_idx, &leaf->nodes[0].uid, 1);
+}
+
+static void uid_tree_leaf_free(struct uid_tree *tree, unsigned int leaf_idx)
+{
+	struct uid_tree_leaf *const *leafp;
+	struct uid_tree_leaf *leaf;
+
+	leafp = array_idx(&tree->leaves, leaf_idx);
+	leaf = *leafp;
+	array_delete(&tree->leaves, leaf_idx, 1);
+	array_delete(&tree->leaf_first_uids, leaf_idx, 1);
+	i_free(leaf);
+}
+
+void *uid_tree_lookup(const struct uid_tree *tree, uint32_t uid)
+{
+	struct uid_tree_leaf *const *leafp;
+	unsigned int idx;
+
+	if (tree->count == 0)
+		return NULL;
+
+	leafp = array_idx(&tree->leaves, uid_tree_find_leaf(tree, uid));
+	if (!uid_tree_leaf_find(*leafp, uid, &idx))
+		return NULL;
+	return (*leafp)->nodes[idx].value;
+}
+
+void uid_tree_insert(struct uid_tree *tree, uint32_t uid, void *value)
+{
+	struct uid_tree_leaf *const *leafp, *leaf, *new_leaf;
+	unsigned int leaf_idx, idx, leaf_count;
+
+	leaf_count = array_count(&tree->leaves);
+	if (leaf_count == 0) {
+		leaf = i_new(struct uid_tree_leaf, 1);
+		leaf->nodes[0].uid = uid;
+		leaf->nodes[0].value = value;
+		leaf->count = 1;
+		uid_tree_leaf_add(tree, 0, leaf);
+		tree->count++;
+		return;
+	}
+
+	leaf_idx = uid_tree_find_leaf(tree, uid);
+	leafp = array_idx(&tree->leaves, leaf_idx);
+	leaf = *leafp;
+	if (uid_tree_leaf_find(leaf, uid, &idx))
+		i_panic("uid_tree: UID %u already exists", uid);
+
+	if (leaf->count == UID_TREE_LEAF_SIZE) {
+		new_leaf = i_new(struct uid_tree_leaf, 1);
+		if (idx == UID_TREE_LEAF_SIZE && leaf_idx + 1 == leaf_count) {
+			/* appending the highest UID - start a new leaf and
+			   keep the old one full, since UIDs mostly grow.
+			   the new leaf is added below once it has a UID. */
+			leaf = new_leaf;
+			leaf_idx++;
+			idx = 0;
+		} else {
+			/* split the leaf in half */
+			new_leaf->count = UID_TREE_LEAF_SIZE / 2;
+			leaf->count -= new_leaf->count;
+			memcpy(new_leaf->nodes, leaf->nodes + leaf->count,
+			       sizeof(leaf->nodes[0]) * new_leaf->count);
+			uid_tree_leaf_add(tree, leaf_idx + 1, new_leaf);
+			if (idx > leaf->count) {
+				idx -= leaf->count;
+				leaf = new_leaf;
+				leaf_idx++;
+			}
+		}
+	}
+
+	memmove(leaf->nodes + idx + 1, leaf->nodes + idx,
+		sizeof(leaf->nodes[0]) * (leaf->count - idx));
+	leaf->nodes[idx].uid = uid;
+	leaf->nodes[idx].value = value;
+	leaf->count++;
+	if (leaf->count == 1)
+		uid_tree_leaf_add(tree, leaf_idx, leaf);
+	else if (idx == 0)
+		uid_tree_leaf_updated(tree, leaf_idx);
+	tree->count++;
+}
+
+static void uid_tree_leaf_merge(struct uid_tree *tree, unsigned int leaf_idx)
+{
+	struct uid_tree_leaf *const *leaves;
+	struct uid_tree_leaf *leaf, *next;
+	unsigned int count;
+
+	leaves = array_get(&tree->leaves, &count);
+	if (leaf_idx + 1 == count) {
+		if (leaf_idx == 0)
+			return;
+		leaf_idx--;
+	}
+	leaf = leaves[leaf_idx];
+	next = leaves[leaf_idx + 1];
+	if (leaf->count + next->count > UID_TREE_LEAF_SIZE / 2)
+		return;
+
+	memcpy(leaf->nodes + leaf->count, next->nodes,
+	       sizeof(leaf->nodes[0]) * next->count);
+	leaf->count += next->count;
+	uid_tree_leaf_free(tree, leaf_idx + 1);
+}
+
+void *uid_tree_remove(struct uid_tree *tree, uint32_t uid)
+{
+	struct uid_tree_leaf *const *leafp, *leaf;
+	unsigned int leaf_idx, idx;
+	void *value;
+
+	if (tree->count == 0)
+		return NULL;
+
+	leaf_idx = uid_tree_find_leaf(tree, uid);
+	leafp = array_idx(&tree->leaves, leaf_idx);
+	leaf = *leafp;
+	if (!uid_tree_leaf_find(leaf, uid, &idx))
+		return NULL;
+
+	value = leaf->nodes[idx].value;
+	leaf->count--;
+	memmove(leaf->nodes + idx, leaf->nodes + idx + 1,
+		sizeof(leaf->nodes[0]) * (leaf->count - idx));
+	tree->count--;
+
+	if (leaf->count == 0)
+		uid_tree_leaf_free(tree, leaf_idx);
+	else {
+		if (idx == 0)
+			uid_tree_leaf_updated(tree, leaf_idx);
+		if (leaf->count < UID_TREE_LEAF_MIN_COUNT)
+			uid_tree_leaf_merge(tree, leaf_idx);
+	}
+	return value;
+}
+
+void uid_tree_clear(struct uid_tree *tree)
+{
+	struct uid_tree_leaf **leafp;
+
+	array_foreach_modifiable(&tree->leaves, leafp)
+		i_free(*leafp);
+	array_clear(&tree->leaves);
+	array_clear(&tree->leaf_first_uids);
+	tree->count = 0;
+}
+
+void uid_tree_iter_init(const struct uid_tree *tree, unsigned int start_idx,
+			struct uid_tree_iter *iter_r)
+{
+	struct uid_tree_leaf *const *leafp;
+
+	i_zero(iter_r);
+	iter_r->tree = tree;
+	iter_r->left = tree->count;
+	if (tree->count == 0)
+		return;
+
+	i_assert(start_idx < tree->count);
+	array_foreach(&tree->leaves, leafp) {
+		if (start_idx < (*leafp)->count)
+			break;
+		start_idx -= (*leafp)->count;
+		iter_r->leaf_idx++;
+	}
+	iter_r->idx = start_idx;
+}
+
+bool uid_tree_iter_next(struct uid_tree_iter *iter, void **value_r)
+{
+	struct uid_tree_leaf *const *leafp;
+
+	if (iter->left == 0)
+		return FALSE;
+
+	leafp = array_idx(&iter->tree->leaves, iter->leaf_idx);
+	if (iter->idx == (*leafp)->count) {
+		if (++iter->leaf_idx == array_count(&iter->tree->leaves))
+			iter->leaf_idx = 0;
+		iter->idx = 0;
+		leafp = array_idx(&iter->tree->leaves, iter->leaf_idx);
+	}
+	*value_r = (*leafp)->nodes[iter->idx++].value;
+	iter->left--;
+	return TRUE;
+}
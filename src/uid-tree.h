@@ -0,0 +1,36 @@
+#ifndef UID_TREE_H
+#define UID_TREE_H
+
+/* Map of UID -> value, kept sorted by UID in a two-level B-tree of
+   fixed-size leaves. Lookups are O(log n), inserts and removes touch only
+   a single leaf except when it's split or merged. */
+
+struct uid_tree_iter {
+	const struct uid_tree *tree;
+	unsigned int leaf_idx, idx, left;
+};
+
+struct uid_tree *uid_tree_init(void);
+void uid_tree_deinit(struct uid_tree **tree);
+
+unsigned int uid_tree_count(const struct uid_tree *tree);
+/* Returns the memory used by the tree itself, excluding the values. */
+size_t uid_tree_get_memory_usage(const struct uid_tree *tree);
+/* Returns the lowest UID in the tree, or 0 if it's empty. */
+uint32_t uid_tree_first_uid(const struct uid_tree *tree);
+
+void *uid_tree_lookup(const struct uid_tree *tree, uint32_t uid);
+/* The UID must not already exist in the tree. */
+void uid_tree_insert(struct uid_tree *tree, uint32_t uid, void *value);
+/* Returns the removed value, or NULL if UID wasn't found. */
+void *uid_tree_remove(struct uid_tree *tree, uint32_t uid);
+void uid_tree_clear(struct uid_tree *tree);
+
+/* Iterate through all the values in UID order, starting from the
+   start_idx'th value and wrapping around to the beginning. The tree must
+   not be modified while iterating. */
+void uid_tree_iter_init(const struct uid_tree *tree, unsigned int start_idx,
+			struct uid_tree_iter *iter_r);
+bool uid_tree_iter_next(struct uid_tree_iter *iter, void **value_r);
+
+#endif
@@ -19,6 +19,11 @@
 static HASH_TABLE(const char *, struct user *) users_hash;
 static ARRAY_TYPE(user) users = ARRAY_INIT;
 static struct profile *users_profile;
+/* profile: users that can (probably) connect a new client right now */
+static ARRAY_TYPE(user) users_ready = ARRAY_INIT;
+/* profile: users that can connect a client once their login time or
+   login_interval has been reached */
+static struct priorityq *users_ready_wakeups;
 
 static inline const char *
 t_nagfree_strdup_printf(char const* format, ...)
@@ -64,6 +69,10 @@ struct user *user_get(const char *username, struct mailbox_source *source)
 	user->mailbox_source = source;
 	mailbox_source_ref(user->mailbox_source);
 	user->next_min_timestamp = INT_MAX;
+	user->sched_item.idx = UINT_MAX;
+	user->ready_idx = UINT_MAX;
+	user->ready_wakeup.item.idx = UINT_MAX;
+	user->ready_wakeup.user = user;
 	p_array_init(&user->clients, user->pool, 2);
 	hash_table_insert(users_hash, user->username, user);
 	return user;
@@ -99,11 +108,19 @@ static struct user *user_get_random_from_conf(struct mailbox_source *source)
 	return user;
 }
 
+static time_t user_client_next_connect_time(struct user_client *uc)
+{
+	if (array_count(&uc->clients) >= uc->profile->connection_max_count) {
+		/* not until one of the connections is closed */
+		return INT_MAX;
+	}
+	if (uc->last_logout <= 0)
+		return uc->user->timestamps[USER_TIMESTAMP_LOGIN];
+	return uc->last_logout + (time_t)uc->profile->login_interval;
+}
+
 #define USER_CLIENT_CAN_CONNECT(uc) \
-	((uc->last_logout <= 0 ? \
-	 (ioloop_time >= uc->user->timestamps[USER_TIMESTAMP_LOGIN]) : \
-	 (ioloop_time - uc->last_logout >= (time_t)uc->profile->login_interval)) && \
-	array_count(&uc->clients) < uc->profile->connection_max_count)
+	(ioloop_time >= user_client_next_connect_time(uc))
 
 
 static bool user_can_connect_clients(struct user *user)
@@ -120,24 +137,89 @@ static bool user_can_connect_clients(struct user *user)
 	return ret;
 }
 
+static void users_ready_remove(struct user *user)
+{
+	struct user *last;
+	unsigned int count;
+
+	if (user->ready_idx == UINT_MAX)
+		return;
+
+	count = array_count(&users_ready);
+	last = *array_idx(&users_ready, count - 1);
+	array_idx_set(&users_ready, user->ready_idx, &last);
+	last->ready_idx = user->ready_idx;
+	array_delete(&users_ready, count - 1, 1);
+	user->ready_idx = UINT_MAX;
+}
+
+void user_update_ready(struct user *user)
+{
+	struct user_client *uc;
+	time_t next_connect = INT_MAX;
+
+	if (users_profile == NULL)
+		return;
+
+	array_foreach_elem(&user->clients, uc) {
+		next_connect = I_MIN(next_connect,
+				     user_client_next_connect_time(uc));
+	}
+	if (user->ready_wakeup.item.idx != UINT_MAX)
+		priorityq_remove(users_ready_wakeups, &user->ready_wakeup.item);
+
+	if (next_connect <= ioloop_time) {
+		if (user->ready_idx == UINT_MAX) {
+			user->ready_idx = array_count(&users_ready);
+			array_append(&users_ready, &user, 1);
+		}
+		return;
+	}
+	users_ready_remove(user);
+	if (next_connect != INT_MAX) {
+		user->ready_wakeup.time = next_connect;
+		priorityq_add(users_ready_wakeups, &user->ready_wakeup.item);
+	}
+}
+
+static int user_ready_wakeup_cmp(const void *p1, const void *p2)
+{
+	const struct user_ready_wakeup *w1 = p1, *w2 = p2;
+
+	if (w1->time < w2->time)
+		return -1;
+	return w1->time > w2->time ? 1 : 0;
+}
+
+static void users_ready_wakeup(void)
+{
+	struct user_ready_wakeup *wakeup;
+
+	while ((wakeup = (struct user_ready_wakeup *)
+		priorityq_peek(users_ready_wakeups)) != NULL &&
+	       wakeup->time <= ioloop_time)
+		user_update_ready(wakeup->user);
+}
+
 bool user_get_random(struct mailbox_source *source, struct user **user_r)
 {
-	struct user *const *u;
-	unsigned int start_idx, i, count;
+	struct user *user;
+	unsigned int count;
 
 	if (users_profile == NULL) {
 		*user_r = user_get_random_from_conf(source);
 		return TRUE;
 	}
 
-	u = array_get(&users, &count);
-	start_idx = i_rand_limit(count);
-	for (i = 0; i < count; i++) {
-		unsigned int idx = (i + start_idx) % count;
-		if (user_can_connect_clients(u[idx])) {
-			*user_r = u[idx];
+	users_ready_wakeup();
+	while ((count = array_count(&users_ready)) > 0) {
+		user = *array_idx(&users_ready, i_rand_limit(count));
+		if (user_can_connect_clients(user)) {
+			*user_r = user;
 			return TRUE;
 		}
+		/* the user's state changed without an update */
+		user_update_ready(user);
 	}
 	return FALSE;
 }
@@ -156,6 +238,7 @@ void user_add_client(struct user *user, struct client *client)
 	array_append(&client->user_client->clients, &client, 1);
 	if (user->active_client == NULL)
 		user->active_client = client->user_client;
+	user_update_ready(user);
 }
 
 static void user_update_active_client(struct user *user)
@@ -190,6 +273,7 @@ void user_remove_client(struct user *user, struct client *client)
 			array_delete(&client->user_client->clients, i, 1);
 			if (count == 1 && user->active_client == client->user_client)
 				user_update_active_client(user);
+			user_update_ready(user);
 			return;
 		}
 	}
@@ -304,15 +388,8 @@ user_get_mailbox_cache(struct user_client *uc, const char *name)
 	return mailbox;
 }
 
-static int users_min_timestamp_cmp(struct user *const *u1,
-				   struct user *const *u2)
+const ARRAY_TYPE(user) *users_get_all(void)
 {
-	return (*u1)->next_min_timestamp - (*u2)->next_min_timestamp;
-}
-
-const ARRAY_TYPE(user) *users_get_sort_by_min_timestamp(void)
-{
-	array_sort(&users, users_min_timestamp_cmp);
 	return &users;
 }
 
@@ -330,6 +407,10 @@ void users_free_all(void)
 	hash_table_clear(users_hash, FALSE);
 	if (array_is_created(&users))
 		array_clear(&users);
+	if (users_ready_wakeups != NULL) {
+		while (priorityq_pop(users_ready_wakeups) != NULL) ;
+		array_clear(&users_ready);
+	}
 }
 
 void users_init(struct profile *profile, struct mailbox_source *source)
@@ -337,8 +418,11 @@ void users_init(struct profile *profile, struct mailbox_source *source)
 	hash_table_create(&users_hash, default_pool, 0, str_hash, strcmp);
 	users_profile = profile;
 
-	if (profile != NULL)
+	if (profile != NULL) {
+		i_array_init(&users_ready, 128);
+		users_ready_wakeups = priorityq_init(user_ready_wakeup_cmp, 128);
 		profile_add_users(profile, &users, source);
+	}
 }
 
 void users_deinit(void)
@@ -348,4 +432,8 @@ void users_deinit(void)
 	hash_table_destroy(&users_hash);
 	if (array_is_created(&users))
 		array_free(&users);
+	if (users_ready_wakeups != NULL) {
+		array_free(&users_ready);
+		priorityq_deinit(&users_ready_wakeups);
+	}
 }
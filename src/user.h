@@ -1,6 +1,8 @@
 #ifndef USER_H
 #define USER_H
 
+#include "priorityq.h"
+
 struct profile;
 struct profile_user;
 
@@ -41,7 +43,17 @@ struct user_client {
 	uint32_t draft_uid;
 };
 
+struct user_ready_wakeup {
+	struct priorityq_item item;
+	struct user *user;
+	/* when the user may be able to connect a client */
+	time_t time;
+};
+
 struct user {
+	/* profile: users are queued by next_run_msecs. This must be the first
+	   field. */
+	struct priorityq_item sched_item;
 	pool_t pool;
 	const char *username;
 	const char *password;
@@ -56,6 +68,15 @@ struct user {
 
 	time_t timestamps[USER_TIMESTAMP_COUNT];
 	time_t next_min_timestamp;
+	/* when to run the user's actions next: next_min_timestamp plus
+	   sched_offset_msecs, which spreads the users within each second */
+	uint64_t next_run_msecs;
+	unsigned int sched_offset_msecs;
+
+	/* profile: index in the ready users array, or UINT_MAX if the user
+	   can't currently connect any clients */
+	unsigned int ready_idx;
+	struct user_ready_wakeup ready_wakeup;
 };
 ARRAY_DEFINE_TYPE(user, struct user *);
 
@@ -67,9 +88,12 @@ void user_remove_client(struct user *user, struct client *client);
 bool user_get_new_client_profile(struct user *user,
 				 struct user_client **user_client_r);
 time_t user_get_next_login_time(struct user *user);
+/* Profile: recheck whether the user can connect new clients. Called
+   automatically when clients are added/removed. */
+void user_update_ready(struct user *user);
 const char *user_get_new_mailbox(struct client *client);
 
-const ARRAY_TYPE(user) *users_get_sort_by_min_timestamp(void);
+const ARRAY_TYPE(user) *users_get_all(void);
 
 struct imap_client *
 user_find_client_by_mailbox(struct user_client *uc, const char *mailbox);
@@ -0,0 +1,370 @@
+/* Copyright (c) 2007-2018 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "buffer.h"
+#include "net.h"
+#include "write-full.h"
+#include "settings.h"
+#include "client.h"
+#include "source-ips.h"
+#include "worker.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+struct worker {
+	unsigned int idx;
+	pid_t pid;
+	int fd;
+
+	struct io *io;
+	struct istream *input;
+	/* the latest statistics received from the worker */
+	struct worker_stats stats;
+	/* connections for each source_ips address */
+	uint32_t *source_ip_conns;
+};
+
+int worker_idx = -1;
+
+static ARRAY(struct worker *) workers = ARRAY_INIT;
+static unsigned int workers_running = 0;
+static int worker_stats_fd = -1;
+
+bool worker_owns_idx(unsigned int idx)
+{
+	return worker_idx < 0 ||
+		idx % conf.workers_count == (unsigned int)worker_idx;
+}
+
+unsigned int worker_client_global_id(unsigned int id)
+{
+	if (worker_idx < 0)
+		return id;
+	return (id - 1) * conf.workers_count + worker_idx + 1;
+}
+
+static void worker_split_range(unsigned int *start, unsigned int *count)
+{
+	unsigned int n = conf.workers_count, idx = worker_idx;
+	unsigned int first = *count * idx / n;
+	unsigned int last = *count * (idx + 1) / n;
+
+	*start += first;
+	*count = last - first;
+}
+
+static void worker_partition_conf(void)
+{
+	const char *const *usernames;
+	ARRAY_TYPE(const_string) own_usernames;
+	unsigned int i, count, n = conf.workers_count;
+
+	conf.clients_count = conf.clients_count / n +
+		((unsigned int)worker_idx < conf.clients_count % n ? 1 : 0);
+	conf.ip_idx = worker_idx % conf.ips_count;
+
+	if (array_is_created(&conf.usernames)) {
+		usernames = array_get(&conf.usernames, &count);
+		i_array_init(&own_usernames, count / n + 1);
+		for (i = 0; i < count; i++) {
+			if (worker_owns_idx(i))
+				array_append(&own_usernames, &usernames[i], 1);
+		}
+		array_free(&conf.usernames);
+		conf.usernames = own_usernames;
+	} else if (conf.users_rand_count >= n) {
+		worker_split_range(&conf.users_rand_start,
+				   &conf.users_rand_count);
+	} else {
+		worker_split_range(&conf.domains_rand_start,
+				   &conf.domains_rand_count);
+	}
+
+	/* don't let all the workers run the same random sequence */
+	srand(rand() + worker_idx);
+}
+
+bool workers_fork(void)
+{
+	struct worker *const *workerp, *worker;
+	unsigned int i;
+	int fd[2];
+	pid_t pid;
+
+	i_array_init(&workers, conf.workers_count);
+	for (i = 0; i < conf.workers_count; i++) {
+		if (pipe(fd) < 0)
+			i_fatal("pipe() failed: %m");
+		fflush(stdout);
+
+		if ((pid = fork()) < 0)
+			i_fatal("fork() failed: %m");
+		if (pid == 0) {
+			/* worker process */
+			i_close_fd(&fd[0]);
+			array_foreach(&workers, workerp) {
+				worker = *workerp;
+				i_close_fd(&worker->fd);
+				i_free(worker);
+			}
+			array_free(&workers);
+
+			worker_idx = i;
+			worker_stats_fd = fd[1];
+			i_set_failure_prefix("worker %u: ", i);
+			worker_partition_conf();
+			return FALSE;
+		}
+		i_close_fd(&fd[1]);
+
+		worker = i_new(struct worker, 1);
+		worker->idx = i;
+		worker->pid = pid;
+		worker->fd = fd[0];
+		array_append(&workers, &worker, 1);
+	}
+	workers_running = conf.workers_count;
+	return TRUE;
+}
+
+static int
+worker_histograms_add(struct histogram *interval, struct histogram *total,
+		      const unsigned char **data, size_t *size)
+{
+	static struct histogram hist;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < STATE_COUNT; i++) {
+		histogram_reset(&hist);
+		if ((ret = histogram_import(&hist, *data, *size)) <= 0)
+			return -1;
+		histogram_merge(&interval[i], &hist);
+		histogram_merge(&total[i], &hist);
+		*data += ret;
+		*size -= ret;
+	}
+	return 0;
+}
+
+static int
+worker_stats_add(struct worker *worker, const unsigned char *data, size_t size)
+{
+	const struct worker_stats *stats = &worker->stats;
+	size_t conns_size = source_ips_count() * sizeof(uint32_t);
+	unsigned int i;
+
+	for (i = 0; i < STATE_COUNT; i++)
+		counters[i] += stats->counters[i];
+	if (worker_histograms_add(latencies, total_latencies,
+				  &data, &size) < 0 ||
+	    worker_histograms_add(response_latencies,
+				  total_response_latencies,
+				  &data, &size) < 0)
+		return -1;
+	if (size != conns_size)
+		return -1;
+	memcpy(worker->source_ip_conns, data, conns_size);
+	return 0;
+}
+
+static int worker_read_stats(struct worker *worker)
+{
+	const unsigned char *data;
+	size_t size, msg_size;
+	int ret;
+
+	ret = i_stream_read_data(worker->input, &data, &size,
+				 sizeof(struct worker_stats) - 1);
+	if (ret <= 0)
+		return ret;
+	memcpy(&worker->stats, data, sizeof(worker->stats));
+
+	msg_size = sizeof(worker->stats) + worker->stats.data_size;
+	ret = i_stream_read_data(worker->input, &data, &size, msg_size - 1);
+	if (ret <= 0)
+		return ret;
+
+	if (worker_stats_add(worker, data + sizeof(worker->stats),
+			     msg_size - sizeof(worker->stats)) < 0) {
+		i_error("worker %u: Received invalid statistics", worker->idx);
+		return -1;
+	}
+	i_stream_skip(worker->input, msg_size);
+	return 1;
+}
+
+static void worker_input(struct worker *worker)
+{
+	int ret;
+
+	while ((ret = worker_read_stats(worker)) > 0) ;
+	if (ret == 0)
+		return;
+
+	if (worker->input->stream_errno != 0) {
+		i_error("worker %u: read() failed: %s", worker->idx,
+			i_stream_get_error(worker->input));
+	}
+	/* worker has finished */
+	io_remove(&worker->io);
+	i_stream_destroy(&worker->input);
+	i_zero(&worker->stats);
+	memset(worker->source_ip_conns, 0,
+	       source_ips_count() * sizeof(uint32_t));
+
+	i_assert(workers_running > 0);
+	if (--workers_running == 0)
+		io_loop_stop(current_ioloop);
+}
+
+void workers_init(void)
+{
+	struct worker *worker;
+
+	array_foreach_elem(&workers, worker) {
+		worker->source_ip_conns =
+			i_new(uint32_t, source_ips_count() + 1);
+		net_set_nonblock(worker->fd, TRUE);
+		worker->input = i_stream_create_fd_autoclose(&worker->fd,
+							      (size_t)-1);
+		worker->io = io_add(i_stream_get_fd(worker->input), IO_READ,
+				    worker_input, worker);
+	}
+}
+
+int workers_deinit(void)
+{
+	struct worker *worker;
+	int status, ret = 0;
+
+	array_foreach_elem(&workers, worker) {
+		if (worker->io != NULL)
+			io_remove(&worker->io);
+		i_stream_destroy(&worker->input);
+
+		if (waitpid(worker->pid, &status, 0) < 0)
+			i_error("waitpid(%ld) failed: %m", (long)worker->pid);
+		else if (WIFSIGNALED(status)) {
+			i_error("worker %u killed by signal %d",
+				worker->idx, WTERMSIG(status));
+			ret = I_MAX(ret, 1);
+		} else if (WIFEXITED(status)) {
+			ret = I_MAX(ret, WEXITSTATUS(status));
+		}
+		i_free(worker->source_ip_conns);
+		i_free(worker);
+	}
+	array_free(&workers);
+	return ret;
+}
+
+unsigned int workers_running_count(void)
+{
+	return workers_running;
+}
+
+void workers_get_client_counts(unsigned int *clients_r,
+			       unsigned int *created_r,
+			       unsigned int *banner_waits_r,
+			       unsigned int *stall_count_r,
+			       unsigned int *rate_backlog_r)
+{
+	struct worker *worker;
+
+	*clients_r = *created_r = *banner_waits_r = *stall_count_r = 0;
+	*rate_backlog_r = 0;
+	array_foreach_elem(&workers, worker) {
+		*clients_r += worker->stats.clients_count;
+		*created_r += worker->stats.clients_created;
+		*banner_waits_r += worker->stats.banner_waits;
+		*stall_count_r += worker->stats.stall_count;
+		*rate_backlog_r += worker->stats.rate_backlog;
+	}
+}
+
+void workers_get_memory_usage(unsigned int *parked_r, uint64_t *memory_r)
+{
+	struct worker *worker;
+
+	*parked_r = 0;
+	*memory_r = 0;
+	array_foreach_elem(&workers, worker) {
+		*parked_r += worker->stats.clients_parked;
+		*memory_r += worker->stats.memory_usage;
+	}
+}
+
+void workers_update_source_ips(void)
+{
+	struct worker *worker;
+	unsigned int i, count = source_ips_count();
+	uint32_t conns;
+
+	for (i = 0; i < count; i++) {
+		conns = 0;
+		array_foreach_elem(&workers, worker)
+			conns += worker->source_ip_conns[i];
+		source_ips_set_connections(i, conns);
+	}
+}
+
+void worker_send_stats(unsigned int banner_waits, unsigned int stall_count,
+		       unsigned int rate_backlog)
+{
+	struct worker_stats stats;
+	buffer_t *buf;
+	unsigned int i, count;
+	uint32_t conns;
+
+	buf = buffer_create_dynamic(pool_datastack_create(), 1024);
+	buffer_append_zero(buf, sizeof(stats));
+
+	i_zero(&stats);
+	for (i = 0; i < STATE_COUNT; i++) {
+		stats.counters[i] = counters[i];
+		total_counters[i] += counters[i];
+		counters[i] = 0;
+
+		histogram_export(&latencies[i], buf);
+		histogram_reset(&latencies[i]);
+	}
+	for (i = 0; i < STATE_COUNT; i++) {
+		histogram_export(&response_latencies[i], buf);
+		histogram_reset(&response_latencies[i]);
+	}
+	count = source_ips_count();
+	for (i = 0; i < count; i++) {
+		conns = source_ips_get_connections(i);
+		buffer_append(buf, &conns, sizeof(conns));
+	}
+	stats.clients_count = clients_count;
+	stats.clients_created = array_count(&clients);
+	stats.banner_waits = banner_waits;
+	stats.stall_count = stall_count;
+	stats.rate_backlog = rate_backlog;
+	stats.clients_parked = clients_parked_count;
+	if (conf.idle_lowmem)
+		stats.memory_usage = clients_get_memory_usage();
+	stats.data_size = buf->used - sizeof(stats);
+	buffer_write(buf, 0, &stats, sizeof(stats));
+
+	if (worker_stats_fd != -1 &&
+	    write_full(worker_stats_fd, buf->data, buf->used) < 0) {
+		if (errno != EPIPE)
+			i_error("write(stats pipe) failed: %m");
+		i_close_fd(&worker_stats_fd);
+	}
+}
+
+void worker_deinit(void)
+{
+	if (worker_stats_fd != -1)
+		i_close_fd(&worker_stats_fd);
+}
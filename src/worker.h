@@ -0,0 +1,57 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include "client-state.h"
+
+/* Statistics sent by each worker process to the parent once per second.
+   Followed by data_size bytes of exported latency histograms (the service
+   times for each state, followed by the response times) and the number of
+   connections for each source_ips address as uint32_t. */
+struct worker_stats {
+	unsigned int counters[STATE_COUNT];
+
+	unsigned int clients_count, clients_created;
+	unsigned int banner_waits, stall_count, rate_backlog;
+	unsigned int clients_parked;
+	uint64_t memory_usage;
+
+	uint32_t data_size;
+};
+
+/* Index of this worker process, or -1 if we're not a worker. */
+extern int worker_idx;
+
+/* Returns TRUE if the user/client with the given index belongs to this
+   process. Always TRUE when not running with workers. */
+bool worker_owns_idx(unsigned int idx);
+/* Returns a client global ID that is unique across all workers. */
+unsigned int worker_client_global_id(unsigned int id);
+
+/* Fork conf.workers_count worker processes. Returns TRUE in the parent and
+   FALSE in the workers, which have their share of the configuration. */
+bool workers_fork(void);
+/* Parent: start reading statistics from the workers. */
+void workers_init(void);
+/* Parent: wait for the workers to exit. Returns the highest exit code. */
+int workers_deinit(void);
+/* Parent: returns the number of workers that haven't yet exited. */
+unsigned int workers_running_count(void);
+/* Parent: returns the client counts last reported by all the workers. */
+void workers_get_client_counts(unsigned int *clients_r,
+			       unsigned int *created_r,
+			       unsigned int *banner_waits_r,
+			       unsigned int *stall_count_r,
+			       unsigned int *rate_backlog_r);
+/* Parent: returns the number of parked clients and the total memory usage
+   of all the workers. */
+void workers_get_memory_usage(unsigned int *parked_r, uint64_t *memory_r);
+/* Parent: update the source_ips connection counts from the workers. */
+void workers_update_source_ips(void);
+
+/* Worker: send the statistics gathered since the previous call to the
+   parent and reset them. */
+void worker_send_stats(unsigned int banner_waits, unsigned int stall_count,
+		       unsigned int rate_backlog);
+void worker_deinit(void);
+
+#endif